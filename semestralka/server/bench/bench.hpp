@@ -0,0 +1,91 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fmt/core.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace prsi::bench {
+
+// compiler must assume the value is used, so the work isn't optimized away
+template <typename T> inline void keep(const T &value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct Result {
+  std::string name_;
+  uint64_t iterations_ = 0; // in one measured batch
+  double ns_per_op_ = 0;    // median of the batches
+  double min_ns_per_op_ = 0;
+  double max_ns_per_op_ = 0;
+};
+
+// Runs each case in batches long enough to be measured reliably, reports
+// time of one call.
+class Runner {
+public:
+  // min_time_s = duration of one batch, repeat = how many batches
+  Runner(double min_time_s, int repeat, std::string filter)
+      : min_time_s_(min_time_s), repeat_(repeat), filter_(std::move(filter)) {}
+
+  // fn is called once per iteration
+  template <typename F> void run(std::string_view name, F &&fn);
+
+  const std::vector<Result> &results() const { return results_; }
+
+private:
+  double min_time_s_;
+  int repeat_;
+  // only cases with this in name are run, empty = all
+  std::string filter_;
+  std::vector<Result> results_;
+
+  template <typename F> static double batch(F &fn, uint64_t iterations) {
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < iterations; i++) {
+      fn();
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(end - start).count();
+  }
+};
+
+template <typename F> void Runner::run(std::string_view name, F &&fn) {
+  if (!filter_.empty() && name.find(filter_) == std::string_view::npos) {
+    return;
+  }
+
+  // grow batch until it is at least a tenth of the target, then scale it
+  uint64_t iterations = 1;
+  double secs = batch(fn, iterations);
+  while (secs < min_time_s_ / 10 && iterations < (1ull << 40)) {
+    iterations *= 10;
+    secs = batch(fn, iterations);
+  }
+  if (secs < min_time_s_) {
+    double scale = min_time_s_ / std::max(secs, 1e-9);
+    iterations = static_cast<uint64_t>(iterations * scale) + 1;
+  }
+
+  std::vector<double> ns;
+  for (int r = 0; r < repeat_; r++) {
+    ns.push_back(batch(fn, iterations) * 1e9 / iterations);
+  }
+  std::sort(ns.begin(), ns.end());
+
+  Result res;
+  res.name_ = name;
+  res.iterations_ = iterations;
+  res.ns_per_op_ = ns[ns.size() / 2];
+  res.min_ns_per_op_ = ns.front();
+  res.max_ns_per_op_ = ns.back();
+  results_.push_back(std::move(res));
+
+  fmt::print(stderr, "{:<36} {:>12.1f} ns/op\n", results_.back().name_,
+             results_.back().ns_per_op_);
+}
+
+} // namespace prsi::bench
@@ -0,0 +1,317 @@
+// Microbenchmarks of the hot paths of protocol, room & player.
+// Prints time of one call of each case as JSON, so runs of different commits
+// can be compared. Progress goes to stderr.
+//
+// usage: bench [--time S] [--repeat N] [--filter TEXT]
+
+#include "../src/bucket.hpp"
+#include "../src/config.hpp"
+#include "../src/logger.hpp"
+#include "../src/player.hpp"
+#include "../src/protocol.hpp"
+#include "../src/room.hpp"
+#include "../src/server.hpp"
+#include "bench.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <fmt/core.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace prsi {
+
+// reaches into the server, so STATE can be built without real clients
+struct Server_Bench {
+  static void add_room(Server &s, Room &r) { s.rooms_.push_back(&r); }
+  static Player_Location where(Server &s, const Player &p) {
+    return s.where_player(p);
+  }
+  // players aren't connected, server must not try to disconnect them
+  static void clear(Server &s) { s.rooms_.clear(); }
+};
+
+} // namespace prsi
+
+using namespace prsi;
+using bench::keep;
+using bench::Runner;
+
+namespace {
+
+constexpr int START_HAND = 4;
+constexpr int MAX_HAND = 9;
+
+// players don't own real sockets, fds only have to differ
+std::unique_ptr<Player> make_player(Server &s, int fd,
+                                    const std::string &nick) {
+  auto p = std::make_unique<Player>(s, fd);
+  p->nick(nick);
+  return p;
+}
+
+// room in game, owns its players as the server slab would
+struct Game {
+  std::unique_ptr<Player> alice_;
+  std::unique_ptr<Player> bob_;
+  std::unique_ptr<Room> room_;
+};
+
+Game make_game(Server &s, int first_fd) {
+  Game g{make_player(s, first_fd, "alice"), make_player(s, first_fd + 1, "bob"),
+         std::make_unique<Room>(START_HAND, MAX_HAND)};
+  g.room_->players() = {g.alice_.get(), g.bob_.get()};
+  for (auto *p : g.room_->players()) {
+    p->location(Player_State::ROOM, g.room_.get());
+  }
+  g.room_->setup_game();
+  g.room_->state(Room_State::PLAYING);
+  return g;
+}
+
+void bench_parse(Runner &run, Server &s) {
+  // what a client sends during a game
+  const std::string one = " PRSI PLAY ZA |\n";
+
+  run.run("parse/single", [&, p = make_player(s, 100, "parse")]() {
+    p->on_received(one.data(), one.size());
+    Tokens msg;
+    Command cmd;
+    keep(p->complete_recv_msg(msg, cmd));
+    keep(msg);
+  });
+
+  // command recognition alone, known & unknown word
+  std::string_view words[] = {"LIST_ROOMS", "PLAY", "HELLO"};
+  size_t w = 0;
+  run.run("parse/command", [&]() {
+    keep(parse_command(words[w]));
+    w = w == 2 ? 0 : w + 1;
+  });
+
+  // one read with many messages, e.g. after a stall
+  std::string pipelined;
+  for (int i = 0; i < 16; i++) {
+    pipelined += i % 2 ? " PRSI PONG |\n" : " PRSI PLAY ZA |\n";
+  }
+  run.run("parse/pipelined_16", [&, p = make_player(s, 101, "parse")]() {
+    p->on_received(pipelined.data(), pipelined.size());
+    Tokens msg;
+    Command cmd;
+    while (p->complete_recv_msg(msg, cmd)) {
+      keep(msg);
+    }
+  });
+
+  // the same PLAY as binary frame: length, opcode, card
+  const std::string frame = {2, static_cast<char>(CMD_PLAY), 0x07};
+  run.run("parse/binary_single", [&, p = make_player(s, 103, "parse")]() {
+    p->binary(true);
+    p->on_received(frame.data(), frame.size());
+    Tokens msg;
+    Command cmd;
+    keep(p->complete_recv_msg(msg, cmd));
+    keep(msg);
+  });
+
+  // message coming in three reads, the delimiter in the last one
+  const std::string parts[] = {" PRS", "I PLAY ", "ZA |\n"};
+  run.run("parse/split_3", [&, p = make_player(s, 102, "parse")]() {
+    Tokens msg;
+    Command cmd;
+    for (const auto &part : parts) {
+      p->on_received(part.data(), part.size());
+      keep(p->complete_recv_msg(msg, cmd));
+    }
+    keep(msg);
+  });
+}
+
+void bench_builders(Runner &run, Server &s) {
+  auto game = make_game(s, 200);
+  auto &room = *game.room_;
+  Server_Bench::add_room(s, room);
+  auto &p = *game.alice_;
+
+  run.run("build/STATE_game", [&]() { keep(Protocol::STATE(s, p)); });
+  // every handler validates the state of the player first
+  run.run("server/where_player", [&]() { keep(Server_Bench::where(s, p)); });
+  run.run("build/ROOM", [&]() { keep(Protocol::ROOM(room)); });
+  run.run("build/HAND", [&]() { keep(Protocol::HAND(p)); });
+  run.run("build/TURN", [&]() { keep(Protocol::TURN(room.current_turn())); });
+
+  std::vector<Room_Summary> rooms;
+  for (int i = 0; i < 10; i++) {
+    rooms.push_back({i, i % 3 ? Room_State::PLAYING : Room_State::OPEN});
+  }
+  run.run("build/ROOMS_10", [&]() { keep(Protocol::ROOMS(rooms)); });
+
+  // what handlers send while nothing changes, only the cache is looked at
+  run.run("build/ROOM_cached", [&]() {
+    keep(Protocol::cached(room.snapshot(), false,
+                          [&]() { return Protocol::ROOM(room); }));
+  });
+
+  // binary connection gets text message encoded as frame
+  auto state = Protocol::STATE(s, p);
+  run.run("build/STATE_game_binary",
+          [&]() { keep(Protocol::to_binary(state)); });
+  auto room_msg = Protocol::ROOM(room);
+  run.run("build/ROOM_binary", [&]() { keep(Protocol::to_binary(room_msg)); });
+
+  Server_Bench::clear(s);
+}
+
+void bench_room(Runner &run, Server &s) {
+  auto alice = make_player(s, 300, "alice");
+  auto bob = make_player(s, 301, "bob");
+
+  run.run("room/setup_game", [&]() {
+    alice->clear_hand();
+    bob->clear_hand();
+    Room r(START_HAND, MAX_HAND);
+    r.players() = {alice.get(), bob.get()};
+    r.setup_game();
+    keep(r.top_card());
+  });
+
+  Room deck(START_HAND, MAX_HAND);
+  deck.generate_deck();
+  run.run("room/shuffle_deck", [&]() { deck.shuffle_deck(); });
+
+  run.run("room/generate_deck", [&]() {
+    Room r(START_HAND, MAX_HAND);
+    r.generate_deck();
+    keep(r);
+  });
+
+  // NOTE: an empty deck is refilled only from the pile, so a fresh deck is
+  // generated every 32 cards, that is included (1/32 of generate_deck)
+  int dealt = 0;
+  auto dealing = std::make_unique<Room>(START_HAND, MAX_HAND);
+  dealing->generate_deck();
+  run.run("room/deal_card", [&]() {
+    if (dealt++ == 32) {
+      dealt = 1;
+      dealing->generate_deck();
+    }
+    keep(dealing->deal_card());
+  });
+
+  // current player always gets a card matching the top, so every play is
+  // legal & hands keep their size, new game every 4096 plays (the extra cards
+  // only wrap the pile around over the deck, which isn't drawn from here)
+  const char ranks[] = {'7', '8', '9', '0', 'J', 'K', 'A'};
+  int played = 0;
+  auto game = make_game(s, 302);
+  run.run("room/play_card", [&]() {
+    if (++played == 4096) {
+      played = 0;
+      game = make_game(s, 302);
+    }
+    auto &room = *game.room_;
+    Card top = room.top_card();
+    Card c(top.suit(), ranks[played % 7]);
+    room.current_player().hand().add(c);
+    keep(room.play_card(c));
+  });
+
+  run.run("room/get_winner", [&]() { keep(game.room_->get_winner()); });
+}
+
+void bench_player(Runner &run, Server &s) {
+  auto p = make_player(s, 400, "hand");
+  for (char rank : {'7', '8', '9', '0', 'J', 'Q', 'K'}) {
+    p->hand().add(Card('Z', rank));
+  }
+  // worst cases of the former list, the whole hand was searched
+  const Card last('Z', 'K');
+  const Card missing('S', 'A');
+
+  run.run("player/have_card_last", [&]() { keep(p->have_card(last)); });
+  run.run("player/have_card_missing", [&]() { keep(p->have_card(missing)); });
+  run.run("player/remove_card", [&]() {
+    p->remove_card(last);
+    p->hand().add(last);
+  });
+
+  // checked for every inbound message, time only moves forward
+  Token_Bucket bucket;
+  auto now = Token_Bucket::Clock::now();
+  const auto interval = std::chrono::milliseconds(10);
+  run.run("player/take_token", [&]() {
+    now += std::chrono::microseconds(5);
+    keep(bucket.take(now, interval, 200));
+  });
+}
+
+void usage() {
+  fmt::print(stderr, "usage: bench [options]\n"
+                     "  --time S       duration of one batch (0.2)\n"
+                     "  --repeat N     batches per case, median is reported "
+                     "(5)\n"
+                     "  --filter TEXT  run only cases containing TEXT\n");
+}
+
+void print_json(const Runner &run) {
+#ifdef __OPTIMIZE__
+  bool optimized = true;
+#else
+  bool optimized = false;
+#endif
+  fmt::print("{{\"optimized\": {}, \"benchmarks\": [", optimized);
+  bool first = true;
+  for (const auto &r : run.results()) {
+    fmt::print("{}\n  {{\"name\": \"{}\", \"iterations\": {}, "
+               "\"ns_per_op\": {:.2f}, \"min_ns_per_op\": {:.2f}, "
+               "\"max_ns_per_op\": {:.2f}}}",
+               first ? "" : ",", r.name_, r.iterations_, r.ns_per_op_,
+               r.min_ns_per_op_, r.max_ns_per_op_);
+    first = false;
+  }
+  fmt::print("\n]}}\n");
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  double time_s = 0.2;
+  int repeat = 5;
+  std::string filter;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) {
+      usage();
+      return arg == "--help" || arg == "-h" ? 0 : 1;
+    }
+    if (arg == "--time") {
+      time_s = std::stod(argv[++i]);
+    } else if (arg == "--repeat") {
+      repeat = std::max(1, std::stoi(argv[++i]));
+    } else if (arg == "--filter") {
+      filter = argv[++i];
+    } else {
+      usage();
+      return 1;
+    }
+  }
+
+  // measured paths shouldn't spend time on logging
+  Config cfg;
+  cfg.log_levels_.fill(LOG_ERROR);
+  Logger::setup(cfg);
+
+  // listens on a random port, no client ever connects
+  cfg.ip_ = "127.0.0.1";
+  cfg.port_ = 0;
+  Server server(cfg);
+
+  Runner run(time_s, repeat, filter);
+  bench_parse(run, server);
+  bench_builders(run, server);
+  bench_room(run, server);
+  bench_player(run, server);
+
+  print_json(run);
+  return 0;
+}
@@ -0,0 +1,251 @@
+// Load generator for the prsi server.
+// Opens many connections, every one plays whole games the way the real
+// client does, and reports throughput, latency & errors.
+//
+// usage: loadgen [--host IP] [--port N] [--clients N] [--threads N]
+//                [--ramp CONN_PER_S] [--think MS] [--churn P] [--abrupt P]
+//                [--duration S] [--timeout MS] [--prefix NICK] [--json]
+
+#include "stats.hpp"
+#include "worker.hpp"
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstdlib>
+#include <fmt/core.h>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <sys/resource.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace prsi::loadgen;
+
+namespace {
+
+void usage() {
+  fmt::print(stderr,
+             "usage: loadgen [options]\n"
+             "  --host IP         server address (127.0.0.1)\n"
+             "  --port N          server port (3750)\n"
+             "  --clients N       connected players (100)\n"
+             "  --threads N       worker threads (cpu count)\n"
+             "  --ramp N          new connections per second (100)\n"
+             "  --think MS        mean pause before each action (100)\n"
+             "  --churn P         reconnects per player & second (0)\n"
+             "  --abrupt P        vanishing players per player & second (0)\n"
+             "  --duration S      how long to run (30)\n"
+             "  --timeout MS      reply timeout (5000)\n"
+             "  --prefix NICK     nick prefix, differ between runs (lg<pid>_)\n"
+             "  --json            print summary as JSON\n");
+}
+
+Options parse(int argc, char **argv) {
+  Options opt;
+  opt.threads_ = std::max(1u, std::thread::hardware_concurrency());
+  opt.prefix_ = "lg" + std::to_string(getpid()) + "_";
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--json") {
+      opt.json_ = true;
+      continue;
+    }
+    if (arg == "--help" || arg == "-h" || i + 1 >= argc) {
+      usage();
+      std::exit(arg == "--help" || arg == "-h" ? 0 : 1);
+    }
+
+    std::string val = argv[++i];
+    if (arg == "--host") {
+      opt.host_ = val;
+    } else if (arg == "--port") {
+      opt.port_ = std::stoi(val);
+    } else if (arg == "--clients") {
+      opt.clients_ = std::stoi(val);
+    } else if (arg == "--threads") {
+      opt.threads_ = std::stoi(val);
+    } else if (arg == "--ramp") {
+      opt.ramp_ = std::stod(val);
+    } else if (arg == "--think") {
+      opt.think_ms_ = std::stoi(val);
+    } else if (arg == "--churn") {
+      opt.churn_ = std::stod(val);
+    } else if (arg == "--abrupt") {
+      opt.abrupt_ = std::stod(val);
+    } else if (arg == "--duration") {
+      opt.duration_s_ = std::stoi(val);
+    } else if (arg == "--timeout") {
+      opt.timeout_ms_ = std::stoi(val);
+    } else if (arg == "--prefix") {
+      opt.prefix_ = val;
+    } else {
+      usage();
+      std::exit(1);
+    }
+  }
+
+  in_addr addr{};
+  if (inet_pton(AF_INET, opt.host_.c_str(), &addr) != 1) {
+    throw std::runtime_error("Host must be IPv4 address: " + opt.host_);
+  }
+  if (opt.clients_ < 1 || opt.threads_ < 1 || opt.ramp_ <= 0) {
+    throw std::runtime_error("Clients, threads & ramp must be positive.");
+  }
+  opt.threads_ = std::min(opt.threads_, opt.clients_);
+  return opt;
+}
+
+// thousands of sockets need more than the default limit
+void raise_fd_limit() {
+  rlimit rl{};
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+void total(const std::vector<std::unique_ptr<Worker>> &workers,
+           Counters &sum) {
+  for (auto &w : workers) {
+    sum.add(w->counters());
+  }
+}
+
+uint64_t get(const std::atomic<uint64_t> &v) {
+  return v.load(std::memory_order_relaxed);
+}
+
+void print_text(const Counters &c, const std::array<Histogram, REQ_COUNT> &lat,
+                double secs) {
+  fmt::print("\n== summary after {:.1f} s\n", secs);
+  fmt::print("connections   {} total, {} reconnects, {} vanished\n",
+             get(c.connects_), get(c.churns_), get(c.drops_));
+  fmt::print("messages      out {} ({:.0f}/s), in {} ({:.0f}/s)\n",
+             get(c.msgs_out_), get(c.msgs_out_) / secs, get(c.msgs_in_),
+             get(c.msgs_in_) / secs);
+  fmt::print("bytes         out {}, in {}\n", get(c.bytes_out_),
+             get(c.bytes_in_));
+  fmt::print("games         {} ({:.2f}/s)\n", get(c.games_),
+             get(c.games_) / secs);
+  fmt::print("errors        connect {}, closed by server {}, timeout {}, "
+             "protocol {}\n",
+             get(c.connect_errors_), get(c.server_closed_), get(c.timeouts_),
+             get(c.protocol_errors_));
+  fmt::print("FAIL replies  {}\n", get(c.fails_));
+
+  fmt::print("\nlatency [ms]  {:>8} {:>8} {:>8} {:>8} {:>8} {:>8}\n", "count",
+             "p50", "p90", "p99", "p99.9", "max");
+  for (int r = 0; r < REQ_COUNT; r++) {
+    const auto &h = lat[r];
+    if (h.count() == 0) {
+      continue;
+    }
+    fmt::print("{:<13} {:>8} {:>8.2f} {:>8.2f} {:>8.2f} {:>8.2f} {:>8.2f}\n",
+               request_name(static_cast<Request>(r)), h.count(),
+               h.percentile(0.5) / 1e3, h.percentile(0.9) / 1e3,
+               h.percentile(0.99) / 1e3, h.percentile(0.999) / 1e3,
+               h.max() / 1e3);
+  }
+}
+
+void print_json(const Options &opt, const Counters &c,
+                const std::array<Histogram, REQ_COUNT> &lat, double secs) {
+  fmt::print("{{\"clients\": {}, \"threads\": {}, \"seconds\": {:.3f},\n",
+             opt.clients_, opt.threads_, secs);
+  fmt::print(" \"connects\": {}, \"reconnects\": {}, \"vanished\": {},\n",
+             get(c.connects_), get(c.churns_), get(c.drops_));
+  fmt::print(" \"msgs_out\": {}, \"msgs_in\": {}, \"bytes_out\": {}, "
+             "\"bytes_in\": {}, \"games\": {},\n",
+             get(c.msgs_out_), get(c.msgs_in_), get(c.bytes_out_),
+             get(c.bytes_in_), get(c.games_));
+  fmt::print(" \"errors\": {{\"connect\": {}, \"server_closed\": {}, "
+             "\"timeout\": {}, \"protocol\": {}}}, \"fails\": {},\n",
+             get(c.connect_errors_), get(c.server_closed_), get(c.timeouts_),
+             get(c.protocol_errors_), get(c.fails_));
+  fmt::print(" \"latency_us\": {{");
+  bool first = true;
+  for (int r = 0; r < REQ_COUNT; r++) {
+    const auto &h = lat[r];
+    if (h.count() == 0) {
+      continue;
+    }
+    fmt::print("{}\n  \"{}\": {{\"count\": {}, \"p50\": {}, \"p90\": {}, "
+               "\"p99\": {}, \"p999\": {}, \"max\": {}}}",
+               first ? "" : ",", request_name(static_cast<Request>(r)),
+               h.count(), h.percentile(0.5), h.percentile(0.9),
+               h.percentile(0.99), h.percentile(0.999), h.max());
+    first = false;
+  }
+  fmt::print("}}}}\n");
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  Options opt;
+  try {
+    opt = parse(argc, argv);
+  } catch (const std::exception &ex) {
+    fmt::print(stderr, "{}\n", ex.what());
+    return 1;
+  }
+  raise_fd_limit();
+
+  // players split evenly, the first workers take the remainder
+  std::vector<std::unique_ptr<Worker>> workers;
+  int first = 0;
+  for (int i = 0; i < opt.threads_; i++) {
+    int count = opt.clients_ / opt.threads_ + (i < opt.clients_ % opt.threads_);
+    workers.emplace_back(std::make_unique<Worker>(opt, i, first, count));
+    first += count;
+  }
+
+  std::atomic<bool> stop{false};
+  std::vector<std::thread> threads;
+  for (auto &w : workers) {
+    threads.emplace_back([&w, &stop]() { w->run(stop); });
+  }
+
+  // progress every second, to stderr so JSON stays clean
+  auto start = std::chrono::steady_clock::now();
+  uint64_t last_out = 0;
+  uint64_t last_in = 0;
+  for (int s = 1; s <= opt.duration_s_; s++) {
+    std::this_thread::sleep_until(start + std::chrono::seconds(s));
+    Counters c;
+    total(workers, c);
+    fmt::print(stderr,
+               "[{:>4}s] conns {:>6} | out {:>7}/s in {:>7}/s | games {:>6} | "
+               "errors {}\n",
+               s, get(c.connected_), get(c.msgs_out_) - last_out,
+               get(c.msgs_in_) - last_in, get(c.games_), c.errors());
+    last_out = get(c.msgs_out_);
+    last_in = get(c.msgs_in_);
+  }
+
+  stop.store(true);
+  for (auto &t : threads) {
+    t.join();
+  }
+  double secs = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+
+  std::array<Histogram, REQ_COUNT> lat;
+  for (auto &w : workers) {
+    for (int r = 0; r < REQ_COUNT; r++) {
+      lat[r].merge(w->latency()[r]);
+    }
+  }
+  Counters c;
+  total(workers, c);
+
+  if (opt.json_) {
+    print_json(opt, c, lat, secs);
+  } else {
+    print_text(c, lat, secs);
+  }
+  return c.errors() == 0 ? 0 : 2;
+}
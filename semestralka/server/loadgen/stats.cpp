@@ -0,0 +1,115 @@
+#include "stats.hpp"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+
+namespace prsi::loadgen {
+
+const char *request_name(Request r) {
+  switch (r) {
+  case REQ_NAME:
+    return "NAME";
+  case REQ_LIST_ROOMS:
+    return "LIST_ROOMS";
+  case REQ_CREATE_ROOM:
+    return "CREATE_ROOM";
+  case REQ_JOIN_ROOM:
+    return "JOIN_ROOM";
+  case REQ_ROOM_INFO:
+    return "ROOM_INFO";
+  case REQ_STATE:
+    return "STATE";
+  case REQ_PLAY:
+    return "PLAY";
+  case REQ_DRAW:
+    return "DRAW";
+  case REQ_LEAVE_ROOM:
+    return "LEAVE_ROOM";
+  case REQ_COUNT:
+    break;
+  }
+  return "NONE";
+}
+
+void Histogram::record(uint64_t value) {
+  buckets_[index(value)]++;
+  count_++;
+  max_ = std::max(max_, value);
+}
+
+void Histogram::merge(const Histogram &other) {
+  for (size_t i = 0; i < buckets_.size(); i++) {
+    buckets_[i] += other.buckets_[i];
+  }
+  count_ += other.count_;
+  max_ = std::max(max_, other.max_);
+}
+
+uint64_t Histogram::percentile(double q) const {
+  if (count_ == 0) {
+    return 0;
+  }
+
+  auto rank = static_cast<uint64_t>(std::ceil(q * count_));
+  rank = std::clamp<uint64_t>(rank, 1, count_);
+
+  uint64_t seen = 0;
+  for (size_t i = 0; i < buckets_.size(); i++) {
+    seen += buckets_[i];
+    if (seen >= rank) {
+      return std::min(upper(i), max_);
+    }
+  }
+  return max_;
+}
+
+size_t Histogram::index(uint64_t value) {
+  // small values are exact
+  if (value < SUB) {
+    return value;
+  }
+  // group by highest bit, then SUB_BITS bits below it pick the bucket
+  size_t msb = std::bit_width(value) - 1;
+  size_t shift = msb - SUB_BITS;
+  size_t sub = (value >> shift) - SUB;
+  return (shift + 1) * SUB + sub;
+}
+
+uint64_t Histogram::upper(size_t index) {
+  if (index < SUB) {
+    return index;
+  }
+  size_t shift = index / SUB - 1;
+  size_t sub = index % SUB;
+  return ((SUB + sub + 1) << shift) - 1;
+}
+
+void Counters::add(const Counters &o) {
+  auto sum = [](std::atomic<uint64_t> &to, const std::atomic<uint64_t> &from) {
+    to.fetch_add(from.load(std::memory_order_relaxed),
+                 std::memory_order_relaxed);
+  };
+  sum(connected_, o.connected_);
+  sum(connects_, o.connects_);
+  sum(msgs_out_, o.msgs_out_);
+  sum(msgs_in_, o.msgs_in_);
+  sum(bytes_out_, o.bytes_out_);
+  sum(bytes_in_, o.bytes_in_);
+  sum(games_, o.games_);
+  sum(churns_, o.churns_);
+  sum(drops_, o.drops_);
+  sum(connect_errors_, o.connect_errors_);
+  sum(server_closed_, o.server_closed_);
+  sum(timeouts_, o.timeouts_);
+  sum(fails_, o.fails_);
+  sum(protocol_errors_, o.protocol_errors_);
+}
+
+uint64_t Counters::errors() const {
+  return connect_errors_.load(std::memory_order_relaxed) +
+         server_closed_.load(std::memory_order_relaxed) +
+         timeouts_.load(std::memory_order_relaxed) +
+         protocol_errors_.load(std::memory_order_relaxed);
+}
+
+} // namespace prsi::loadgen
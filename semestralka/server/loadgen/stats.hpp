@@ -0,0 +1,76 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace prsi::loadgen {
+
+// requests which get a direct reply, latency is measured for each
+enum Request {
+  REQ_NAME,
+  REQ_LIST_ROOMS,
+  REQ_CREATE_ROOM,
+  REQ_JOIN_ROOM,
+  REQ_ROOM_INFO,
+  REQ_STATE,
+  REQ_PLAY,
+  REQ_DRAW,
+  REQ_LEAVE_ROOM,
+  REQ_COUNT, // also = no request pending
+};
+
+const char *request_name(Request r);
+
+// Latency histogram with logarithmic buckets (~3 % precision), no allocation.
+// Values are in microseconds.
+class Histogram {
+public:
+  void record(uint64_t value);
+  void merge(const Histogram &other);
+
+  uint64_t count() const { return count_; }
+  uint64_t max() const { return max_; }
+  // q in <0, 1>, returns upper bound of the bucket where it lies
+  uint64_t percentile(double q) const;
+
+private:
+  // each power of two is split into this many buckets
+  static constexpr size_t SUB = 32;
+  static constexpr size_t SUB_BITS = 5;
+  std::array<uint64_t, 64 * SUB> buckets_{};
+  uint64_t count_ = 0;
+  uint64_t max_ = 0;
+
+  static size_t index(uint64_t value);
+  static uint64_t upper(size_t index);
+};
+
+// Counters of one worker thread, read by main thread for progress report.
+struct Counters {
+  std::atomic<uint64_t> connected_{0}; // currently open sockets
+  std::atomic<uint64_t> connects_{0};
+  std::atomic<uint64_t> msgs_out_{0};
+  std::atomic<uint64_t> msgs_in_{0};
+  std::atomic<uint64_t> bytes_out_{0};
+  std::atomic<uint64_t> bytes_in_{0};
+  std::atomic<uint64_t> games_{0}; // finished games (counted by the winner)
+  std::atomic<uint64_t> churns_{0}; // reconnects with the same nick
+  std::atomic<uint64_t> drops_{0};  // players who vanished for good
+  // FAIL replies, e.g. room limit reached, not an error of the server
+  std::atomic<uint64_t> fails_{0};
+
+  // errors
+  std::atomic<uint64_t> connect_errors_{0};
+  std::atomic<uint64_t> server_closed_{0};
+  std::atomic<uint64_t> timeouts_{0};
+  std::atomic<uint64_t> protocol_errors_{0};
+
+  // add relaxed snapshot of other counters
+  void add(const Counters &other);
+  // sum of the errors, FAIL replies are not included
+  uint64_t errors() const;
+};
+
+} // namespace prsi::loadgen
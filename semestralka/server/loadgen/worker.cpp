@@ -0,0 +1,699 @@
+#include "worker.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdexcept>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace prsi::loadgen {
+
+namespace {
+
+uint64_t event_data(uint32_t idx, uint32_t gen) {
+  return static_cast<uint64_t>(gen) << 32 | idx;
+}
+
+// split message into words, without magic
+// false = doesn't start with magic
+bool split(std::string_view msg, std::vector<std::string_view> &words) {
+  words.clear();
+  size_t i = 0;
+  while (i < msg.size()) {
+    while (i < msg.size() && std::isspace(static_cast<unsigned char>(msg[i]))) {
+      i++;
+    }
+    size_t start = i;
+    while (i < msg.size() &&
+           !std::isspace(static_cast<unsigned char>(msg[i]))) {
+      i++;
+    }
+    if (i > start) {
+      words.push_back(msg.substr(start, i - start));
+    }
+  }
+
+  if (words.empty() || words.front() != "PRSI") {
+    return false;
+  }
+  words.erase(words.begin());
+  return true;
+}
+
+int to_int(std::string_view word) {
+  int value = -1;
+  std::from_chars(word.data(), word.data() + word.size(), value);
+  return value;
+}
+
+} // namespace
+
+Worker::Worker(const Options &opt, int id, int first_bot, int bots)
+    : opt_(opt), id_(id), bots_(bots), rng_(std::random_device{}()) {
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd_ == -1) {
+    throw std::runtime_error("Cannot create epoll.");
+  }
+
+  for (int i = 0; i < bots; i++) {
+    auto &b = bots_[i];
+    b.id_ = first_bot + i;
+    b.nick_ = opt_.prefix_ + std::to_string(b.id_);
+    b.creator_ = b.id_ % 2 == 0;
+  }
+}
+
+Worker::~Worker() {
+  for (auto &b : bots_) {
+    if (b.fd_ != -1) {
+      close(b.fd_);
+    }
+  }
+  close(epoll_fd_);
+}
+
+void Worker::run(const std::atomic<bool> &stop) {
+  now_ = Clock::now();
+  next_check_ = now_;
+
+  // spread connecting over time, workers take turns
+  for (size_t i = 0; i < bots_.size(); i++) {
+    double order = static_cast<double>(i) * opt_.threads_ + id_;
+    auto delay = std::chrono::duration<double>(order / opt_.ramp_);
+    schedule(i, T_CONNECT,
+             std::chrono::duration_cast<Clock::duration>(delay));
+  }
+
+  epoll_event events[MAX_EVENTS];
+  while (!stop.load(std::memory_order_relaxed)) {
+    // wake up for the nearest timer, but check stop flag regularly
+    int64_t timeout = 100;
+    if (!timers_.empty()) {
+      auto until = std::chrono::duration_cast<std::chrono::milliseconds>(
+          timers_.top().when_ - Clock::now());
+      timeout = std::clamp<int64_t>(until.count(), 0, timeout);
+    }
+
+    int n = epoll_wait(epoll_fd_, events, MAX_EVENTS, timeout);
+    if (n == -1 && errno != EINTR) {
+      throw std::runtime_error("epoll_wait failed.");
+    }
+    now_ = Clock::now();
+
+    for (int i = 0; i < n; i++) {
+      uint32_t idx = events[i].data.u64 & 0xFFFFFFFF;
+      uint32_t gen = events[i].data.u64 >> 32;
+      auto &b = bots_[idx];
+      if (gen != b.gen_) { // socket closed meanwhile
+        continue;
+      }
+
+      if (b.state_ == BOT_CONNECTING) {
+        on_connected(idx);
+        continue;
+      }
+      if (events[i].events & EPOLLOUT) {
+        flush(idx);
+      }
+      if (gen == b.gen_ && events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        on_readable(idx);
+      }
+    }
+
+    run_timers();
+    if (now_ >= next_check_) {
+      check_bots();
+      next_check_ = now_ + std::chrono::milliseconds(250);
+    }
+  }
+
+  for (auto &b : bots_) {
+    if (b.fd_ != -1) {
+      close(b.fd_);
+      b.fd_ = -1;
+    }
+  }
+  counters_.connected_.store(0, std::memory_order_relaxed);
+}
+
+void Worker::schedule(uint32_t idx, Timer_Kind kind, Clock::duration after) {
+  timers_.push({now_ + after, idx, bots_[idx].gen_, kind});
+}
+
+void Worker::schedule_act(uint32_t idx) { schedule(idx, T_ACT, think()); }
+
+void Worker::schedule_chaos(uint32_t idx) {
+  double rate = opt_.churn_ + opt_.abrupt_;
+  if (rate <= 0) {
+    return;
+  }
+  // events come randomly, time between them is exponential
+  std::exponential_distribution<double> dist(rate);
+  auto after = std::chrono::duration<double>(dist(rng_));
+  schedule(idx, T_CHAOS, std::chrono::duration_cast<Clock::duration>(after));
+}
+
+void Worker::run_timers() {
+  while (!timers_.empty() && timers_.top().when_ <= now_) {
+    Timer t = timers_.top();
+    timers_.pop();
+    if (t.gen_ != bots_[t.bot_].gen_) { // player reconnected meanwhile
+      continue;
+    }
+
+    switch (t.kind_) {
+    case T_CONNECT:
+      connect_bot(t.bot_);
+      break;
+    case T_ACT:
+      act(t.bot_);
+      break;
+    case T_CHAOS:
+      chaos(t.bot_);
+      break;
+    }
+  }
+}
+
+void Worker::check_bots() {
+  auto timeout = std::chrono::milliseconds(opt_.timeout_ms_);
+
+  for (uint32_t idx = 0; idx < bots_.size(); idx++) {
+    auto &b = bots_[idx];
+
+    if (b.state_ == BOT_CONNECTING && now_ - b.sent_at_ > timeout) {
+      counters_.connect_errors_.fetch_add(1, std::memory_order_relaxed);
+      disconnect(idx, RETRY, false);
+
+    } else if (b.pending_ != REQ_COUNT && now_ - b.sent_at_ > timeout) {
+      counters_.timeouts_.fetch_add(1, std::memory_order_relaxed);
+      disconnect(idx, RETRY, false);
+
+      // nobody joined or opponent is gone, try another room
+    } else if ((b.state_ == BOT_ROOM || b.state_ == BOT_GAME) &&
+               b.pending_ == REQ_COUNT && now_ - b.progress_at_ > STALL) {
+      b.progress_at_ = now_;
+      send(idx, REQ_LEAVE_ROOM, "LEAVE_ROOM");
+    }
+  }
+}
+
+void Worker::connect_bot(uint32_t idx) {
+  auto &b = bots_[idx];
+
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(opt_.port_);
+  inet_pton(AF_INET, opt_.host_.c_str(), &addr.sin_addr);
+
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    counters_.connect_errors_.fetch_add(1, std::memory_order_relaxed);
+    schedule(idx, T_CONNECT, RETRY);
+    return;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1 &&
+      errno != EINPROGRESS) {
+    close(fd);
+    counters_.connect_errors_.fetch_add(1, std::memory_order_relaxed);
+    schedule(idx, T_CONNECT, RETRY);
+    return;
+  }
+
+  b.fd_ = fd;
+  b.state_ = BOT_CONNECTING;
+  b.sent_at_ = now_;
+
+  // writable = connected (or failed)
+  epoll_event ev{};
+  ev.events = EPOLLOUT;
+  ev.data.u64 = event_data(idx, b.gen_);
+  epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+}
+
+void Worker::on_connected(uint32_t idx) {
+  auto &b = bots_[idx];
+
+  int err = 0;
+  socklen_t len = sizeof(err);
+  getsockopt(b.fd_, SOL_SOCKET, SO_ERROR, &err, &len);
+  if (err != 0) {
+    counters_.connect_errors_.fetch_add(1, std::memory_order_relaxed);
+    disconnect(idx, RETRY, false);
+    return;
+  }
+
+  epoll_event ev{};
+  ev.events = EPOLLIN;
+  ev.data.u64 = event_data(idx, b.gen_);
+  epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, b.fd_, &ev);
+
+  b.state_ = BOT_NAMING;
+  b.progress_at_ = now_;
+  counters_.connected_.fetch_add(1, std::memory_order_relaxed);
+  counters_.connects_.fetch_add(1, std::memory_order_relaxed);
+
+  send(idx, REQ_NAME, "NAME " + b.nick_);
+  schedule_chaos(idx);
+}
+
+void Worker::disconnect(uint32_t idx, Clock::duration reconnect_after,
+                        bool new_nick) {
+  auto &b = bots_[idx];
+
+  if (b.fd_ != -1) { // closing removes it from epoll too
+    close(b.fd_);
+    b.fd_ = -1;
+  }
+  if (b.state_ != BOT_OFFLINE && b.state_ != BOT_CONNECTING) {
+    counters_.connected_.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  b.gen_++;
+  b.state_ = BOT_OFFLINE;
+  b.in_.clear();
+  b.out_.clear();
+  b.want_out_ = false;
+  b.hand_.clear();
+  b.top_.clear();
+  b.played_.clear();
+  b.my_turn_ = false;
+  b.pending_ = REQ_COUNT;
+  b.empty_lists_ = 0;
+
+  if (new_nick) {
+    b.nick_serial_++;
+    b.nick_ = opt_.prefix_ + std::to_string(b.id_) + "r" +
+              std::to_string(b.nick_serial_);
+  }
+
+  schedule(idx, T_CONNECT, reconnect_after);
+}
+
+void Worker::on_readable(uint32_t idx) {
+  auto &b = bots_[idx];
+  uint32_t gen = b.gen_;
+
+  // read everything, messages are processed after
+  bool closed = false;
+  char buff[4096];
+  while (true) {
+    ssize_t n = recv(b.fd_, buff, sizeof(buff), 0);
+    if (n > 0) {
+      counters_.bytes_in_.fetch_add(n, std::memory_order_relaxed);
+      b.in_.append(buff, n);
+      continue;
+    }
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    closed = n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+    break;
+  }
+
+  size_t start = 0;
+  while (true) {
+    size_t end = b.in_.find('|', start);
+    if (end == std::string::npos) {
+      break;
+    }
+    std::string_view msg(b.in_.data() + start, end - start);
+    start = end + 1;
+
+    counters_.msgs_in_.fetch_add(1, std::memory_order_relaxed);
+    if (!split(msg, words_)) {
+      counters_.protocol_errors_.fetch_add(1, std::memory_order_relaxed);
+      continue;
+    }
+    on_message(idx, words_);
+
+    if (b.gen_ != gen) { // disconnected, buffer is gone
+      return;
+    }
+  }
+  b.in_.erase(0, start);
+
+  if (closed) {
+    counters_.server_closed_.fetch_add(1, std::memory_order_relaxed);
+    disconnect(idx, RETRY, false);
+  }
+}
+
+void Worker::flush(uint32_t idx) {
+  auto &b = bots_[idx];
+
+  while (!b.out_.empty()) {
+    ssize_t n = ::send(b.fd_, b.out_.data(), b.out_.size(), MSG_NOSIGNAL);
+    if (n > 0) {
+      counters_.bytes_out_.fetch_add(n, std::memory_order_relaxed);
+      b.out_.erase(0, n);
+      continue;
+    }
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (!b.want_out_) {
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT;
+        ev.data.u64 = event_data(idx, b.gen_);
+        epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, b.fd_, &ev);
+        b.want_out_ = true;
+      }
+      return;
+    }
+
+    counters_.server_closed_.fetch_add(1, std::memory_order_relaxed);
+    disconnect(idx, RETRY, false);
+    return;
+  }
+
+  if (b.want_out_) {
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = event_data(idx, b.gen_);
+    epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, b.fd_, &ev);
+    b.want_out_ = false;
+  }
+}
+
+void Worker::chaos(uint32_t idx) {
+  auto &b = bots_[idx];
+  if (b.state_ == BOT_OFFLINE || b.state_ == BOT_CONNECTING) {
+    return;
+  }
+
+  std::uniform_real_distribution<double> dist(0, opt_.churn_ + opt_.abrupt_);
+  if (dist(rng_) < opt_.abrupt_) {
+    // gone for good, somebody new comes instead
+    counters_.drops_.fetch_add(1, std::memory_order_relaxed);
+    disconnect(idx, think(), true);
+  } else {
+    // e.g. wifi dropped, the same player comes back
+    counters_.churns_.fetch_add(1, std::memory_order_relaxed);
+    disconnect(idx, think(), false);
+  }
+}
+
+void Worker::send(uint32_t idx, Request req, std::string_view body) {
+  auto &b = bots_[idx];
+
+  b.out_ += "PRSI ";
+  b.out_ += body;
+  b.out_ += " |\n";
+  counters_.msgs_out_.fetch_add(1, std::memory_order_relaxed);
+
+  if (req != REQ_COUNT) {
+    b.pending_ = req;
+    b.sent_at_ = Clock::now();
+  }
+
+  if (!b.want_out_) {
+    flush(idx);
+  }
+}
+
+void Worker::reply_received(Bot &b, Request req) {
+  if (b.pending_ != req) { // not a reply, e.g. CARDS after opponent's seven
+    return;
+  }
+  auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+      Clock::now() - b.sent_at_);
+  latency_[req].record(us.count());
+  b.pending_ = REQ_COUNT;
+}
+
+void Worker::on_message(uint32_t idx, Tokens msg) {
+  auto &b = bots_[idx];
+  if (msg.empty()) {
+    counters_.protocol_errors_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  auto kw = msg[0];
+  if (kw == "PING") {
+    send(idx, REQ_COUNT, "PONG");
+    return;
+  }
+  // server is full & closes the connection, try again later
+  if (kw == "FULL") {
+    counters_.server_closed_.fetch_add(1, std::memory_order_relaxed);
+    disconnect(idx, RETRY, false);
+    return;
+  }
+  b.progress_at_ = now_;
+
+  if (kw == "OK" && msg.size() > 1) {
+    if (msg[1] == "NAME") {
+      reply_received(b, REQ_NAME);
+      b.state_ = BOT_LOBBY;
+      // may be reconnect, ask where the player is
+      send(idx, REQ_STATE, "STATE");
+
+    } else if (msg[1] == "CREATE_ROOM" || msg[1] == "JOIN_ROOM") {
+      reply_received(b, msg[1] == "CREATE_ROOM" ? REQ_CREATE_ROOM
+                                                : REQ_JOIN_ROOM);
+      b.state_ = BOT_ROOM;
+      b.empty_lists_ = 0;
+      send(idx, REQ_ROOM_INFO, "ROOM_INFO");
+
+    } else if (msg[1] == "PLAY") {
+      reply_received(b, REQ_PLAY);
+      auto it = std::find(b.hand_.begin(), b.hand_.end(), b.played_);
+      if (it != b.hand_.end()) {
+        b.hand_.erase(it);
+      }
+      b.played_.clear();
+
+    } else if (msg[1] == "LEAVE_ROOM") {
+      reply_received(b, REQ_LEAVE_ROOM);
+      b.state_ = BOT_LOBBY;
+      b.hand_.clear();
+      b.my_turn_ = false;
+      schedule_act(idx);
+
+    } else {
+      counters_.protocol_errors_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return;
+  }
+
+  if (kw == "FAIL" && msg.size() > 1) {
+    counters_.fails_.fetch_add(1, std::memory_order_relaxed);
+    if (msg[1] == "CREATE_ROOM") { // room limit, join somebody else
+      reply_received(b, REQ_CREATE_ROOM);
+      send(idx, REQ_LIST_ROOMS, "LIST_ROOMS");
+    } else if (msg[1] == "JOIN_ROOM") { // somebody was faster
+      reply_received(b, REQ_JOIN_ROOM);
+      b.state_ = BOT_LOBBY;
+      schedule_act(idx);
+    } else {
+      counters_.protocol_errors_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return;
+  }
+
+  if (kw == "ROOMS") { // ROOMS n (id state)*n
+    reply_received(b, REQ_LIST_ROOMS);
+    if (b.state_ != BOT_LOBBY) {
+      return;
+    }
+
+    // pick random open room
+    std::string_view chosen;
+    size_t open = 0;
+    for (size_t i = 2; i + 1 < msg.size(); i += 2) {
+      if (msg[i + 1] == "OPEN" &&
+          std::uniform_int_distribution<size_t>(0, open++)(rng_) == 0) {
+        chosen = msg[i];
+      }
+    }
+
+    if (!chosen.empty()) {
+      send(idx, REQ_JOIN_ROOM, "JOIN_ROOM " + std::string(chosen));
+    } else {
+      b.empty_lists_++;
+      schedule_act(idx);
+    }
+    return;
+  }
+
+  if (kw == "ROOM") { // reply to ROOM_INFO, or to STATE when in room
+    reply_received(b, b.pending_ == REQ_STATE ? REQ_STATE : REQ_ROOM_INFO);
+    if (b.state_ == BOT_LOBBY) {
+      b.state_ = BOT_ROOM;
+    }
+    if (msg.size() > 2 && msg[2] == "FINISHED" && b.state_ != BOT_OVER) {
+      b.state_ = BOT_OVER;
+      schedule_act(idx);
+    }
+    return;
+  }
+
+  if (kw == "STATE") {
+    reply_received(b, REQ_STATE);
+    on_state(idx, msg);
+    return;
+  }
+
+  if (kw == "GAME_START") {
+    b.state_ = BOT_GAME;
+    b.hand_.clear();
+    b.my_turn_ = false;
+    return;
+  }
+
+  if (kw == "HAND" || kw == "CARDS") { // HAND n cards..., CARDS n cards...
+    if (kw == "HAND") {
+      b.hand_.clear();
+    } else {
+      reply_received(b, REQ_DRAW);
+    }
+    for (size_t i = 2; i < msg.size(); i++) {
+      b.hand_.emplace_back(msg[i]);
+    }
+    return;
+  }
+
+  if (kw == "TURN" && msg.size() >= 4) { // TURN name TOP card
+    b.state_ = BOT_GAME;
+    b.top_ = msg[3];
+    b.my_turn_ = msg[1] == b.nick_;
+    if (b.my_turn_) {
+      schedule_act(idx);
+    }
+    return;
+  }
+
+  if (kw == "WIN" || kw == "LOSE") {
+    if (kw == "WIN") {
+      counters_.games_.fetch_add(1, std::memory_order_relaxed);
+    }
+    b.state_ = BOT_OVER;
+    b.my_turn_ = false;
+    schedule_act(idx);
+    return;
+  }
+
+  // only informative for a player who doesn't draw anything
+  if (kw == "PLAYED" || kw == "SKIP" || kw == "DRAWED" || kw == "JOIN" ||
+      kw == "LEAVE" || kw == "SLEEP" || kw == "AWAKE" || kw == "DEAD") {
+    return;
+  }
+
+  counters_.protocol_errors_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Worker::on_state(uint32_t idx, Tokens msg) {
+  auto &b = bots_[idx];
+  if (msg.size() < 2) {
+    counters_.protocol_errors_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  if (msg[1] == "LOBBY") {
+    b.state_ = BOT_LOBBY;
+    b.hand_.clear();
+    schedule_act(idx);
+    return;
+  }
+
+  if (msg[1] != "GAME") {
+    counters_.protocol_errors_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  // STATE GAME ROOM ... HAND n cards... TURN name TOP card
+  b.state_ = BOT_GAME;
+  b.hand_.clear();
+  auto hand = std::find(msg.begin(), msg.end(), "HAND");
+  if (hand != msg.end() && hand + 1 != msg.end()) {
+    int n = to_int(*(hand + 1));
+    for (auto it = hand + 2; it != msg.end() && n-- > 0; ++it) {
+      b.hand_.emplace_back(*it);
+    }
+  }
+
+  auto turn = std::find(msg.begin(), msg.end(), "TURN");
+  if (turn != msg.end() && msg.end() - turn >= 4) {
+    b.top_ = *(turn + 3);
+    b.my_turn_ = *(turn + 1) == b.nick_;
+    if (b.my_turn_) {
+      schedule_act(idx);
+    }
+  }
+}
+
+void Worker::act(uint32_t idx) {
+  auto &b = bots_[idx];
+  if (b.pending_ != REQ_COUNT) { // reply will move it on
+    return;
+  }
+
+  switch (b.state_) {
+  case BOT_LOBBY:
+    // nobody opens rooms, so open one
+    if (b.creator_ || b.empty_lists_ >= 3) {
+      b.empty_lists_ = 0;
+      send(idx, REQ_CREATE_ROOM, "CREATE_ROOM");
+    } else {
+      send(idx, REQ_LIST_ROOMS, "LIST_ROOMS");
+    }
+    break;
+  case BOT_GAME:
+    if (b.my_turn_) {
+      play_turn(idx);
+    }
+    break;
+  case BOT_OVER:
+    send(idx, REQ_LEAVE_ROOM, "LEAVE_ROOM");
+    break;
+  default:
+    break;
+  }
+}
+
+void Worker::play_turn(uint32_t idx) {
+  auto &b = bots_[idx];
+  b.my_turn_ = false;
+
+  // card matching suit or rank, queen fits always so keep it for later
+  const std::string *match = nullptr;
+  const std::string *queen = nullptr;
+  for (const auto &c : b.hand_) {
+    if (c.size() != 2 || b.top_.size() != 2) {
+      continue;
+    }
+    if (c[1] == 'Q') {
+      queen = &c;
+    } else if (c[0] == b.top_[0] || c[1] == b.top_[1]) {
+      match = &c;
+      break;
+    }
+  }
+
+  const std::string *card = match ? match : queen;
+  if (card) {
+    b.played_ = *card;
+    send(idx, REQ_PLAY, "PLAY " + b.played_);
+  } else {
+    send(idx, REQ_DRAW, "DRAW");
+  }
+}
+
+Clock::duration Worker::think() {
+  std::uniform_int_distribution<int> dist(0, 2 * opt_.think_ms_);
+  return std::chrono::milliseconds(dist(rng_));
+}
+
+} // namespace prsi::loadgen
@@ -0,0 +1,160 @@
+#pragma once
+
+#include "stats.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <queue>
+#include <random>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace prsi::loadgen {
+
+using Clock = std::chrono::steady_clock;
+using Tokens = std::span<const std::string_view>;
+
+// command line settings, shared by all workers
+struct Options {
+  std::string host_ = "127.0.0.1";
+  int port_ = 3'750;
+  // how many players are connected at once
+  int clients_ = 100;
+  int threads_ = 1;
+  // new connections per second, over all threads
+  double ramp_ = 100;
+  // mean pause before each action of a player, real one is random 0..2*think
+  int think_ms_ = 100;
+  // per player & second, probability that the socket is dropped & player
+  // reconnects with the same nick
+  double churn_ = 0;
+  // per player & second, probability that the player vanishes without goodbye
+  // & is replaced by a new one
+  double abrupt_ = 0;
+  int duration_s_ = 30;
+  // request without reply in this time is an error
+  int timeout_ms_ = 5'000;
+  // nick = prefix + number, should differ between runs
+  std::string prefix_ = "lg";
+  bool json_ = false;
+};
+
+// what the player is doing right now
+enum Bot_State {
+  BOT_OFFLINE,
+  BOT_CONNECTING,
+  BOT_NAMING, // waiting for OK NAME
+  BOT_LOBBY,
+  BOT_ROOM, // in room, waiting for opponent
+  BOT_GAME,
+  BOT_OVER, // game finished, will leave the room
+};
+
+// One simulated player, plays the way the real client does.
+struct Bot {
+  int id_ = 0; // over all workers
+  int fd_ = -1;
+  // bumped on every disconnect, so old timers & events are ignored
+  uint32_t gen_ = 0;
+  Bot_State state_ = BOT_OFFLINE;
+  std::string nick_;
+  int nick_serial_ = 0;
+  // creators open rooms, others join them
+  bool creator_ = false;
+  int empty_lists_ = 0;
+
+  std::string in_;  // received, message not complete yet
+  std::string out_; // not sent yet, socket was full
+  bool want_out_ = false;
+
+  // game as the player sees it
+  std::vector<std::string> hand_;
+  std::string top_;
+  std::string played_; // waits for OK PLAY
+  bool my_turn_ = false;
+
+  // one request at a time, like a human clicking
+  Request pending_ = REQ_COUNT;
+  Clock::time_point sent_at_;
+  // last message which moved the game, pings don't count
+  Clock::time_point progress_at_;
+};
+
+// Event loop with its own epoll, drives a part of all players.
+class Worker {
+public:
+  Worker(const Options &opt, int id, int first_bot, int bots);
+  ~Worker();
+  // Delete copy/move
+  Worker(const Worker &) = delete;
+  Worker &operator=(const Worker &) = delete;
+
+  void run(const std::atomic<bool> &stop);
+
+  Counters &counters() { return counters_; }
+  const std::array<Histogram, REQ_COUNT> &latency() const { return latency_; }
+
+private:
+  const Options &opt_;
+  int id_;
+  int epoll_fd_ = -1;
+  std::vector<Bot> bots_;
+  std::mt19937_64 rng_;
+
+  Counters counters_;
+  std::array<Histogram, REQ_COUNT> latency_;
+
+  // timers
+  enum Timer_Kind : uint8_t { T_CONNECT, T_ACT, T_CHAOS };
+  struct Timer {
+    Clock::time_point when_;
+    uint32_t bot_;
+    uint32_t gen_;
+    Timer_Kind kind_;
+    bool operator>(const Timer &o) const { return when_ > o.when_; }
+  };
+  std::priority_queue<Timer, std::vector<Timer>, std::greater<>> timers_;
+  Clock::time_point now_;
+  Clock::time_point next_check_;
+  // words of the message being processed
+  std::vector<std::string_view> words_;
+
+  // room waiting for opponent or stuck game is left after this
+  static constexpr auto STALL = std::chrono::seconds(20);
+  // retry after connection failure
+  static constexpr auto RETRY = std::chrono::seconds(1);
+  static constexpr int MAX_EVENTS = 256;
+
+  // timers
+  void schedule(uint32_t idx, Timer_Kind kind, Clock::duration after);
+  void schedule_act(uint32_t idx);
+  void schedule_chaos(uint32_t idx);
+  void run_timers();
+  // timeouts of requests & stalled rooms
+  void check_bots();
+
+  // connection
+  void connect_bot(uint32_t idx);
+  void on_connected(uint32_t idx);
+  // close socket, come back after delay, new_nick = as a different player
+  void disconnect(uint32_t idx, Clock::duration reconnect_after,
+                  bool new_nick);
+  void on_readable(uint32_t idx);
+  void flush(uint32_t idx);
+  void chaos(uint32_t idx);
+
+  // protocol
+  void send(uint32_t idx, Request req, std::string_view body);
+  void on_message(uint32_t idx, Tokens msg);
+  void reply_received(Bot &b, Request req);
+  void act(uint32_t idx);
+  void play_turn(uint32_t idx);
+  void on_state(uint32_t idx, Tokens msg);
+
+  Clock::duration think();
+};
+
+} // namespace prsi::loadgen
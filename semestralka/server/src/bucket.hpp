@@ -0,0 +1,35 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+
+namespace prsi {
+
+// Token bucket of one connection & command class. Instead of counting tokens
+// it keeps the time when the bucket is full again, so nothing has to be
+// refilled & an empty bucket says when its next token comes.
+class Token_Bucket {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  // take one token, false if there is none
+  // interval = time to make one token, burst = size of the bucket
+  bool take(Clock::time_point now, Clock::duration interval, int burst) {
+    auto full = std::max(full_at_, now);
+    if (full - now > interval * (burst - 1)) {
+      return false;
+    }
+    full_at_ = full + interval;
+    return true;
+  }
+
+  // when will be a token in the bucket again
+  Clock::time_point next_token(Clock::duration interval, int burst) const {
+    return full_at_ - interval * (burst - 1);
+  }
+
+private:
+  Clock::time_point full_at_{};
+};
+
+} // namespace prsi
@@ -1,42 +1,117 @@
 #pragma once
 
+#include <array>
+#include <bit>
+#include <cstdint>
 #include <string>
 namespace prsi {
 
+// prsi is played with exactly 32 cards = 4 suits * 8 ranks
+inline constexpr int DECK_SIZE = 32;
+
+// in order of their code
+inline constexpr std::array<char, 4> SUIT_CHARS = {
+    'Z', // zaludy
+    'L', // listy
+    'K', // kule
+    'S', // srdce
+};
+inline constexpr std::array<char, 8> RANK_CHARS = {
+    '7', '8', '9',
+    '0', // 10
+    'J',
+    'Q', // menic
+    'K', 'A',
+};
+
+namespace card_table {
+
+inline constexpr uint8_t NONE = 0xFF;
+
+// char => index in chars, NONE if it isn't there
+template <size_t N>
+constexpr std::array<uint8_t, 256> index_of(const std::array<char, N> &chars) {
+  std::array<uint8_t, 256> t{};
+  t.fill(NONE);
+  for (size_t i = 0; i < N; i++) {
+    t[static_cast<unsigned char>(chars[i])] = i;
+  }
+  return t;
+}
+
+inline constexpr auto SUIT_INDEX = index_of(SUIT_CHARS);
+inline constexpr auto RANK_INDEX = index_of(RANK_CHARS);
+
+} // namespace card_table
+
+// One card packed into its id = suit index * 8 + rank index.
 struct Card {
-  char rank_ = 'N'; // invalid
-  char suit_ = 'N';
-
-  Card() {}
-  Card(char suit, char rank) : rank_(rank), suit_(suit) {}
-
-  bool is_valid() {
-    bool valid_rank = false;
-    switch (rank_) {
-    case '7':
-    case '8':
-    case '9':
-    case '0': // 10
-    case 'J':
-    case 'Q': // menic
-    case 'K':
-    case 'A':
-      valid_rank = true;
-    }
+  static constexpr uint8_t INVALID = 0xFF;
+  uint8_t id_ = INVALID;
 
-    bool valid_suit = false;
-    switch (suit_) {
-    case 'Z': // zaludy
-    case 'L': // listy
-    case 'K': // kule
-    case 'S': // srdce
-      valid_suit = true;
+  constexpr Card() {}
+  constexpr explicit Card(uint8_t id) : id_(id < DECK_SIZE ? id : INVALID) {}
+  // from text form, invalid if either char is unknown
+  constexpr Card(char suit, char rank) {
+    auto s = card_table::SUIT_INDEX[static_cast<unsigned char>(suit)];
+    auto r = card_table::RANK_INDEX[static_cast<unsigned char>(rank)];
+    if (s != card_table::NONE && r != card_table::NONE) {
+      id_ = s << 3 | r;
     }
+  }
 
-    return valid_rank && valid_suit;
+  constexpr bool is_valid() const { return id_ < DECK_SIZE; }
+  // 'N' for invalid card
+  constexpr char suit() const {
+    return is_valid() ? SUIT_CHARS[id_ >> 3] : 'N';
   }
+  constexpr char rank() const { return is_valid() ? RANK_CHARS[id_ & 7] : 'N'; }
 
-  std::string to_string() const { return std::string{suit_} + rank_; }
+  constexpr bool operator==(const Card &o) const { return id_ == o.id_; }
+
+  std::string to_string() const { return std::string{suit()} + rank(); }
+};
+
+// Set of cards, one bit per card id. Iterates in order of ids.
+class Hand {
+public:
+  constexpr bool has(Card c) const { return bits_ & bit(c); }
+  constexpr void add(Card c) { bits_ |= bit(c); }
+  constexpr void remove(Card c) { bits_ &= ~bit(c); }
+  constexpr int size() const { return std::popcount(bits_); }
+  constexpr bool empty() const { return bits_ == 0; }
+  constexpr void clear() { bits_ = 0; }
+
+  class Iterator {
+  public:
+    constexpr explicit Iterator(uint32_t bits) : bits_(bits) {}
+    constexpr Card operator*() const {
+      return Card(static_cast<uint8_t>(std::countr_zero(bits_)));
+    }
+    constexpr Iterator &operator++() {
+      bits_ &= bits_ - 1; // drop the lowest set bit
+      return *this;
+    }
+    constexpr bool operator!=(const Iterator &o) const {
+      return bits_ != o.bits_;
+    }
+
+  private:
+    uint32_t bits_;
+  };
+  constexpr Iterator begin() const { return Iterator(bits_); }
+  constexpr Iterator end() const { return Iterator(0); }
+
+private:
+  uint32_t bits_ = 0;
+
+  // invalid card is never in hand
+  static constexpr uint32_t bit(Card c) {
+    return c.is_valid() ? uint32_t{1} << c.id_ : 0;
+  }
 };
 
+static_assert(Card('S', 'A').id_ == DECK_SIZE - 1);
+static_assert(!Card('H', '7').is_valid());
+
 } // namespace prsi
@@ -0,0 +1,86 @@
+#include "cluster.hpp"
+#include "logger.hpp"
+#include "server.hpp"
+#include <functional>
+#include <thread>
+
+namespace prsi {
+
+Cluster::Cluster(const Config &cfg) {
+  size_ = cfg.reactors_ < 1 ? 1 : cfg.reactors_;
+
+  shards_.reserve(size_);
+  for (int i = 0; i < size_; i++) {
+    shards_.emplace_back(std::make_unique<Server>(cfg, this, i));
+    metrics_.add(&shards_.back()->metrics());
+  }
+
+  if (cfg.metrics_port_ > 0) {
+    endpoint_ = std::make_unique<Metrics_Endpoint>(metrics_, cfg.metrics_ip_,
+                                                   cfg.metrics_port_);
+  }
+}
+
+Cluster::~Cluster() {}
+
+void Cluster::run() {
+  // single reactor - no need for any thread
+  if (shards_.size() == 1) {
+    shards_[0]->run();
+    return;
+  }
+
+  Logger::info("Running {} reactors.", shards_.size());
+
+  std::vector<std::thread> threads;
+  threads.reserve(shards_.size() - 1);
+  for (size_t i = 1; i < shards_.size(); i++) {
+    threads.emplace_back([this, i]() { shards_[i]->run(); });
+  }
+
+  // main thread is the first reactor
+  shards_[0]->run();
+
+  for (auto &t : threads) {
+    t.join();
+  }
+}
+
+void Cluster::post(int shard, Shard_Message &&msg) {
+  shards_[shard]->post(std::move(msg));
+}
+
+void Cluster::pause_accepting(int from) {
+  for (int i = 0; i < size_; i++) {
+    if (i != from && !shards_[i]->accept_paused()) {
+      Shard_Message msg;
+      msg.kind_ = Shard_Message_Kind::ACCEPT_PAUSE;
+      msg.from_ = from;
+      post(i, std::move(msg));
+    }
+  }
+}
+
+void Cluster::resume_accepting(int from) {
+  for (int i = 0; i < size_; i++) {
+    if (i != from && shards_[i]->accept_paused()) {
+      Shard_Message msg;
+      msg.kind_ = Shard_Message_Kind::ACCEPT_RESUME;
+      msg.from_ = from;
+      post(i, std::move(msg));
+    }
+  }
+}
+
+int Cluster::home_shard(const std::string &nick) const {
+  return std::hash<std::string>{}(nick) % size_;
+}
+
+int Cluster::room_shard(int room_id) const {
+  if (room_id < 0) {
+    return 0;
+  }
+  return room_id % size_;
+}
+
+} // namespace prsi
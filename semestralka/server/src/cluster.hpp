@@ -0,0 +1,95 @@
+#pragma once
+
+#include "config.hpp"
+#include "metrics.hpp"
+#include "player.hpp"
+#include "room.hpp"
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace prsi {
+
+class Server; // forward declare
+
+// what the receiving shard should do with handed off player
+enum Handoff_Action {
+  HANDOFF_NAME,  // resolve the nick - new player or reconnect
+  HANDOFF_JOIN,  // join the room owned by receiving shard
+  HANDOFF_LOBBY, // player is coming back home to lobby
+};
+
+enum Shard_Message_Kind {
+  HANDOFF,       // player with socket moves to another shard
+  ROOMS_UPDATE,  // list of rooms on sending shard
+  NICK_GONE,     // player who lived outside of home shard was removed
+  ACCEPT_PAUSE,  // server got full (ADM PAUSE), stop accepting too
+  ACCEPT_RESUME, // place was freed, accept again if paused
+};
+
+// message passed between shards, the only way shards talk to each other
+struct Shard_Message {
+  Shard_Message_Kind kind_;
+  int from_ = -1; // which shard sent it
+
+  // HANDOFF
+  Handoff_Action action_ = HANDOFF_NAME;
+  Player_Transfer player_;
+  int room_id_ = -1;
+  // how many times was the player already handed off for one NAME
+  int hops_ = 0;
+
+  // NICK_GONE, HANDOFF_NAME
+  std::string nick_;
+  // HANDOFF_NAME, session token sent with the nick, may be empty
+  std::string token_;
+
+  // ROOMS_UPDATE
+  std::vector<Room_Summary> rooms_;
+};
+
+// Run one or more servers (shards), each in its own thread with own epoll
+// and own SO_REUSEPORT listen socket, so kernel spreads new connections.
+// Every player and room is owned by exactly one shard:
+// - named player lives on the home shard of its nick (unless in room)
+// - room lives on the shard which created it, the shard is encoded in its id
+// Player moves to the shard of room on join & back home on leave.
+class Cluster {
+public:
+  Cluster(const Config &cfg);
+  ~Cluster();
+
+  // run all shards, block until all of them end
+  void run();
+
+  int size() const { return size_; }
+
+  // deliver message to given shard, thread-safe
+  void post(int shard, Shard_Message &&msg);
+
+  // which shard is home of the nick
+  int home_shard(const std::string &nick) const;
+  // which shard owns the room
+  int room_shard(int room_id) const;
+
+  // players living on all shards, MC limits this sum
+  std::atomic<int> &clients() { return clients_; }
+  // tell other shards to stop accepting, the server is full (ADM PAUSE)
+  void pause_accepting(int from);
+  // wake up other paused shards, a place was freed, thread-safe
+  void resume_accepting(int from);
+
+private:
+  // known before shards are constructed, they need it in setup
+  int size_ = 1;
+  // players stay counted while handed off between shards
+  std::atomic<int> clients_{0};
+  std::vector<std::unique_ptr<Server>> shards_;
+  // metrics of all shards, endpoint only if enabled
+  // NOTE: declared after shards, so the endpoint stops before they are gone
+  Metrics metrics_;
+  std::unique_ptr<Metrics_Endpoint> endpoint_;
+};
+
+} // namespace prsi
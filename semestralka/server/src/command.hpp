@@ -0,0 +1,119 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace prsi {
+
+// commands client can send, index into handler & metric tables
+enum Command : uint8_t {
+  CMD_PONG,
+  CMD_NAME,
+  CMD_LIST_ROOMS,
+  CMD_JOIN_ROOM,
+  CMD_CREATE_ROOM,
+  CMD_LEAVE_ROOM,
+  CMD_ROOM_INFO,
+  CMD_STATE,
+  CMD_PLAY,
+  CMD_DRAW,
+  CMD_PROTO,           // switch to binary protocol, first message only
+  CMD_OK,              // acknowledgment from client, nothing to do
+  CMD_SUBSCRIBE_ROOMS, // push changes of rooms while in lobby
+  CMD_UNKNOWN,         // not a command at all, client is disconnected
+  CMD_COUNT,
+};
+
+// as sent on the wire, index = Command
+inline constexpr std::array<std::string_view, CMD_COUNT> COMMAND_NAMES = {
+    "PONG",       "NAME",      "LIST_ROOMS", "JOIN_ROOM",
+    "CREATE_ROOM", "LEAVE_ROOM", "ROOM_INFO", "STATE",
+    "PLAY",       "DRAW",      "PROTO",      "OK",
+    "SUBSCRIBE_ROOMS", "UNKNOWN",
+};
+
+// commands are rate limited by class, each class has own token bucket
+enum Command_Class : uint8_t {
+  CLASS_CONTROL, // cheap replies & connection setup
+  CLASS_LOBBY,   // rooms & state queries, answered by whole snapshots
+  CLASS_GAME,    // moves in the game
+  CLASS_COUNT,
+};
+
+// index = Command
+inline constexpr std::array<Command_Class, CMD_COUNT> COMMAND_CLASSES = {
+    CLASS_CONTROL, // PONG
+    CLASS_CONTROL, // NAME
+    CLASS_LOBBY,   // LIST_ROOMS
+    CLASS_LOBBY,   // JOIN_ROOM
+    CLASS_LOBBY,   // CREATE_ROOM
+    CLASS_LOBBY,   // LEAVE_ROOM
+    CLASS_LOBBY,   // ROOM_INFO
+    CLASS_LOBBY,   // STATE
+    CLASS_GAME,    // PLAY
+    CLASS_GAME,    // DRAW
+    CLASS_CONTROL, // PROTO
+    CLASS_CONTROL, // OK
+    CLASS_LOBBY,   // SUBSCRIBE_ROOMS
+    CLASS_CONTROL, // UNKNOWN
+};
+
+// Perfect hash of command names. The seed is searched at compile time, so
+// no two commands share a slot & one comparison confirms the match.
+namespace command_hash {
+
+inline constexpr size_t SLOTS = 32;
+
+constexpr size_t hash(std::string_view word, size_t seed) {
+  auto first = static_cast<unsigned char>(word.front());
+  auto last = static_cast<unsigned char>(word.back());
+  return (word.size() + first * seed + last) % SLOTS;
+}
+
+consteval size_t find_seed() {
+  for (size_t seed = 1; seed < 1'000; seed++) {
+    std::array<bool, SLOTS> used{};
+    bool ok = true;
+    for (int c = 0; c < CMD_UNKNOWN && ok; c++) {
+      auto slot = hash(COMMAND_NAMES[c], seed);
+      ok = !used[slot];
+      used[slot] = true;
+    }
+    if (ok) {
+      return seed;
+    }
+  }
+  return 0;
+}
+
+inline constexpr size_t SEED = find_seed();
+static_assert(SEED != 0, "No perfect hash of commands, add SLOTS.");
+
+// slot => command, CMD_UNKNOWN in free slots
+inline constexpr std::array<Command, SLOTS> TABLE = [] {
+  std::array<Command, SLOTS> t{};
+  t.fill(CMD_UNKNOWN);
+  for (int c = 0; c < CMD_UNKNOWN; c++) {
+    t[hash(COMMAND_NAMES[c], SEED)] = static_cast<Command>(c);
+  }
+  return t;
+}();
+
+} // namespace command_hash
+
+// which command is the word, no allocation & at most one string comparison
+constexpr Command parse_command(std::string_view word) {
+  if (word.empty()) {
+    return CMD_UNKNOWN;
+  }
+  Command c = command_hash::TABLE[command_hash::hash(word, command_hash::SEED)];
+  return COMMAND_NAMES[c] == word ? c : CMD_UNKNOWN;
+}
+
+static_assert(parse_command("DRAW") == CMD_DRAW);
+static_assert(parse_command("OK") == CMD_OK);
+static_assert(parse_command("DRAWS") == CMD_UNKNOWN);
+
+} // namespace prsi
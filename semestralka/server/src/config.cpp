@@ -12,7 +12,13 @@ const std::unordered_map<std::string, Config::Setter> Config::setters_ = {
     {"IP", &Config::ip}, {"PORT", &Config::port}, {"EME", &Config::eme},
     {"ET", &Config::et}, {"MC", &Config::mc},     {"PT", &Config::pt},
     {"ST", &Config::st}, {"DT", &Config::dt},     {"MR", &Config::mr},
-    {"KT", &Config::kt}};
+    {"KT", &Config::kt}, {"RT", &Config::rt},     {"IO", &Config::io},
+    {"CORK", &Config::cork}, {"LOG", &Config::log},  {"LM", &Config::lm},
+    {"LQ", &Config::lq},     {"LF", &Config::lf},   {"LL", &Config::ll},
+    {"MP", &Config::mp},     {"MIP", &Config::mip}, {"SES", &Config::ses},
+    {"LB", &Config::lb},     {"AB", &Config::ab},   {"ADM", &Config::adm},
+    {"OS", &Config::os},     {"OH", &Config::oh},   {"RC", &Config::rc},
+    {"RL", &Config::rl},     {"RG", &Config::rg},   {"MB", &Config::mb}};
 
 Config::Config(const std::string &filename) {
   // open file
@@ -43,4 +49,59 @@ Config::Config(const std::string &filename) {
   }
 }
 
+void Config::rate_limit(Command_Class c, const std::string &val) {
+  auto comma = val.find(',');
+  auto &limit = rate_limits_[c];
+  limit.rate_ = std::stoi(val.substr(0, comma));
+  limit.burst_ = comma == std::string::npos ? limit.rate_
+                                            : std::stoi(val.substr(comma + 1));
+  if (limit.rate_ < 0 || limit.burst_ < 0) {
+    throw std::runtime_error("Negative rate limit: " + val);
+  }
+}
+
+void Config::ll(const std::string &val) {
+  // first part is for all, the rest are category=level
+  std::istringstream iss(val);
+  std::string part;
+  bool first = true;
+  while (std::getline(iss, part, ',')) {
+    if (first) {
+      log_levels_.fill(log_level(part));
+      first = false;
+      continue;
+    }
+
+    auto eq = part.find('=');
+    if (eq == std::string::npos) {
+      throw std::runtime_error("Log level override without '=': " + part);
+    }
+    static const std::unordered_map<std::string, Log_Category> categories = {
+        {"GENERAL", LOG_GENERAL},
+        {"NET", LOG_NET},
+        {"PROTOCOL", LOG_PROTOCOL},
+        {"GAME", LOG_GAME},
+        {"TIMER", LOG_TIMER}};
+    auto it = categories.find(to_upper(part.substr(0, eq)));
+    if (it == categories.end()) {
+      throw std::runtime_error("Unknown log category: " + part.substr(0, eq));
+    }
+    log_levels_[it->second] = log_level(part.substr(eq + 1));
+  }
+}
+
+Log_Level Config::log_level(const std::string &val) {
+  auto v = to_upper(val);
+  if (v == "DEBUG") {
+    return LOG_DEBUG;
+  } else if (v == "INFO") {
+    return LOG_INFO;
+  } else if (v == "WARN") {
+    return LOG_WARN;
+  } else if (v == "ERROR") {
+    return LOG_ERROR;
+  }
+  throw std::runtime_error("Unknown log level: " + val);
+}
+
 } // namespace prsi
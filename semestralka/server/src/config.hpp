@@ -1,11 +1,62 @@
 #pragma once
 
+#include "command.hpp"
 #include <algorithm>
+#include <array>
+#include <stdexcept>
 #include <string>
 #include <unordered_map>
 
 namespace prsi {
 
+// how the server waits for sockets & talks to them
+enum Io_Backend {
+  IO_EPOLL, // readiness notification + recv/send syscall per socket
+  IO_URING, // completions, multishot accept/recv, sends submitted in batch
+};
+
+// what happens to connections over the client limit
+enum Admission_Policy {
+  ADMIT_REJECT, // accepted, told FULL & closed right away
+  ADMIT_PAUSE,  // not accepted until somebody leaves, wait in listen backlog
+};
+
+// how log records get to the output
+enum Log_Mode {
+  LOG_SYNC,  // formatted & written by the logging thread, under a mutex
+  LOG_ASYNC, // queued into lock-free ring, written by background thread
+};
+
+// what async logger does when its ring is full
+enum Log_Full_Policy {
+  LOG_DROP,  // record is thrown away & counted, never slows the event loop
+  LOG_BLOCK, // logging thread waits until the writer makes space
+};
+
+// log severities, lower ones are filtered first
+enum Log_Level {
+  LOG_DEBUG,
+  LOG_INFO,
+  LOG_WARN,
+  LOG_ERROR,
+};
+
+// subsystem which logs, each has own minimum level
+enum Log_Category {
+  LOG_GENERAL,  // startup & everything else
+  LOG_NET,      // sockets, epoll/io_uring, connections
+  LOG_PROTOCOL, // malformed or unexpected messages
+  LOG_GAME,     // lobby, rooms & gameplay
+  LOG_TIMER,    // pings, sleep & death timeouts
+  LOG_CATEGORY_COUNT,
+};
+
+// inbound messages of one command class, per connection
+struct Rate_Limit {
+  int rate_ = 0;  // messages per second, 0 = no limit
+  int burst_ = 0; // how many may come at once
+};
+
 class Config {
 public:
   // IP
@@ -19,12 +70,12 @@ public:
   int port_ = 3'750;
   // EME
   // maximum number of events to which the epoll would listen
-  // should be at least 2 * max_clients_ + 1 (listen)
-  // 2 times because each client could have reconnect timer
+  // should be at least max_clients_ + 1 (listen)
   int epoll_max_events_ = 32;
   // ET
-  // in how many miliseconds would epoll_wait() stop be blocking
-  int epoll_timeout_ms_ = 500;
+  // at most how many miliseconds would epoll_wait() be blocking
+  // epoll_wait() is woken up by the nearest timer anyway, so -1 = no limit
+  int epoll_timeout_ms_ = -1;
   // MC
   // how many clients could be connected to the server at once
   // at least 2 are required (one game-room consists of two players)
@@ -47,6 +98,79 @@ public:
   // kic-out timer, in how many ms would you automatic timer kick out of server.
   // currently not used really
   int kick_timer_ms_ = 180'000;
+  // RT
+  // reactor threads - how many event loops run in parallel, each with its own
+  // epoll and listen socket (SO_REUSEPORT), 1 = classic single thread server
+  // NOTE: MC limits all reactors together, players moving between them
+  // keep their place
+  int reactors_ = 1;
+  // IO
+  // I/O backend, EPOLL or URING (io_uring, needs Linux 6.0+)
+  Io_Backend io_backend_ = IO_EPOLL;
+  // CORK
+  // 1 = messages are only queued & each connection is flushed once at the end
+  // of loop iteration, so all replies to one action go in one send
+  bool cork_ = false;
+  // LB
+  // listen backlog, how many connections may wait for accept
+  // NOTE: kernel limits it by net.core.somaxconn
+  int listen_backlog_ = 4'096;
+  // AB
+  // at most how many connections are accepted in one loop iteration, the rest
+  // waits for the next one, so clients already connected aren't held up
+  int accept_batch_ = 64;
+  // ADM
+  // admission of clients over MC, REJECT or PAUSE (see Admission_Policy)
+  Admission_Policy admission_ = ADMIT_REJECT;
+  // OS
+  // soft limit of unsent output of one client in bytes, over it pings are
+  // dropped & only the latest ROOM/ROOMS snapshot is kept, 0 = no limit
+  // (e.g. 64 KiB)
+  int output_soft_limit_ = 0;
+  // OH
+  // hard limit of unsent output of one client in bytes, the client is
+  // disconnected over it, 0 = no limit
+  // on by default, memory of a client who doesn't read must stay bounded
+  int output_hard_limit_ = 1'024 * 1'024;
+  // RC, RL, RG
+  // rate limits of control, lobby & game commands of one client (see
+  // Command_Class), RATE or RATE,BURST, BURST is RATE by default
+  // messages over the limit wait in the buffer until tokens are made
+  // off by default, e.g. RL 100,200 & RG 100,200 never slow a human player
+  std::array<Rate_Limit, CLASS_COUNT> rate_limits_ = {
+      Rate_Limit{0, 0}, Rate_Limit{0, 0}, Rate_Limit{0, 0}};
+  // MB
+  // at most how many messages of one client are processed in one loop
+  // iteration, the rest waits for the next one, 0 = no limit (e.g. 16)
+  int message_budget_ = 0;
+  // SES
+  // 1 = OK NAME carries session token, client reconnecting with NAME nick
+  // token is matched to its player directly
+  bool session_tokens_ = false;
+  // LOG
+  // where to write logs, file is appended to, - = standard error output
+  std::string log_file_ = "-";
+  // LM
+  // log mode, SYNC or ASYNC (background writer thread)
+  Log_Mode log_mode_ = LOG_SYNC;
+  // LQ
+  // how many records the async log ring holds, rounded up to power of two
+  int log_queue_size_ = 8'192;
+  // LF
+  // what to do when the async log ring is full, DROP or BLOCK
+  Log_Full_Policy log_full_policy_ = LOG_DROP;
+  // LL
+  // minimum log level, DEBUG, INFO, WARN or ERROR, optionally followed by
+  // overrides for categories, e.g. WARN,net=DEBUG,game=INFO
+  // categories: general, net, protocol, game, timer
+  std::array<Log_Level, LOG_CATEGORY_COUNT> log_levels_ = {
+      LOG_INFO, LOG_INFO, LOG_INFO, LOG_INFO, LOG_INFO};
+  // MP
+  // port of HTTP endpoint with metrics in Prometheus format, 0 = disabled
+  int metrics_port_ = 0;
+  // MIP
+  // ip address of the metrics endpoint, only local by default
+  std::string metrics_ip_ = "127.0.0.1";
 
 public:
   // load config from file
@@ -70,6 +194,66 @@ private:
   void dt(const std::string &val) { death_timeout_ms_ = std::stoi(val); }
   void mr(const std::string &val) { max_rooms_ = std::stoi(val); }
   void kt(const std::string &val) { kick_timer_ms_ = std::stoi(val); }
+  void rt(const std::string &val) { reactors_ = std::stoi(val); }
+  void cork(const std::string &val) { cork_ = std::stoi(val) != 0; }
+  void ses(const std::string &val) { session_tokens_ = std::stoi(val) != 0; }
+  void lb(const std::string &val) { listen_backlog_ = std::stoi(val); }
+  void ab(const std::string &val) { accept_batch_ = std::stoi(val); }
+  void os(const std::string &val) { output_soft_limit_ = std::stoi(val); }
+  void oh(const std::string &val) { output_hard_limit_ = std::stoi(val); }
+  void rc(const std::string &val) { rate_limit(CLASS_CONTROL, val); }
+  void rl(const std::string &val) { rate_limit(CLASS_LOBBY, val); }
+  void rg(const std::string &val) { rate_limit(CLASS_GAME, val); }
+  void mb(const std::string &val) { message_budget_ = std::stoi(val); }
+  void rate_limit(Command_Class c, const std::string &val);
+  void adm(const std::string &val) {
+    auto v = to_upper(val);
+    if (v == "REJECT") {
+      admission_ = ADMIT_REJECT;
+    } else if (v == "PAUSE") {
+      admission_ = ADMIT_PAUSE;
+    } else {
+      throw std::runtime_error("Unknown admission policy: " + val);
+    }
+  }
+  void io(const std::string &val) {
+    auto v = to_upper(val);
+    if (v == "EPOLL") {
+      io_backend_ = IO_EPOLL;
+    } else if (v == "URING") {
+      io_backend_ = IO_URING;
+    } else {
+      throw std::runtime_error("Unknown I/O backend: " + val);
+    }
+  }
+
+  void log(const std::string &val) { log_file_ = val; }
+  void lm(const std::string &val) {
+    auto v = to_upper(val);
+    if (v == "SYNC") {
+      log_mode_ = LOG_SYNC;
+    } else if (v == "ASYNC") {
+      log_mode_ = LOG_ASYNC;
+    } else {
+      throw std::runtime_error("Unknown log mode: " + val);
+    }
+  }
+  void lq(const std::string &val) { log_queue_size_ = std::stoi(val); }
+  void lf(const std::string &val) {
+    auto v = to_upper(val);
+    if (v == "DROP") {
+      log_full_policy_ = LOG_DROP;
+    } else if (v == "BLOCK") {
+      log_full_policy_ = LOG_BLOCK;
+    } else {
+      throw std::runtime_error("Unknown log full policy: " + val);
+    }
+  }
+
+  void ll(const std::string &val);
+  void mp(const std::string &val) { metrics_port_ = std::stoi(val); }
+  void mip(const std::string &val) { metrics_ip_ = val; }
+  static Log_Level log_level(const std::string &val);
 
   static std::string to_upper(const std::string &s) {
     std::string result = s;
@@ -1,27 +1,268 @@
-
 #include "logger.hpp"
+#include <algorithm>
+#include <bit>
+#include <cerrno>
 #include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
 #include <fmt/chrono.h>
 #include <fmt/core.h>
 #include <fmt/format.h>
-#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <unistd.h>
 namespace prsi {
 
+// one log line, message is formatted by the caller, time by the writer
+struct Log_Record {
+  std::string_view severity_;
+  std::chrono::system_clock::time_point time_;
+  std::string msg_;
+};
+
+// Bounded lock-free queue, many producers & one consumer.
+// Every slot has a sequence number saying whether it is free for producer in
+// this lap (seq == pos), or filled & ready for consumer (seq == pos + 1).
+class Log_Queue {
+public:
+  Log_Queue(size_t capacity)
+      : size_(std::bit_ceil(std::max<size_t>(capacity, 2))),
+        slots_(std::make_unique<Slot[]>(size_)) {
+    for (size_t i = 0; i < size_; i++) {
+      slots_[i].seq_.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // false = queue is full, record is left untouched
+  bool push(Log_Record &&r) {
+    size_t pos = tail_.load(std::memory_order_relaxed);
+    while (true) {
+      Slot &s = slots_[pos & (size_ - 1)];
+      size_t seq = s.seq_.load(std::memory_order_acquire);
+      auto diff = static_cast<std::ptrdiff_t>(seq - pos);
+
+      if (diff == 0) { // free, try to claim it
+        if (tail_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          s.record_ = std::move(r);
+          s.seq_.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) { // consumer didn't take it yet
+        return false;
+      } else { // other producer was faster
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // only the writer thread may call it
+  bool pop(Log_Record &r) {
+    Slot &s = slots_[head_ & (size_ - 1)];
+    if (s.seq_.load(std::memory_order_acquire) != head_ + 1) {
+      return false;
+    }
+    r = std::move(s.record_);
+    s.seq_.store(head_ + size_, std::memory_order_release);
+    head_++;
+    return true;
+  }
+
+  bool empty() const {
+    const Slot &s = slots_[head_ & (size_ - 1)];
+    return s.seq_.load(std::memory_order_acquire) != head_ + 1;
+  }
+
+private:
+  // own cache line each, so producers don't fight over neighbours
+  struct alignas(64) Slot {
+    std::atomic<size_t> seq_;
+    Log_Record record_;
+  };
+
+  size_t size_;
+  std::unique_ptr<Slot[]> slots_;
+  alignas(64) std::atomic<size_t> tail_{0};
+  alignas(64) size_t head_ = 0;
+};
+
 std::mutex Logger::log_mutex_;
+int Logger::out_fd_ = STDERR_FILENO;
+Log_Full_Policy Logger::full_policy_ = LOG_DROP;
+std::unique_ptr<Log_Queue> Logger::queue_;
+std::thread Logger::writer_;
+std::atomic<bool> Logger::running_{false};
+std::atomic<bool> Logger::sleeping_{false};
+std::atomic<uint64_t> Logger::dropped_{0};
+std::array<std::atomic<uint8_t>, LOG_CATEGORY_COUNT> Logger::levels_ = {
+    LOG_INFO, LOG_INFO, LOG_INFO, LOG_INFO, LOG_INFO};
 
-std::string get_formatted_time() {
-  auto now = std::chrono::system_clock::now();
+namespace {
 
-  return fmt::format("{:%F %T}", now);
+// formatting wall-clock time is expensive, do it once per second
+struct Time_Cache {
+  std::chrono::sys_seconds second_{};
+  std::string text_;
+
+  std::string_view get(std::chrono::system_clock::time_point time) {
+    auto sec = std::chrono::floor<std::chrono::seconds>(time);
+    if (text_.empty() || sec != second_) {
+      second_ = sec;
+      text_ = fmt::format("{:%F %T}", sec);
+    }
+    return text_;
+  }
+};
+
+void format_record(std::string &out, Time_Cache &cache,
+                   std::string_view severity,
+                   std::chrono::system_clock::time_point time,
+                   std::string_view msg) {
+  fmt::format_to(std::back_inserter(out), "[{} | {}] {}\n", severity,
+                 cache.get(time), msg);
 }
 
-void Logger::log(std::string_view severity, std::string_view msg) {
+// writer batches up to this much before calling write
+constexpr size_t BATCH_SIZE = 64 * 1024;
+
+} // namespace
+
+void Logger::log(std::string_view severity, std::string &&msg) {
+  auto now = std::chrono::system_clock::now();
+
+  if (running_.load(std::memory_order_acquire)) {
+    Log_Record r{severity, now, std::move(msg)};
+    while (!queue_->push(std::move(r))) {
+      if (full_policy_ == LOG_DROP) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      wake_writer(); // LOG_BLOCK
+      std::this_thread::yield();
+    }
+    wake_writer();
+    return;
+  }
+
   std::lock_guard<std::mutex> lock(log_mutex_);
+  static Time_Cache cache;
+  static std::string line;
+
+  line.clear();
+  format_record(line, cache, severity, now, msg);
+  write_out(line);
+}
 
-  std::string formatted_log =
-      fmt::format("[{} | {}] {}", severity, get_formatted_time(), msg);
+bool Log_Limit::allow(uint64_t &suppressed) {
+  int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch())
+                    .count();
+  int64_t next = next_ms_.load(std::memory_order_relaxed);
+
+  // only one thread wins the interval
+  if (now < next || !next_ms_.compare_exchange_strong(
+                        next, now + interval_ms_, std::memory_order_relaxed)) {
+    suppressed_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  suppressed = suppressed_.exchange(0, std::memory_order_relaxed);
+  return true;
+}
+
+void Logger::setup(const Config &cfg) {
+  for (size_t i = 0; i < levels_.size(); i++) {
+    levels_[i].store(cfg.log_levels_[i], std::memory_order_relaxed);
+  }
+
+  if (cfg.log_file_ != "-") {
+    int fd = open(cfg.log_file_.c_str(),
+                  O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+      throw std::runtime_error("Cannot open log file " + cfg.log_file_ +
+                               ": " + std::strerror(errno));
+    }
+    out_fd_ = fd;
+  }
+
+  if (cfg.log_mode_ != LOG_ASYNC || running_.load()) {
+    return;
+  }
+
+  full_policy_ = cfg.log_full_policy_;
+  queue_ = std::make_unique<Log_Queue>(cfg.log_queue_size_);
+  running_.store(true, std::memory_order_release);
+  writer_ = std::thread(&Logger::write_loop);
+  // server runs until killed, but normal exit should not lose anything
+  std::atexit(&Logger::shutdown);
+}
+
+void Logger::shutdown() {
+  if (!running_.exchange(false)) {
+    return;
+  }
+  sleeping_.store(true); // force the notify
+  wake_writer();
+  writer_.join();
+}
+
+void Logger::write_loop() {
+  Time_Cache cache;
+  std::string batch;
+  batch.reserve(BATCH_SIZE);
+  Log_Record r;
+
+  while (true) {
+    while (batch.size() < BATCH_SIZE && queue_->pop(r)) {
+      format_record(batch, cache, r.severity_, r.time_, r.msg_);
+    }
+
+    uint64_t dropped = dropped_.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0) {
+      format_record(batch, cache, "WARN", std::chrono::system_clock::now(),
+                    fmt::format("Log queue full, dropped {} records.",
+                                dropped));
+    }
+
+    if (!batch.empty()) {
+      write_out(batch);
+      batch.clear();
+      continue;
+    }
+
+    if (!running_.load(std::memory_order_acquire)) {
+      return; // everything is written
+    }
+
+    // nothing to do, sleep until some producer pushes
+    sleeping_.store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (queue_->empty() && running_.load()) {
+      sleeping_.wait(true);
+    }
+    sleeping_.store(false);
+  }
+}
+
+void Logger::wake_writer() {
+  // pairs with the fence in write_loop, so no wakeup is lost
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleeping_.load(std::memory_order_relaxed) && sleeping_.exchange(false)) {
+    sleeping_.notify_one();
+  }
+}
 
-  std::cerr << formatted_log << '\n';
+void Logger::write_out(std::string_view data) {
+  while (!data.empty()) {
+    ssize_t n = write(out_fd_, data.data(), data.size());
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return; // nowhere to report it
+    }
+    data.remove_prefix(n);
+  }
 }
 
 } // namespace prsi
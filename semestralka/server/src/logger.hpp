@@ -1,12 +1,25 @@
 #pragma once
 
+#include "config.hpp"
 #include "player.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
 #include <fmt/format.h>
+#include <iterator>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <string_view>
+#include <thread>
+
+// lowest log level compiled in, calls below it are removed completely
+// 0 = DEBUG, 1 = INFO, 2 = WARN, 3 = ERROR, release build sets it in CMake
+#ifndef PRSI_LOG_MIN_LEVEL
+#define PRSI_LOG_MIN_LEVEL 0
+#endif
 
 namespace prsi {
 
@@ -24,6 +37,30 @@ template <size_t N> struct Log_Severity {
   } // drop '\0'
 };
 
+class Log_Queue; // forward declare
+
+// Lets through one log per interval, the others are only counted.
+// Meant to be static at a hot call site, which can repeat a lot.
+class Log_Limit {
+public:
+  explicit Log_Limit(std::chrono::milliseconds interval)
+      : interval_ms_(interval.count()) {}
+
+  // true = log now, suppressed = how many were swallowed since the last one
+  bool allow(uint64_t &suppressed);
+
+private:
+  int64_t interval_ms_;
+  std::atomic<int64_t> next_ms_{0}; // steady clock
+  std::atomic<uint64_t> suppressed_{0};
+};
+
+// player described for logs, formatted only when the log is really written
+struct Log_Player {
+  const Player *p_;
+};
+
+// Writes logs synchronously to stderr until setup() says otherwise.
 class Logger {
 private:
   // delete con(de)structor
@@ -35,38 +72,99 @@ private:
   Logger &operator=(const Logger &) = delete;
   Logger &operator=(Logger &&) = delete;
 
-  // write log to file
-  static void log(std::string_view severity, std::string_view msg);
+  // write log to file, or queue it for the writer thread
+  // severity must be static, it is not copied
+  static void log(std::string_view severity, std::string &&msg);
 
   // template for multiple log severities, each severity defined by string
-  template <Log_Severity Severity> struct Generic_Log {
+  // nothing is formatted unless the level is enabled for the category
+  template <Log_Level Level, Log_Severity Severity> struct Generic_Log {
     template <typename... Args>
     void operator()(fmt::format_string<Args...> fmt_str, Args &&...args) const {
-      Logger::log(Severity, fmt::format(fmt_str, std::forward<Args>(args)...));
+      (*this)(LOG_GENERAL, fmt_str, std::forward<Args>(args)...);
+    }
+
+    template <typename... Args>
+    void operator()(Log_Category cat, fmt::format_string<Args...> fmt_str,
+                    Args &&...args) const {
+      if constexpr (Level >= PRSI_LOG_MIN_LEVEL) {
+        if (Logger::enabled(Level, cat)) {
+          Logger::log(Severity,
+                      fmt::format(fmt_str, std::forward<Args>(args)...));
+        }
+      }
+    }
+
+    // rate limited, for messages which can repeat many times per second
+    template <typename... Args>
+    void operator()(Log_Limit &limit, Log_Category cat,
+                    fmt::format_string<Args...> fmt_str,
+                    Args &&...args) const {
+      if constexpr (Level >= PRSI_LOG_MIN_LEVEL) {
+        uint64_t suppressed = 0;
+        if (Logger::enabled(Level, cat) && limit.allow(suppressed)) {
+          auto msg = fmt::format(fmt_str, std::forward<Args>(args)...);
+          if (suppressed > 0) {
+            fmt::format_to(std::back_inserter(msg),
+                           " ({} similar suppressed)", suppressed);
+          }
+          Logger::log(Severity, std::move(msg));
+        }
+      }
     }
   };
 
+  // runtime minimum level of each category
+  static std::array<std::atomic<uint8_t>, LOG_CATEGORY_COUNT> levels_;
+  static bool enabled(Log_Level level, Log_Category cat) {
+    return level >= levels_[cat].load(std::memory_order_relaxed);
+  }
+
   // protect shared resource - the place which to log into
   static std::mutex log_mutex_;
+  // where logs go, stderr or opened file
+  static int out_fd_;
+
+  // async mode, records go through the queue only while writer is running
+  static Log_Full_Policy full_policy_;
+  static std::unique_ptr<Log_Queue> queue_;
+  static std::thread writer_;
+  static std::atomic<bool> running_;
+  // writer waits for records, producer has to wake it
+  static std::atomic<bool> sleeping_;
+  // how many records were dropped since writer reported it last
+  static std::atomic<uint64_t> dropped_;
+
+  // background thread, drains the ring & writes records in batches
+  static void write_loop();
+  static void wake_writer();
+  static void write_out(std::string_view data);
 
 public:
   // public interface
-  static inline constexpr Generic_Log<"INFO"> info{};
-  static inline constexpr Generic_Log<"WARN"> warn{};
-  static inline constexpr Generic_Log<"EROR"> error{};
+  static inline constexpr Generic_Log<LOG_DEBUG, "DBUG"> debug{};
+  static inline constexpr Generic_Log<LOG_INFO, "INFO"> info{};
+  static inline constexpr Generic_Log<LOG_WARN, "WARN"> warn{};
+  static inline constexpr Generic_Log<LOG_ERROR, "EROR"> error{};
+
+  // set levels, open log file & start writer thread
+  // call before spawning other threads
+  static void setup(const Config &cfg);
+  // write everything queued & stop writer thread
+  static void shutdown();
 
   // easily show more info about something
 
   // more info about player
-  static inline const std::string more(std::shared_ptr<Player> p) {
-    std::string response = "Player ";
-    if (!p->nick().empty()) {
-      response += p->nick() + " ";
-    }
-    response += "fd=" + std::to_string(p->fd()) + ": ";
-
-    return response;
-  }
+  static inline Log_Player more(const Player &p) { return {&p}; }
 };
 
 } // namespace prsi
+
+template <> struct fmt::formatter<prsi::Log_Player> : formatter<string_view> {
+  auto format(const prsi::Log_Player &lp, format_context &ctx) const {
+    const auto &nick = lp.p_->nick();
+    return fmt::format_to(ctx.out(), "Player {}{}fd={}: ", nick,
+                          nick.empty() ? "" : " ", lp.p_->fd());
+  }
+};
@@ -1,7 +1,7 @@
 
+#include "cluster.hpp"
 #include "config.hpp"
 #include "logger.hpp"
-#include "server.hpp"
 
 int main(int argc, char **argv) {
   prsi::Logger::info("Server started.");
@@ -11,10 +11,11 @@ int main(int argc, char **argv) {
   if (argc > 1) {
     cfg = prsi::Config(argv[1]);
   }
+  prsi::Logger::setup(cfg);
 
-  prsi::Server s{cfg};
+  prsi::Cluster c{cfg};
 
-  s.run();
+  c.run();
 
   return 0;
 }
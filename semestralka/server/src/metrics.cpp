@@ -0,0 +1,275 @@
+#include "metrics.hpp"
+#include "logger.hpp"
+#include "room.hpp"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <fmt/format.h>
+#include <iterator>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace prsi {
+
+namespace {
+
+using Out = std::back_insert_iterator<std::string>;
+
+void header(Out out, std::string_view name, std::string_view type,
+            std::string_view help) {
+  fmt::format_to(out, "# HELP {} {}\n# TYPE {} {}\n", name, help, name, type);
+}
+
+template <typename Get>
+void counter(Out out, const std::vector<const Shard_Metrics *> &shards,
+             std::string_view name, std::string_view help, Get get) {
+  uint64_t sum = 0;
+  for (const auto *s : shards) {
+    sum += get(*s).value();
+  }
+  header(out, name, "counter", help);
+  fmt::format_to(out, "{} {}\n", name, sum);
+}
+
+// scale = divisor of observed values to get base unit (e.g. ns -> s)
+template <typename Get>
+void histogram(Out out, const std::vector<const Shard_Metrics *> &shards,
+               std::string_view name, std::string_view help, double scale,
+               Get get) {
+  header(out, name, "histogram", help);
+
+  auto bounds = get(*shards.front()).bounds();
+  uint64_t cumulative = 0;
+  double sum = 0;
+  for (size_t i = 0; i <= bounds.size(); i++) {
+    for (const auto *s : shards) {
+      cumulative += get(*s).bucket(i);
+    }
+    if (i < bounds.size()) {
+      fmt::format_to(out, "{}_bucket{{le=\"{}\"}} {}\n", name,
+                     bounds[i] / scale, cumulative);
+    } else {
+      fmt::format_to(out, "{}_bucket{{le=\"+Inf\"}} {}\n", name, cumulative);
+    }
+  }
+  for (const auto *s : shards) {
+    sum += get(*s).sum() / scale;
+  }
+  fmt::format_to(out, "{}_sum {}\n{}_count {}\n", name, sum, name,
+                 cumulative);
+}
+
+} // namespace
+
+std::string Metrics::render() const {
+  std::string body;
+  if (shards_.empty()) {
+    return body;
+  }
+  auto out = std::back_inserter(body);
+
+  header(out, "prsi_messages_total", "counter",
+         "Received messages by command.");
+  for (size_t c = 0; c < CMD_COUNT; c++) {
+    uint64_t sum = 0;
+    for (const auto *s : shards_) {
+      sum += s->messages_[c].value();
+    }
+    fmt::format_to(out, "prsi_messages_total{{command=\"{}\"}} {}\n",
+                   COMMAND_NAMES[c], sum);
+  }
+
+  counter(out, shards_, "prsi_received_bytes_total", "Bytes read from clients.",
+          [](const Shard_Metrics &s) -> const Counter & {
+            return s.bytes_in_;
+          });
+  counter(out, shards_, "prsi_sent_bytes_total", "Bytes written to clients.",
+          [](const Shard_Metrics &s) -> const Counter & {
+            return s.bytes_out_;
+          });
+  counter(out, shards_, "prsi_connections_accepted_total",
+          "Accepted connections.",
+          [](const Shard_Metrics &s) -> const Counter & {
+            return s.accepted_;
+          });
+  counter(out, shards_, "prsi_connections_rejected_total",
+          "Connections rejected because the server was full.",
+          [](const Shard_Metrics &s) -> const Counter & {
+            return s.rejected_;
+          });
+  counter(out, shards_, "prsi_accept_pauses_total",
+          "Times accepting stopped because the server was full.",
+          [](const Shard_Metrics &s) -> const Counter & {
+            return s.accept_pauses_;
+          });
+  counter(out, shards_, "prsi_output_dropped_total",
+          "Pings not sent to clients over the soft output limit.",
+          [](const Shard_Metrics &s) -> const Counter & {
+            return s.output_dropped_;
+          });
+  counter(out, shards_, "prsi_output_coalesced_total",
+          "Queued snapshots replaced by newer ones over the soft output limit.",
+          [](const Shard_Metrics &s) -> const Counter & {
+            return s.output_coalesced_;
+          });
+  counter(out, shards_, "prsi_output_overflows_total",
+          "Clients disconnected over the hard output limit.",
+          [](const Shard_Metrics &s) -> const Counter & {
+            return s.output_overflows_;
+          });
+  counter(out, shards_, "prsi_rate_limited_total",
+          "Times a client ran out of tokens & its messages had to wait.",
+          [](const Shard_Metrics &s) -> const Counter & {
+            return s.rate_limited_;
+          });
+  counter(out, shards_, "prsi_budget_deferrals_total",
+          "Times messages of a client waited for the next loop iteration.",
+          [](const Shard_Metrics &s) -> const Counter & {
+            return s.budget_deferrals_;
+          });
+  counter(out, shards_, "prsi_player_sleeps_total",
+          "Players who stopped answering pings.",
+          [](const Shard_Metrics &s) -> const Counter & { return s.sleeps_; });
+  counter(out, shards_, "prsi_player_deaths_total",
+          "Players removed for not answering pings.",
+          [](const Shard_Metrics &s) -> const Counter & { return s.deaths_; });
+
+  header(out, "prsi_rooms", "gauge", "Rooms by state.");
+  for (auto state : {Room_State::OPEN, Room_State::PLAYING,
+                     Room_State::FINISHED}) {
+    int64_t sum = 0;
+    for (const auto *s : shards_) {
+      sum += s->rooms_[state].value();
+    }
+    fmt::format_to(out, "prsi_rooms{{state=\"{}\"}} {}\n", to_string(state),
+                   sum);
+  }
+
+  histogram(out, shards_, "prsi_write_queue_messages",
+            "Messages queued for a connection when flushing.", 1,
+            [](const Shard_Metrics &s) -> const Histogram & {
+              return s.write_queue_;
+            });
+  histogram(out, shards_, "prsi_handler_duration_seconds",
+            "Time spent handling one message.", 1e9,
+            [](const Shard_Metrics &s) -> const Histogram & {
+              return s.handler_ns_;
+            });
+
+  return body;
+}
+
+Metrics_Endpoint::Metrics_Endpoint(const Metrics &metrics,
+                                   const std::string &ip, int port)
+    : metrics_(metrics) {
+  listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_fd_ == -1) {
+    throw std::runtime_error("Cannot create metrics socket.");
+  }
+  int opt = 1;
+  setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, ip.c_str(), &addr.sin_addr) <= 0) {
+    close(listen_fd_);
+    throw std::runtime_error("Invalid metrics IP address: " + ip);
+  }
+  if (bind(listen_fd_, (sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(listen_fd_, 16) == -1) {
+    close(listen_fd_);
+    throw std::runtime_error("Cannot listen on metrics port " +
+                             std::to_string(port));
+  }
+
+  stop_fd_ = eventfd(0, EFD_CLOEXEC);
+  if (stop_fd_ == -1) {
+    close(listen_fd_);
+    throw std::runtime_error("Cannot create metrics stop event.");
+  }
+
+  thread_ = std::thread([this]() { run(); });
+  Logger::info("Metrics available on http://{}:{}/metrics", ip, port);
+}
+
+Metrics_Endpoint::~Metrics_Endpoint() {
+  uint64_t one = 1;
+  if (write(stop_fd_, &one, sizeof(one)) == -1) {
+    Logger::error("Cannot stop metrics thread: {}", std::strerror(errno));
+  }
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  close(stop_fd_);
+  close(listen_fd_);
+}
+
+void Metrics_Endpoint::run() {
+  pollfd fds[2] = {{listen_fd_, POLLIN, 0}, {stop_fd_, POLLIN, 0}};
+  while (true) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      Logger::error("Metrics poll failed: {}", std::strerror(errno));
+      return;
+    }
+    if (fds[1].revents) {
+      return;
+    }
+    if (fds[0].revents & POLLIN) {
+      int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd != -1) {
+        serve(fd);
+        close(fd);
+      }
+    }
+  }
+}
+
+void Metrics_Endpoint::serve(int fd) {
+  // scraper which doesn't talk mustn't block the thread forever
+  timeval timeout{1, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  // only the request line matters, the rest of the request is ignored
+  char buff[1024];
+  ssize_t n = recv(fd, buff, sizeof(buff), 0);
+  if (n <= 0) {
+    return;
+  }
+  std::string_view request(buff, n);
+
+  std::string body;
+  std::string status = "200 OK";
+  if (request.starts_with("GET /metrics ") || request.starts_with("GET / ")) {
+    body = metrics_.render();
+  } else {
+    status = "404 Not Found";
+    body = "Metrics are at /metrics\n";
+  }
+
+  std::string response = fmt::format(
+      "HTTP/1.1 {}\r\nContent-Type: text/plain; version=0.0.4\r\n"
+      "Content-Length: {}\r\nConnection: close\r\n\r\n{}",
+      status, body.size(), body);
+
+  size_t sent = 0;
+  while (sent < response.size()) {
+    ssize_t w = send(fd, response.data() + sent, response.size() - sent,
+                     MSG_NOSIGNAL);
+    if (w <= 0) {
+      return;
+    }
+    sent += w;
+  }
+}
+
+} // namespace prsi
@@ -0,0 +1,139 @@
+#pragma once
+
+#include "command.hpp"
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace prsi {
+
+// Monotonic counter, written only by the shard which owns it, read by the
+// metrics endpoint thread. Single writer needs no locked instruction.
+class Counter {
+public:
+  void add(uint64_t n = 1) {
+    v_.store(v_.load(std::memory_order_relaxed) + n,
+             std::memory_order_relaxed);
+  }
+  uint64_t value() const { return v_.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<uint64_t> v_{0};
+};
+
+// Value which goes up & down, single writer like Counter.
+class Gauge {
+public:
+  void set(int64_t v) { v_.store(v, std::memory_order_relaxed); }
+  int64_t value() const { return v_.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<int64_t> v_{0};
+};
+
+// Histogram with fixed upper bounds of buckets, the last bucket is +Inf.
+class Histogram {
+public:
+  static constexpr size_t MAX_BUCKETS = 16;
+
+  // bounds must be sorted & outlive the histogram
+  explicit Histogram(std::span<const uint64_t> bounds) : bounds_(bounds) {}
+
+  void observe(uint64_t v) {
+    size_t i = 0;
+    while (i < bounds_.size() && v > bounds_[i]) {
+      i++;
+    }
+    buckets_[i].add();
+    sum_.add(v);
+  }
+
+  std::span<const uint64_t> bounds() const { return bounds_; }
+  // not cumulative, index bounds().size() = +Inf
+  uint64_t bucket(size_t i) const { return buckets_[i].value(); }
+  uint64_t sum() const { return sum_.value(); }
+
+private:
+  std::span<const uint64_t> bounds_;
+  std::array<Counter, MAX_BUCKETS + 1> buckets_;
+  Counter sum_;
+};
+
+// handler duration, nanoseconds
+inline constexpr std::array<uint64_t, 14> LATENCY_BOUNDS_NS = {
+    250,     500,     1'000,   2'500,     5'000,     10'000,    25'000,
+    50'000,  100'000, 250'000, 500'000,   1'000'000, 2'500'000, 10'000'000};
+// messages waiting in output queue of a connection
+inline constexpr std::array<uint64_t, 9> QUEUE_BOUNDS = {1,  2,  4,   8,  16,
+                                                         32, 64, 256, 1'024};
+
+// Everything one shard measures. Updated on the hot path, so no locks and
+// no allocation, only relaxed stores.
+struct Shard_Metrics {
+  // received messages by command
+  std::array<Counter, CMD_COUNT> messages_;
+  Counter bytes_in_;
+  Counter bytes_out_;
+  Counter accepted_;
+  Counter rejected_; // server was full
+  // accepting stopped because the server was full (ADM PAUSE)
+  Counter accept_pauses_;
+  // client doesn't read its output: pings dropped over soft limit, older
+  // snapshots replaced over soft limit, disconnected over hard limit
+  Counter output_dropped_;
+  Counter output_coalesced_;
+  Counter output_overflows_;
+  // inbound messages left for later: client ran out of tokens, or of the
+  // budget of one loop iteration
+  Counter rate_limited_;
+  Counter budget_deferrals_;
+  // player stopped answering pings / was removed for it
+  Counter sleeps_;
+  Counter deaths_;
+  // rooms owned by the shard, index = Room_State
+  std::array<Gauge, 3> rooms_;
+  // queue length when flushing connection output
+  Histogram write_queue_{QUEUE_BOUNDS};
+  // time spent in handler of one message
+  Histogram handler_ns_{LATENCY_BOUNDS_NS};
+};
+
+// All shards' metrics, rendered together for scraping.
+class Metrics {
+public:
+  // shard metrics must outlive the registry
+  void add(const Shard_Metrics *shard) { shards_.push_back(shard); }
+
+  // Prometheus text format, shards summed up
+  std::string render() const;
+
+private:
+  std::vector<const Shard_Metrics *> shards_;
+};
+
+// Serves metrics over HTTP from its own thread, any GET gets them.
+class Metrics_Endpoint {
+public:
+  Metrics_Endpoint(const Metrics &metrics, const std::string &ip, int port);
+  ~Metrics_Endpoint();
+  // Delete copy/move
+  Metrics_Endpoint(const Metrics_Endpoint &) = delete;
+  Metrics_Endpoint &operator=(const Metrics_Endpoint &) = delete;
+
+private:
+  const Metrics &metrics_;
+  int listen_fd_ = -1;
+  // written on destruction, wakes the thread up to end
+  int stop_fd_ = -1;
+  std::thread thread_;
+
+  void run();
+  void serve(int fd);
+};
+
+} // namespace prsi
@@ -3,16 +3,19 @@
 #include "protocol.hpp"
 #include "server.hpp"
 #include <algorithm>
+#include <cctype>
 #include <cerrno>
 #include <memory>
 #include <stdexcept>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/types.h>
 
 namespace prsi {
 
 Player::Player(Server &s, int fd) : server_(s), fd_(fd) {
   this->fd(fd_); // to set fd valid
+  epollout_ = false; // new socket is added to epoll without it
   set_last_pong();
   set_last_ping();
 }
@@ -30,7 +33,7 @@ void Player::receive() {
       if (errno == EAGAIN || errno == EWOULDBLOCK) {
         return;
       }
-      Logger::error("recv failed for fd={}", fd_);
+      Logger::error(LOG_NET, "recv failed for fd={}", fd_);
       throw std::runtime_error("Failed receive, should disconnect.");
     }
 
@@ -38,86 +41,355 @@ void Player::receive() {
       throw std::runtime_error("Client closed connection.");
     }
 
-    read_buffer_.append(buff, n);
-    if (read_buffer_.size() > 1'000'000) {
-      throw std::runtime_error("Too long message buffer, probably an attack.");
-    }
+    on_received(buff, n);
+  }
+}
 
-    Logger::info("Received {} bytes from fd={}", n, fd_);
+void Player::on_received(const char *data, size_t n) {
+  // drop processed messages, when there is nothing left or it is worth it
+  if (read_offset_ == read_buffer_.size()) {
+    read_buffer_.clear();
+    read_offset_ = scan_offset_ = 0;
+  } else if (read_offset_ > read_buffer_.size() / 2) {
+    read_buffer_.erase(0, read_offset_);
+    scan_offset_ -= read_offset_;
+    read_offset_ = 0;
   }
+
+  read_buffer_.append(data, n);
+  server_.metrics_.bytes_in_.add(n);
+  if (read_buffer_.size() - read_offset_ > 1'000'000) {
+    throw std::runtime_error("Too long message buffer, probably an attack.");
+  }
+
+  Logger::debug(LOG_NET, "Received {} bytes from fd={}", n, fd_);
 }
 
-void Player::append_msg(const std::string &msg) {
-  write_buffer_.append(msg);
-  try_flush();
+void Player::append_msg(std::string msg, Msg_Kind kind) {
+  if (!admit_output(kind)) {
+    return;
+  }
+  if (binary_) {
+    msg = Protocol::to_binary(msg);
+  }
+  queue_output({std::move(msg), nullptr, kind});
 }
 
-void Player::try_flush() {
-  ssize_t sent = send(fd_, write_buffer_.data(), write_buffer_.size(), 0);
+void Player::append_msg(Payload msg, Msg_Kind kind) {
+  if (!admit_output(kind)) {
+    return;
+  }
+  queue_output({{}, std::move(msg), kind});
+}
 
-  if (sent > 0) { // success
-    write_buffer_.erase(0, sent);
+bool Player::admit_output(Msg_Kind kind) {
+  if (overflowed_) {
+    return false;
+  }
+  if (kind == MSG_PING && over_soft_limit()) {
+    server_.metrics_.output_dropped_.add();
+    return false;
+  }
+  return true;
+}
+
+bool Player::over_soft_limit() const {
+  size_t soft = server_.output_soft_limit_;
+  return soft != 0 && queued_bytes_ > soft;
+}
 
-    if (write_buffer_.empty()) { // writen everything
-      server_.disable_sending(fd_);
-    } else { // something needs to be retried
-      server_.enable_sending(fd_);
+Segment *Player::queued_snapshot(Msg_Kind kind) {
+  // wraps around to a huge number if the segment left the queue
+  uint64_t i = last_queued_[kind] - popped_;
+  if (i >= write_queue_.size() || (i == 0 && write_offset_ > 0)) {
+    return nullptr;
+  }
+  auto &s = write_queue_[i];
+  return s.kind_ == kind ? &s : nullptr;
+}
+
+void Player::queue_output(Segment &&s) {
+  // older snapshot of the same kind is out of date, the new one must still
+  // go after everything queued meanwhile, so the old one is only emptied
+  Segment *old = nullptr;
+  if (s.kind_ != MSG_OTHER && over_soft_limit()) {
+    old = queued_snapshot(s.kind_);
+  }
+  if (old) {
+    queued_bytes_ -= old->size();
+    server_.metrics_.output_coalesced_.add();
+  }
+  if (old && old == &write_queue_.back()) {
+    queued_bytes_ += s.size();
+    *old = std::move(s);
+  } else {
+    if (old) {
+      *old = Segment{};
     }
+    last_queued_[s.kind_] = popped_ + write_queue_.size();
+    queued_bytes_ += s.size();
+    write_queue_.push_back(std::move(s));
+  }
 
-    // socket is working, but dont have time or what
-  } else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-    server_.enable_sending(fd_); // retry next time
+  size_t hard = server_.output_hard_limit_;
+  if (hard == 0 || queued_bytes_ <= hard) {
+    output_queued();
+    return;
+  }
+
+  server_.metrics_.output_overflows_.add();
+  Logger::warn(LOG_NET, "fd={} has {} bytes of output, client doesn't read.",
+               fd_, queued_bytes_);
+  clear_output();
+  // the event loop sees the socket closed & terminates the player, doing it
+  // here would break callers iterating over room players
+  // NOTE: without socket the fd may belong to somebody else already
+  if (valid_fd_) {
+    overflowed_ = true;
+    shutdown(fd_, SHUT_RDWR);
+  }
+}
 
-    // socket is not a friend anymore
+void Player::output_queued() {
+  // without socket the fd may belong to somebody else already, the client
+  // asks for STATE after reconnect anyway
+  if (!valid_fd_) {
+    clear_output();
+    return;
+  }
+  if (server_.cork_) {
+    server_.mark_dirty(*this);
   } else {
-    server_.terminate_player(std::make_shared<Player>(*this));
+    try_flush();
   }
 }
 
-std::vector<std::string> Player::complete_recv_msg() {
-  if (!Protocol::could_validate(read_buffer_)) {
-    return {};
+void Player::try_flush() {
+  // io_uring sends asynchronously, its completion continues the flush
+  if (server_.uring_) {
+    server_.uring_send(*this);
+    return;
+  }
+
+  if (!write_queue_.empty()) {
+    server_.metrics_.write_queue_.observe(write_queue_.size());
+  }
+  while (!write_queue_.empty()) {
+    // gather queued messages, so one syscall sends all of them
+    iovec iov[MAX_IOV];
+    size_t n = 0;
+    size_t total = 0;
+    for (auto it = write_queue_.begin();
+         it != write_queue_.end() && n < MAX_IOV; ++it) {
+      size_t skip = it == write_queue_.begin() ? write_offset_ : 0;
+      if (it->size() == skip) { // emptied by a newer snapshot
+        continue;
+      }
+      iov[n].iov_base = const_cast<char *>(it->data()) + skip;
+      iov[n].iov_len = it->size() - skip;
+      total += iov[n].iov_len;
+      n++;
+    }
+
+    msghdr msg{};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    // peer may be gone already, that must not kill the server by SIGPIPE
+    ssize_t sent = sendmsg(fd_, &msg, MSG_NOSIGNAL);
+
+    if (sent > 0) { // success
+      server_.metrics_.bytes_out_.add(sent);
+      consume_output(sent);
+
+      if (static_cast<size_t>(sent) < total) { // something needs to be retried
+        if (!epollout_) {
+          server_.enable_sending(fd_);
+          epollout_ = true;
+        }
+        return;
+      }
+
+      // socket is working, but dont have time or what
+    } else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (!epollout_) { // retry next time
+        server_.enable_sending(fd_);
+        epollout_ = true;
+      }
+      return;
+
+      // socket is not a friend anymore, event loop sees the error on it too &
+      // terminates the player, doing it here would break callers iterating
+      // over room players
+    } else {
+      clear_output();
+      return;
+    }
   }
 
-  if (!Protocol::valid(read_buffer_)) {
-    throw std::runtime_error("Not a valid protocol message.");
+  // writen everything
+  if (epollout_) {
+    server_.disable_sending(fd_);
+    epollout_ = false;
   }
+}
 
-  return Protocol::extract_message(read_buffer_);
+void Player::clear_output() {
+  popped_ += write_queue_.size();
+  write_queue_.clear();
+  write_offset_ = 0;
+  queued_bytes_ = 0;
 }
-void Player::set_last_pong(std::chrono::steady_clock::time_point time) {
-  if (did_sleep_times_ > 0) {
-    // if is in room, tell others that now i am awake
-    auto p = shared_from_this();
-    auto loc = server_.where_player(p);
-    auto r = loc.room_.lock();
-    if (r) {
-      server_.broadcast_to_room(r, Protocol::AWAKE(p), {fd_});
+
+void Player::consume_output(size_t n) {
+  // only move the offset, don't move the data
+  queued_bytes_ -= std::min(n, queued_bytes_);
+  // emptied segments are dropped on the way too
+  while (!write_queue_.empty()) {
+    size_t left = write_queue_.front().size() - write_offset_;
+    if (n < left) {
+      write_offset_ += n;
+      return;
     }
+    n -= left;
+    write_queue_.pop_front();
+    popped_++;
+    write_offset_ = 0;
   }
-  did_sleep_times_ = 0;
-  last_pong_ = time;
-};
+}
 
-bool Player::have_card(const Card &c) {
-  auto it = std::find_if(hand_.begin(), hand_.end(), [&c](const auto &card) {
-    return c.rank_ == card.rank_ && c.suit_ == card.suit_;
-  });
+size_t Player::take_output(std::vector<Segment> &out) {
+  size_t offset = write_offset_;
+  size_t taken = 0;
+  while (!write_queue_.empty() && out.size() < MAX_IOV) {
+    taken += write_queue_.front().size();
+    out.push_back(std::move(write_queue_.front()));
+    write_queue_.pop_front();
+    popped_++;
+  }
+  queued_bytes_ -= std::min(taken - offset, queued_bytes_);
+  write_offset_ = 0;
+  return offset;
+}
 
-  return it != hand_.end();
+void Player::unsent(std::vector<Segment> &out, size_t from, size_t offset) {
+  for (size_t i = out.size(); i > from; i--) {
+    queued_bytes_ += out[i - 1].size();
+    write_queue_.push_front(std::move(out[i - 1]));
+    popped_--;
+  }
+  if (from < out.size()) {
+    queued_bytes_ -= offset;
+  }
+  write_offset_ = offset;
 }
 
-void Player::remove_card(const Card &c) {
-  auto it = std::find_if(hand_.begin(), hand_.end(), [&c](const auto &card) {
-    return c.rank_ == card.rank_ && c.suit_ == card.suit_;
-  });
-  if (it == hand_.end()) {
-    return; // cannot find
+bool Player::complete_recv_msg(Tokens &msg, Command &cmd) {
+  std::string_view pending{read_buffer_};
+  pending.remove_prefix(read_offset_);
+
+  if (binary_) {
+    size_t n = 0;
+    size_t used = Protocol::decode_binary(pending, tokens_, scratch_, n, cmd);
+    if (used == 0) {
+      return false;
+    }
+    msg = Tokens{tokens_.data(), n};
+    msg_start_ = read_offset_;
+    read_offset_ = scan_offset_ = read_offset_ + used;
+    return true;
+  }
+
+  // every message is checked only once, as soon as it's long enough
+  if (!magic_checked_) {
+    if (!Protocol::could_validate(pending)) {
+      return false;
+    }
+    if (!Protocol::valid(pending)) {
+      throw std::runtime_error("Not a valid protocol message.");
+    }
+    magic_checked_ = true;
   }
 
-  hand_.erase(it);
+  size_t end = Protocol::find_end(read_buffer_, scan_offset_);
+  if (end == std::string::npos) {
+    scan_offset_ = read_buffer_.size();
+    return false;
+  }
+
+  size_t n = Protocol::tokenize(pending.substr(0, end - read_offset_),
+                                tokens_, cmd);
+  msg = Tokens{tokens_.data(), n};
+
+  msg_start_ = read_offset_;
+  read_offset_ = scan_offset_ = end;
+  magic_checked_ = false;
+  return true;
+}
+void Player::start_binary() {
+  binary_ = true;
+  // the rest of the text message (e.g. its newline) isn't a frame, client
+  // sends frames only after OK PROTO
+  while (read_offset_ < read_buffer_.size() &&
+         std::isspace(static_cast<unsigned char>(read_buffer_[read_offset_]))) {
+    read_offset_++;
+  }
+  scan_offset_ = read_offset_;
+  magic_checked_ = false;
+}
+
+Player_Transfer Player::release() {
+  Player_Transfer t;
+  t.fd_ = fd_;
+  t.nick_ = nick_;
+  read_buffer_.erase(0, read_offset_); // only what wasn't processed
+  t.read_buffer_ = std::move(read_buffer_);
+  popped_ += write_queue_.size();
+  t.write_queue_ = std::move(write_queue_);
+  t.write_offset_ = write_offset_;
+  t.last_ping_ = last_ping_;
+  t.last_pong_ = last_pong_;
+  t.did_sleep_times_ = did_sleep_times_;
+  t.binary_ = binary_;
+
+  read_buffer_.clear();
+  read_offset_ = scan_offset_ = 0;
+  magic_checked_ = false;
+  write_queue_.clear();
+  write_offset_ = 0;
+  queued_bytes_ = 0;
+  valid_fd_ = false;
+
+  return t;
+}
+
+void Player::restore(Player_Transfer &&t) {
+  nick_ = std::move(t.nick_);
+  read_buffer(std::move(t.read_buffer_));
+  write_queue_ = std::move(t.write_queue_);
+  write_offset_ = t.write_offset_;
+  queued_bytes_ = 0;
+  for (size_t i = 0; i < write_queue_.size(); i++) {
+    queued_bytes_ += write_queue_[i].size();
+    last_queued_[write_queue_[i].kind_] = popped_ + i;
+  }
+  queued_bytes_ -= std::min(write_offset_, queued_bytes_);
+  last_ping_ = t.last_ping_;
+  last_pong_ = t.last_pong_;
+  did_sleep_times_ = t.did_sleep_times_;
+  binary_ = t.binary_;
 }
 
-void Player::clear_hand() { hand_.resize(0); }
+void Player::set_last_pong(std::chrono::steady_clock::time_point time) {
+  if (did_sleep_times_ > 0) {
+    // if is in room, tell others that now i am awake
+    auto loc = server_.where_player(*this);
+    if (loc.room_) {
+      loc.room_->changed();
+      server_.broadcast_to_room(*loc.room_, Protocol::AWAKE(*this), {fd_});
+    }
+  }
+  did_sleep_times_ = 0;
+  last_pong_ = time;
+};
 
 } // namespace prsi
@@ -1,11 +1,19 @@
 #pragma once
 
+#include "bucket.hpp"
 #include "card.hpp"
+#include "command.hpp"
+#include "slab.hpp"
+#include "timer.hpp"
+#include <array>
 #include <chrono>
-#include <list>
+#include <cstdint>
+#include <deque>
 #include <memory>
+#include <span>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <vector>
 namespace prsi {
 class Room; // forward declaring
@@ -21,27 +29,118 @@ enum Player_State {
 };
 
 struct Player_Location {
-  Player_State state_;
-  std::weak_ptr<Room> room_; // only valid if state==room/game
+  Player_State state_ = NON_EXISTING;
+  Room *room_ = nullptr; // only valid if state==room/game
+};
+
+// serialized message, immutable & shared by all players it is sent to
+using Payload = std::shared_ptr<const std::string>;
+inline Payload make_payload(std::string msg) {
+  return std::make_shared<const std::string>(std::move(msg));
+}
+
+// message built once & sent until what it describes changes, in both formats
+// empty = has to be built again
+struct Snapshot {
+  Payload text_;
+  Payload binary_;
+
+  void clear() {
+    text_.reset();
+    binary_.reset();
+  }
+};
+
+// words of one received message, views into the receive buffer of player
+// valid only until the buffer changes (next receive, reconnect, handoff)
+using Tokens = std::span<const std::string_view>;
+
+// what a queued message is, a client over the soft output limit gets no
+// pings & only the latest snapshot of each kind
+enum Msg_Kind : uint8_t {
+  MSG_OTHER, // always queued, the game can't go on without it
+  MSG_PING,  // dropped, client which doesn't read won't answer anyway
+  MSG_ROOM,  // ROOM snapshot, replaces the older one still queued
+  MSG_ROOMS, // ROOMS snapshot, likewise
+  MSG_KIND_COUNT,
+};
+
+// one queued message, owned by the player or shared with other recipients
+struct Segment {
+  std::string owned_;
+  Payload shared_;
+  Msg_Kind kind_ = MSG_OTHER;
+
+  const char *data() const { return shared_ ? shared_->data() : owned_.data(); }
+  size_t size() const { return shared_ ? shared_->size() : owned_.size(); }
+};
+
+// everything needed to move connected player into another server shard
+struct Player_Transfer {
+  int fd_ = -1;
+  std::string nick_;
+  std::string read_buffer_;
+  std::deque<Segment> write_queue_;
+  size_t write_offset_ = 0;
+  std::chrono::steady_clock::time_point last_ping_;
+  std::chrono::steady_clock::time_point last_pong_;
+  int did_sleep_times_ = 0;
+  bool binary_ = false;
 };
 
 class Server; // forward declare
 
-class Player : public std::enable_shared_from_this<Player> {
+class Player {
 public:
   Player(Server &server, int socket_file_descriptor);
   ~Player();
 
 private:
+  // own slot in the server slab
+  Handle handle_;
   int fd_;
   bool valid_fd_ = false;
   std::string nick_;
 
   Server &server_;
+  // received data, messages before read_offset_ were already processed
   std::string read_buffer_;
-  std::string write_buffer_;
+  size_t read_offset_ = 0;
+  // where the last complete message started, so it can be put back
+  size_t msg_start_ = 0;
+  // no delimiter is before this position, so it's not searched again
+  size_t scan_offset_ = 0;
+  // start of the pending message is known to be valid
+  bool magic_checked_ = false;
+  // words of the last complete message
+  std::array<std::string_view, 8> tokens_;
+  // numbers & cards of binary message as text, tokens may point here
+  std::array<char, 24> scratch_;
+  // connection switched to binary protocol (PROTO BIN)
+  bool binary_ = false;
+  // gets changes of rooms while in lobby (SUBSCRIBE_ROOMS)
+  bool subscribed_ = false;
+  // random part of session token, 0 = no token was issued yet
+  uint32_t session_secret_ = 0;
+  // messages waiting for send, the first may be already partially sent
+  std::deque<Segment> write_queue_;
+  // how much of the first message was sent
+  size_t write_offset_ = 0;
+  // bytes in write_queue not sent yet, checked against output limits
+  size_t queued_bytes_ = 0;
+  // hard output limit was hit, socket is shut down & nothing more is queued
+  bool overflowed_ = false;
+  // segments are numbered in order of queueing, this many left the front
+  uint64_t popped_ = 0;
+  // number of the last queued segment of each kind, so a snapshot can be
+  // found without searching the queue (it may have left it already)
+  std::array<uint64_t, MSG_KIND_COUNT> last_queued_{};
+
+  Hand hand_;
 
-  std::list<Card> hand_;
+  // where the player is, set by the server whenever it moves the player
+  // NOTE: ROOM stands for game too, state of the room tells which one
+  Player_Location location_;
 
   // time of last sent ping
   std::chrono::steady_clock::time_point last_ping_;
@@ -50,19 +149,69 @@ private:
   // how many sleep cycles were experienced without pong
   int did_sleep_times_ = 0;
 
-  int timer_fd_ = -1;
+  // drop n sent bytes from the start of write_queue
+  void consume_output(size_t n);
+  // drop whole write_queue, nobody will read it
+  void clear_output();
+
+  // apply soft output limit, false if the message should be dropped
+  bool admit_output(Msg_Kind kind);
+  bool over_soft_limit() const;
+  // the last queued segment of the kind, if it's still waiting & nothing of
+  // it was sent yet
+  Segment *queued_snapshot(Msg_Kind kind);
+  // add message to write_queue, shut the socket down over hard limit
+  void queue_output(Segment &&s);
+
+  // output waits for flush at the end of server loop iteration (corking)
+  bool dirty_ = false;
+  // EPOLLOUT is enabled for the socket, so it isn't set again
+  bool epollout_ = false;
+  // flush now, or only mark dirty when corking
+  void output_queued();
+
+  // ids of live timers in the server timer wheel, 0 = not running
+  std::array<uint64_t, 4> timers_{};
+
+  // rate limits of inbound messages, index = Command_Class
+  std::array<Token_Bucket, CLASS_COUNT> buckets_;
+  // waits in the server list of players over the message budget
+  bool deferred_ = false;
 
 public:
   // read from socket into read_buffer
   void receive();
-  // add something to write_buffer
-  // and try flushing the buffer
-  void append_msg(const std::string &msg);
-  // push to socket what is in write_buffer
+  // add received data into read_buffer
+  // throw if the buffer gets suspiciously long
+  void on_received(const char *data, size_t n);
+  // at most how many messages are sent by one syscall
+  static constexpr size_t MAX_IOV = 64;
+
+  // add something to write_queue
+  // and try flushing the queue
+  // text message is encoded as binary frame for binary connection
+  // kind tells what may be dropped when client doesn't read
+  void append_msg(std::string msg, Msg_Kind kind = MSG_OTHER);
+  // queue message shared with others, no copy is made
+  // NOTE: must be already in the format of this connection
+  void append_msg(Payload msg, Msg_Kind kind = MSG_OTHER);
+  // push to socket what is in write_queue, many messages at once
   // if cannot the whole message, will set EPOLLOUT,
   // so it will be retried afterwards
   void try_flush();
 
+  // for sending outside of try_flush (io_uring)
+  bool has_output() const { return !write_queue_.empty(); }
+  // how many messages wait for send
+  size_t queued() const { return write_queue_.size(); }
+  size_t queued_bytes() const { return queued_bytes_; }
+  // move up to MAX_IOV first queued messages into out
+  // return how much of the first one was already sent
+  size_t take_output(std::vector<Segment> &out);
+  // put taken messages back, starting with out[from], which was sent only
+  // up to offset
+  void unsent(std::vector<Segment> &out, size_t from, size_t offset);
+
   // get/set time
   void set_last_ping(std::chrono::steady_clock::time_point time =
                          std::chrono::steady_clock::now()) {
@@ -81,17 +230,44 @@ public:
 
   // get/set
 public:
+  Handle handle() const { return handle_; }
+  void handle(Handle h) { handle_ = h; }
+
   int fd() const { return fd_; }
   void fd(int new_fd) {
+    // the rest of output for the old socket would break the new stream
+    clear_output();
     fd_ = new_fd;
     valid_fd_ = true;
+    overflowed_ = false;
+    // socket may come with EPOLLOUT on, next flush will turn it off
+    epollout_ = true;
   }
 
   bool valid_fd() const { return valid_fd_; }
   void valid_fd(bool is_valid) { valid_fd_ = is_valid; }
 
-  int tfd() const { return timer_fd_; }
-  void tfd(int new_tfd) { timer_fd_ = new_tfd; }
+  bool binary() const { return binary_; }
+  void binary(bool is_binary) { binary_ = is_binary; }
+  // switch to binary protocol after PROTO BIN was processed
+  void start_binary();
+
+  bool subscribed() const { return subscribed_; }
+  void subscribed(bool is_subscribed) { subscribed_ = is_subscribed; }
+
+  uint32_t session_secret() const { return session_secret_; }
+  void session_secret(uint32_t secret) { session_secret_ = secret; }
+
+  Token_Bucket &bucket(Command_Class c) { return buckets_[c]; }
+
+  bool deferred() const { return deferred_; }
+  void deferred(bool is_deferred) { deferred_ = is_deferred; }
+
+  bool dirty() const { return dirty_; }
+  void dirty(bool is_dirty) { dirty_ = is_dirty; }
+
+  uint64_t timer(Timer_Kind kind) const { return timers_[kind]; }
+  void timer(Timer_Kind kind, uint64_t id) { timers_[kind] = id; }
 
   const std::string &nick() const { return nick_; }
   void nick(const std::string &nick) {
@@ -101,18 +277,43 @@ public:
     nick_ = nick;
   }
 
-  std::list<Card> &hand() { return hand_; }
-  bool have_card(const Card &c);
-  void remove_card(const Card &c);
+  // replace received data, e.g. when socket moves from other player object
+  void read_buffer(std::string &&buffer) {
+    read_buffer_ = std::move(buffer);
+    read_offset_ = scan_offset_ = 0;
+    magic_checked_ = false;
+  }
+
+  const Player_Location &location() const { return location_; }
+  void location(Player_State state, Room *room = nullptr) {
+    location_ = {state, room};
+  }
+
+  Hand &hand() { return hand_; }
+  const Hand &hand() const { return hand_; }
+  bool have_card(Card c) const { return hand_.has(c); }
+  void remove_card(Card c) { hand_.remove(c); }
   // remove all cards from hand
-  void clear_hand();
+  void clear_hand() { hand_.clear(); }
 
   // helper
 
-  // return complete received message splitted by whitespaces or empty vector
-  // remove that message from recv buffer
+  // move connection state out, player is left without socket
+  Player_Transfer release();
+  // take over state of released player, socket fd is set by constructor
+  void restore(Player_Transfer &&t);
+
+  // if there is complete received message, split it by whitespaces into msg
+  // with its command recognized & mark it as processed, return false if
+  // there is none
+  // NOTE: msg is valid only until the next receive
   // throw error if msg is buffer is invalid
-  std::vector<std::string> complete_recv_msg();
+  bool complete_recv_msg(Tokens &msg, Command &cmd);
+  // mark the last complete message as not processed, it's returned again
+  void unread_msg() {
+    read_offset_ = scan_offset_ = msg_start_;
+    magic_checked_ = false;
+  }
 };
 
 } // namespace prsi
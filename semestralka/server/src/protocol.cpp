@@ -1,62 +1,400 @@
 
 #include "protocol.hpp"
+#include <charconv>
+#include <cstdint>
+#include <initializer_list>
+#include <stdexcept>
 
 namespace prsi {
 
-std::vector<std::string>
-Protocol::extract_message(std::string &mutable_string) {
-  // find if any message exists
-  auto delim_start = mutable_string.find(DELIM);
-  if (delim_start == std::string::npos) {
-    return {};
+namespace {
+
+// suits & ranks in order of their binary code
+constexpr std::string_view SUITS = "ZLKS";
+constexpr std::string_view RANKS = "7890JQKA";
+constexpr uint8_t NO_CARD = 0xFF;
+
+void put_varint(std::string &out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back(static_cast<char>(v | 0x80));
+    v >>= 7;
   }
+  out.push_back(static_cast<char>(v));
+}
 
-  // extract the message
-  std::string_view msg_view{mutable_string.c_str(), delim_start + DELIM.size()};
+void put_string(std::string &out, std::string_view s) {
+  put_varint(out, s.size());
+  out.append(s);
+}
 
-  // split into parts, by whitespaces
-  std::vector<std::string> result;
-  size_t i = 0;
-  while (i < msg_view.size()) {
-    // skip whitespaces
-    while (i < msg_view.size() &&
-           std::isspace(static_cast<unsigned char>(msg_view[i]))) {
-      i++;
+// position in list of words, empty word = not found
+uint8_t index_of(std::string_view word,
+                 std::initializer_list<std::string_view> words) {
+  uint8_t i = 0;
+  for (auto w : words) {
+    if (w == word) {
+      return i;
     }
-    // the whole msg only whitespaces - shouldn't happen, we have delim
-    if (i >= msg_view.size()) {
-      break;
+    i++;
+  }
+  return i;
+}
+
+// Words of text message one by one, without magic & delimiter.
+class Words {
+public:
+  explicit Words(std::string_view msg) : msg_(msg) {}
+
+  // next word, empty at the end
+  std::string_view next() {
+    while (true) {
+      while (i_ < msg_.size() &&
+             std::isspace(static_cast<unsigned char>(msg_[i_]))) {
+        i_++;
+      }
+      size_t start = i_;
+      while (i_ < msg_.size() &&
+             !std::isspace(static_cast<unsigned char>(msg_[i_]))) {
+        i_++;
+      }
+      auto word = msg_.substr(start, i_ - start);
+      if (word != "PRSI" && word != "|") {
+        return word;
+      }
     }
+  }
 
-    size_t word_start = i;
-    while (i < msg_view.size() &&
-           !std::isspace(static_cast<unsigned char>(msg_view[i]))) {
-      i++;
+  bool number(uint64_t &v) {
+    auto word = next();
+    auto [end, ec] =
+        std::from_chars(word.data(), word.data() + word.size(), v);
+    return ec == std::errc() && end == word.data() + word.size();
+  }
+  bool string(std::string &out) {
+    auto word = next();
+    put_string(out, word);
+    return !word.empty();
+  }
+  bool card(std::string &out) {
+    auto word = next();
+    size_t suit = word.size() == 2 ? SUITS.find(word[0]) : std::string::npos;
+    size_t rank = word.size() == 2 ? RANKS.find(word[1]) : std::string::npos;
+    if (suit == std::string::npos || rank == std::string::npos) {
+      out.push_back(static_cast<char>(NO_CARD));
+    } else {
+      out.push_back(static_cast<char>(suit << 3 | rank));
     }
+    return !word.empty();
+  }
+  // next word must be the given one
+  bool expect(std::string_view word) { return next() == word; }
+  bool done() { return next().empty(); }
 
-    // extract word
-    auto word = msg_view.substr(word_start, i - word_start);
+private:
+  std::string_view msg_;
+  size_t i_ = 0;
+};
 
-    // dont include magic and delim in result
-    if (MAGIC.compare(word) != 0 && DELIM.compare(word) != 0) {
-      result.emplace_back(word);
+bool encode_cards(Words &w, std::string &out) {
+  uint64_t n = 0;
+  if (!w.number(n)) {
+    return false;
+  }
+  put_varint(out, n);
+  for (uint64_t i = 0; i < n; i++) {
+    if (!w.card(out)) {
+      return false;
     }
   }
+  return true;
+}
 
-  // erase from input string
-  mutable_string.erase(0, delim_start + DELIM.size());
+// after ROOM keyword
+bool encode_room(Words &w, std::string &out) {
+  uint64_t id = 0;
+  uint64_t n = 0;
+  if (!w.number(id)) {
+    return false;
+  }
+  put_varint(out, id);
+  out.push_back(index_of(w.next(), {"OPEN", "PLAYING", "FINISHED"}));
+  if (!w.expect("PLAYERS") || !w.number(n)) {
+    return false;
+  }
+  put_varint(out, n);
+  for (uint64_t i = 0; i < n; i++) {
+    uint64_t hand = 0;
+    if (!w.string(out)) {
+      return false;
+    }
+    out.push_back(w.next() == "SLEEP" ? 1 : 0);
+    if (!w.number(hand)) {
+      return false;
+    }
+    put_varint(out, hand);
+  }
+  return true;
+}
 
-  return result;
+// after TURN keyword
+bool encode_turn(Words &w, std::string &out) {
+  return w.string(out) && w.expect("TOP") && w.card(out);
 }
 
-bool Protocol::could_validate(const std::string &msg) {
+// body of text message into opcode & payload, false if it doesn't fit
+bool encode(Words &w, std::string &out) {
+  auto kw = w.next();
+
+  if (kw == "PING") {
+    out.push_back(BIN_PING);
+  } else if (kw == "GAME_START") {
+    out.push_back(BIN_GAME_START);
+  } else if (kw == "WIN") {
+    out.push_back(BIN_WIN);
+  } else if (kw == "LOSE") {
+    out.push_back(BIN_LOSE);
+
+  } else if (kw == "SLEEP" || kw == "DEAD" || kw == "AWAKE" || kw == "JOIN" ||
+             kw == "LEAVE" || kw == "SKIP") {
+    out.push_back(kw == "SLEEP"   ? BIN_SLEEP
+                  : kw == "DEAD"  ? BIN_DEAD
+                  : kw == "AWAKE" ? BIN_AWAKE
+                  : kw == "JOIN"  ? BIN_JOIN
+                  : kw == "LEAVE" ? BIN_LEAVE
+                                  : BIN_SKIP);
+    if (!w.string(out)) {
+      return false;
+    }
+
+  } else if (kw == "OK" || kw == "FAIL") {
+    out.push_back(kw == "OK" ? BIN_OK : BIN_FAIL);
+    auto cmd = parse_command(w.next());
+    out.push_back(cmd);
+    // session token, nothing is added without it
+    std::string token;
+    if (kw == "OK" && cmd == CMD_NAME && w.string(token)) {
+      out += token;
+    }
+
+  } else if (kw == "ROOMS") {
+    out.push_back(BIN_ROOMS);
+    uint64_t n = 0;
+    if (!w.number(n)) {
+      return false;
+    }
+    put_varint(out, n);
+    for (uint64_t i = 0; i < n; i++) {
+      uint64_t id = 0;
+      if (!w.number(id)) {
+        return false;
+      }
+      put_varint(out, id);
+      out.push_back(index_of(w.next(), {"OPEN", "PLAYING", "FINISHED"}));
+    }
+
+  } else if (kw == "ROOM_ADDED" || kw == "ROOM_CHANGED") {
+    out.push_back(kw == "ROOM_ADDED" ? BIN_ROOM_ADDED : BIN_ROOM_CHANGED);
+    uint64_t id = 0;
+    if (!w.number(id)) {
+      return false;
+    }
+    put_varint(out, id);
+    out.push_back(index_of(w.next(), {"OPEN", "PLAYING", "FINISHED"}));
+
+  } else if (kw == "ROOM_REMOVED") {
+    out.push_back(BIN_ROOM_REMOVED);
+    uint64_t id = 0;
+    if (!w.number(id)) {
+      return false;
+    }
+    put_varint(out, id);
+
+  } else if (kw == "ROOM") {
+    out.push_back(BIN_ROOM);
+    if (!encode_room(w, out)) {
+      return false;
+    }
+
+  } else if (kw == "HAND" || kw == "CARDS") {
+    out.push_back(kw == "HAND" ? BIN_HAND : BIN_CARDS);
+    if (!encode_cards(w, out)) {
+      return false;
+    }
+
+  } else if (kw == "TURN") {
+    out.push_back(BIN_TURN);
+    if (!encode_turn(w, out)) {
+      return false;
+    }
+
+  } else if (kw == "PLAYED") {
+    out.push_back(BIN_PLAYED);
+    if (!w.string(out) || !w.card(out)) {
+      return false;
+    }
+
+  } else if (kw == "DRAWED") {
+    out.push_back(BIN_DRAWED);
+    uint64_t n = 0;
+    if (!w.string(out) || !w.number(n)) {
+      return false;
+    }
+    put_varint(out, n);
+
+  } else if (kw == "STATE") {
+    out.push_back(BIN_STATE);
+    auto kind = w.next();
+    uint8_t k = index_of(kind, {"UNKNOWN", "UNNAMED", "LOBBY", "GAME"});
+    // bad state is reported as unknown, client reconnects anyway
+    out.push_back(k > 3 ? 0 : k);
+    if (kind == "GAME") {
+      return w.expect("ROOM") && encode_room(w, out) && w.expect("HAND") &&
+             encode_cards(w, out) && w.expect("TURN") &&
+             encode_turn(w, out) && w.done();
+    }
+    return true;
+
+  } else {
+    return false;
+  }
+
+  return w.done();
+}
+
+// false if buffer ends before the varint does
+bool get_varint(std::string_view b, size_t &pos, uint64_t &v) {
+  v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (pos >= b.size()) {
+      return false;
+    }
+    auto byte = static_cast<uint8_t>(b[pos++]);
+    v |= static_cast<uint64_t>(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  throw std::runtime_error("Too long varint in binary frame.");
+}
+
+} // namespace
+
+std::string Protocol::to_binary(std::string_view text) {
+  std::string body;
+  Words w(text);
+  if (!encode(w, body)) {
+    // no binary form, send the text body wrapped
+    body.clear();
+    body.push_back(BIN_TEXT);
+    auto start = text.find(MAGIC);
+    auto end = text.rfind(DELIM);
+    start = start == std::string_view::npos ? 0 : start + MAGIC.size();
+    end = end == std::string_view::npos || end < start ? text.size() : end;
+    put_string(body, text.substr(start, end - start));
+  }
+
+  std::string frame;
+  frame.reserve(body.size() + 2);
+  put_varint(frame, body.size());
+  frame += body;
+  return frame;
+}
+
+size_t Protocol::decode_binary(std::string_view buffer,
+                               std::span<std::string_view> words,
+                               std::span<char> scratch, size_t &count,
+                               Command &cmd) {
+  size_t pos = 0;
+  uint64_t len = 0;
+  if (!get_varint(buffer, pos, len)) {
+    return 0;
+  }
+  if (len == 0 || len > MAX_FRAME) {
+    throw std::runtime_error("Invalid binary frame length " +
+                             std::to_string(len));
+  }
+  if (buffer.size() - pos < len) {
+    return 0;
+  }
+
+  auto frame = buffer.substr(pos, len);
+  auto op = static_cast<uint8_t>(frame[0]);
+  cmd = op < CMD_UNKNOWN ? static_cast<Command>(op) : CMD_UNKNOWN;
+  words[0] = COMMAND_NAMES[cmd];
+  count = 1;
+
+  size_t i = 1;
+  switch (cmd) {
+  case CMD_NAME: {
+    uint64_t n = 0;
+    if (!get_varint(frame, i, n) || n == 0 || frame.size() - i < n) {
+      throw std::runtime_error("Invalid nick in binary NAME.");
+    }
+    auto nick = frame.substr(i, n);
+    // nick is sent as a word to text clients
+    for (char c : nick) {
+      if (std::isspace(static_cast<unsigned char>(c)) || c == DELIM[0]) {
+        throw std::runtime_error("Invalid character in binary nick.");
+      }
+    }
+    words[count++] = nick;
+    i += n;
+    // optional session token
+    if (i < frame.size()) {
+      if (!get_varint(frame, i, n) || n == 0 || frame.size() - i < n) {
+        throw std::runtime_error("Invalid token in binary NAME.");
+      }
+      words[count++] = frame.substr(i, n);
+      i += n;
+    }
+    break;
+  }
+  case CMD_JOIN_ROOM: {
+    uint64_t id = 0;
+    if (!get_varint(frame, i, id)) {
+      throw std::runtime_error("Invalid room id in binary JOIN_ROOM.");
+    }
+    auto [end, ec] =
+        std::to_chars(scratch.data(), scratch.data() + scratch.size(), id);
+    words[count++] = std::string_view(scratch.data(), end - scratch.data());
+    break;
+  }
+  case CMD_PLAY: {
+    if (frame.size() < 2) {
+      throw std::runtime_error("Missing card in binary PLAY.");
+    }
+    auto card = static_cast<uint8_t>(frame[i++]);
+    size_t suit = card >> 3;
+    size_t rank = card & 7;
+    // invalid card is refused by the handler like any other
+    scratch[0] = suit < SUITS.size() ? SUITS[suit] : 'N';
+    scratch[1] = RANKS[rank];
+    words[count++] = std::string_view(scratch.data(), 2);
+    break;
+  }
+  case CMD_OK:
+  case CMD_UNKNOWN:
+    // what is acknowledged doesn't matter, unknown ends the client anyway
+    i = frame.size();
+    break;
+  default:
+    break;
+  }
+
+  if (i != frame.size()) {
+    throw std::runtime_error("Unexpected payload in binary frame.");
+  }
+  return pos + len;
+}
+
+bool Protocol::could_validate(std::string_view msg) {
   if (msg.empty()) {
     return false;
   }
 
   // skip whitespaces on the beginning
   size_t i = 0;
-  while (i < msg.size() && std::isspace(msg[i])) {
+  while (i < msg.size() && std::isspace(static_cast<unsigned char>(msg[i]))) {
     i++;
   }
 
@@ -64,11 +402,11 @@ bool Protocol::could_validate(const std::string &msg) {
   return msg.size() > i + MAGIC.size();
 }
 
-bool Protocol::valid(const std::string &msg) {
+bool Protocol::valid(std::string_view msg) {
   size_t i = 0;
 
   // skip whitespaces on the beginning
-  while (i < msg.size() && std::isspace(msg[i])) {
+  while (i < msg.size() && std::isspace(static_cast<unsigned char>(msg[i]))) {
     i++;
   }
 
@@ -76,4 +414,17 @@ bool Protocol::valid(const std::string &msg) {
   return msg.compare(i, MAGIC.size(), MAGIC) == 0;
 }
 
+int Protocol::to_int(std::string_view word) {
+  int value = 0;
+  auto [end, ec] = std::from_chars(word.data(), word.data() + word.size(),
+                                   value);
+  if (ec == std::errc::result_out_of_range) {
+    throw std::out_of_range("Number out of range: " + std::string(word));
+  }
+  if (ec != std::errc()) {
+    throw std::invalid_argument("Not a number: " + std::string(word));
+  }
+  return value;
+}
+
 } // namespace prsi
@@ -1,42 +1,80 @@
 #pragma once
 
 #include "card.hpp"
+#include "command.hpp"
 #include "player.hpp"
 #include "room.hpp"
 #include "server.hpp"
+#include <array>
 #include <bits/types/wint_t.h>
+#include <cctype>
 #include <memory>
+#include <span>
 #include <string>
+#include <string_view>
 #include <sys/types.h>
 #include <vector>
 
 namespace prsi {
 
+// Opcodes of server messages in binary protocol, the client sends Command.
+// Frame = varint length of the rest, opcode byte, payload. Numbers are
+// varints, strings are varint length + bytes, card is one byte
+// (suit index << 3 | rank index, 0xFF = invalid).
+enum Bin_Op : uint8_t {
+  BIN_PING = 0x80,
+  BIN_SLEEP,        // nick
+  BIN_DEAD,         // nick
+  BIN_AWAKE,        // nick
+  BIN_STATE,        // kind byte, GAME is followed by ROOM, HAND, TURN payloads
+  BIN_ROOMS,        // count, # id, room state byte #
+  BIN_ROOM,         // id, state byte, count, # nick, asleep byte, hand size #
+  BIN_JOIN,         // nick
+  BIN_LEAVE,        // nick
+  BIN_GAME_START,   //
+  BIN_HAND,         // count, # card #
+  BIN_TURN,         // nick, card
+  BIN_PLAYED,       // nick, card
+  BIN_SKIP,         // nick
+  BIN_DRAWED,       // nick, count
+  BIN_CARDS,        // count, # card #
+  BIN_WIN,          //
+  BIN_LOSE,         //
+  BIN_OK,           // Command byte, OK NAME may add session token string
+  BIN_FAIL,         // Command byte
+  BIN_TEXT,         // string, text body of message without binary form
+  BIN_ROOM_ADDED,   // id, room state byte
+  BIN_ROOM_CHANGED, // id, room state byte
+  BIN_ROOM_REMOVED, // id
+};
+
 class Protocol {
 public:
   // WRITE
   // = control messages
   static std::string PING() { return build_message("PING"); }
-  static std::string SLEEP(std::shared_ptr<Player> p) {
-    std::string body = "SLEEP " + p->nick();
+  // sent instead of anything else, the connection is closed right after
+  static std::string FULL() { return build_message("FULL"); }
+  static std::string SLEEP(const Player &p) {
+    std::string body = "SLEEP " + p.nick();
 
     return build_message(body);
   }
-  static std::string DEAD(std::shared_ptr<Player> p) {
-    std::string body = "DEAD " + p->nick();
+  static std::string DEAD(const Player &p) {
+    std::string body = "DEAD " + p.nick();
 
     return build_message(body);
   }
-  static std::string AWAKE(std::shared_ptr<Player> p) {
-    std::string body = "AWAKE " + p->nick();
+  static std::string AWAKE(const Player &p) {
+    std::string body = "AWAKE " + p.nick();
 
     return build_message(body);
   }
-  static std::string STATE(Server &s, std::shared_ptr<Player> p) {
+  static std::string STATE(Server &s, const Player &p) {
     auto loc = s.where_player(p);
     std::string body = "STATE ";
 
-    auto room = loc.room_.lock();
+    auto *room = loc.room_;
     switch (loc.state_) {
     case Player_State::NON_EXISTING:
       body += "UNKNOWN";
@@ -54,7 +92,7 @@ public:
         break;
       }
       // just send normal room info
-      return ROOM(room);
+      return ROOM(*room);
     case Player_State::GAME:
       if (!room) {
         // some garbage
@@ -62,7 +100,9 @@ public:
         break;
       }
       body += "GAME \n";
-      body += strip(ROOM(room)) + "\n";
+      body += strip(*cached(room->snapshot(), false,
+                            [room]() { return ROOM(*room); })) +
+              "\n";
       body += strip(HAND(p)) + "\n";
       body += strip(TURN(room->current_turn()));
       break;
@@ -72,24 +112,36 @@ public:
   }
 
   // = lobby messages
-  static std::string ROOMS(std::vector<std::shared_ptr<Room>> &rs) {
+  static std::string ROOMS(const std::vector<Room_Summary> &rs) {
     std::string body = "ROOMS " + std::to_string(rs.size());
 
     for (const auto &r : rs) {
-      body += " " + std::to_string(r->id());
-      body += " " + to_string(r->state());
+      body += " " + std::to_string(r.id_);
+      body += " " + to_string(r.state_);
     }
 
     return build_message(body);
   }
+  // events for lobby players subscribed to rooms
+  static std::string ROOM_ADDED(const Room_Summary &r) {
+    return build_message("ROOM_ADDED " + std::to_string(r.id_) + " " +
+                         to_string(r.state_));
+  }
+  static std::string ROOM_CHANGED(const Room_Summary &r) {
+    return build_message("ROOM_CHANGED " + std::to_string(r.id_) + " " +
+                         to_string(r.state_));
+  }
+  static std::string ROOM_REMOVED(int id) {
+    return build_message("ROOM_REMOVED " + std::to_string(id));
+  }
 
   // = room messages
-  static std::string ROOM(std::shared_ptr<Room> r) {
-    std::string body = "ROOM " + std::to_string(r->id()) + " ";
-    body += to_string(r->state()) + " ";
+  static std::string ROOM(const Room &r) {
+    std::string body = "ROOM " + std::to_string(r.id()) + " ";
+    body += to_string(r.state()) + " ";
 
-    body += "PLAYERS " + std::to_string(r->players().size());
-    for (const auto &p : r->players()) {
+    body += "PLAYERS " + std::to_string(r.players().size());
+    for (const auto *p : r.players()) {
       body += " " + p->nick();
 
       std::string status = p->did_sleep_times() == 0 ? "AWAKE" : "SLEEP";
@@ -100,21 +152,21 @@ public:
 
     return build_message(body);
   }
-  static std::string JOIN(std::shared_ptr<Player> p) {
-    std::string body = "JOIN " + p->nick();
+  static std::string JOIN(const Player &p) {
+    std::string body = "JOIN " + p.nick();
 
     return build_message(body);
   }
-  static std::string LEAVE(std::shared_ptr<Player> p) {
-    std::string body = "LEAVE " + p->nick();
+  static std::string LEAVE(const Player &p) {
+    std::string body = "LEAVE " + p.nick();
 
     return build_message(body);
   }
 
   // = game messages
   static std::string GAME_START() { return build_message("GAME_START"); }
-  static std::string HAND(std::shared_ptr<Player> p) {
-    auto &hand = p->hand();
+  static std::string HAND(const Player &p) {
+    auto &hand = p.hand();
     std::string body = "HAND " + std::to_string(hand.size());
 
     for (const auto &c : hand) {
@@ -132,17 +184,17 @@ public:
     return build_message(body);
   }
 
-  static std::string PLAYED(std::shared_ptr<Player> p, const Card &c) {
-    std::string body = "PLAYED " + p->nick();
+  static std::string PLAYED(const Player &p, const Card &c) {
+    std::string body = "PLAYED " + p.nick();
     body += " " + c.to_string();
 
     return build_message(body);
   }
-  static std::string SKIP(std::shared_ptr<Player> p) {
-    return build_message("SKIP " + p->nick());
+  static std::string SKIP(const Player &p) {
+    return build_message("SKIP " + p.nick());
   }
-  static std::string DRAWED(std::shared_ptr<Player> p, int count) {
-    return build_message("DRAWED " + p->nick() + " " + std::to_string(count));
+  static std::string DRAWED(const Player &p, int count) {
+    return build_message("DRAWED " + p.nick() + " " + std::to_string(count));
   }
   static std::string CARDS(const std::vector<Card> &cards) {
     std::string body = "CARDS " + std::to_string(cards.size());
@@ -159,6 +211,9 @@ public:
 
   // = ok messages
   static std::string OK_NAME() { return build_message("OK NAME"); }
+  static std::string OK_NAME(const std::string &token) {
+    return build_message("OK NAME " + token);
+  }
   static std::string OK_JOIN_ROOM() { return build_message("OK JOIN_ROOM"); }
   static std::string OK_CREATE_ROOM() {
     return build_message("OK CREATE_ROOM");
@@ -173,20 +228,72 @@ public:
   static std::string FAIL_CREATE_ROOM() {
     return build_message("FAIL CREATE_ROOM");
   }
+  static std::string OK_PROTO() { return build_message("OK PROTO"); }
+  static std::string FAIL_PROTO() { return build_message("FAIL PROTO"); }
+
+  // BINARY
+  // the longest frame client may send
+  static constexpr size_t MAX_FRAME = 1'024;
+
+  // encode built text message as binary frame
+  static std::string to_binary(std::string_view text);
+
+  // message of the snapshot in given format, build() makes the text one if
+  // the snapshot was cleared, binary one is encoded from it on first use
+  template <typename Build>
+  static const Payload &cached(Snapshot &s, bool binary, Build build) {
+    if (!s.text_) {
+      s.text_ = make_payload(build());
+    }
+    if (!binary) {
+      return s.text_;
+    }
+    if (!s.binary_) {
+      s.binary_ = make_payload(to_binary(*s.text_));
+    }
+    return s.binary_;
+  }
+
+  // decode binary frame at the start of buffer into words like tokenize,
+  // numbers & cards are written as text into scratch, words may point there
+  // return size of the frame, 0 if it isn't complete yet
+  // throw if the frame is malformed
+  static size_t decode_binary(std::string_view buffer,
+                              std::span<std::string_view> words,
+                              std::span<char> scratch, size_t &count,
+                              Command &cmd);
 
   // READ
 
-  // return a message split by whitespaces into vector,
-  // if no complete message, return empty vector
-  // remove found messafge from mutable_string
-  static std::vector<std::string> extract_message(std::string &mutable_string);
+  // position right after the delimiter of the first message in buffer,
+  // searching from given position, npos if no message is complete
+  static size_t find_end(std::string_view buffer, size_t from) {
+    auto delim_start = buffer.find(DELIM, from);
+    if (delim_start == std::string_view::npos) {
+      return std::string_view::npos;
+    }
+    return delim_start + DELIM.size();
+  }
+
+  // split complete message by whitespaces into words, without magic & delim
+  // no allocation - words are views into msg
+  // the first word is recognized as command, message with unknown one isn't
+  // split any further (words contain only the command)
+  // return number of words, at most words.size()
+  // NOTE: no valid message has that many words, so the rest is dropped
+  template <size_t N>
+  static size_t tokenize(std::string_view msg,
+                         std::array<std::string_view, N> &words, Command &cmd);
 
   // could the message even be validated - is long enough?
-  static bool could_validate(const std::string &msg);
+  static bool could_validate(std::string_view msg);
 
   // validate any string without mutating
   // does string start with magic?
-  static bool valid(const std::string &msg);
+  static bool valid(std::string_view msg);
+
+  // parse number in message, throw like std::stoi if it isn't a number
+  static int to_int(std::string_view word);
 
 private:
   // WRITE
@@ -217,4 +324,48 @@ private:
   }
 };
 
+template <size_t N>
+size_t Protocol::tokenize(std::string_view msg,
+                          std::array<std::string_view, N> &words,
+                          Command &cmd) {
+  cmd = CMD_UNKNOWN;
+  size_t count = 0;
+  size_t i = 0;
+  while (i < msg.size() && count < N) {
+    // skip whitespaces
+    while (i < msg.size() && std::isspace(static_cast<unsigned char>(msg[i]))) {
+      i++;
+    }
+    // the whole msg only whitespaces - shouldn't happen, we have delim
+    if (i >= msg.size()) {
+      break;
+    }
+
+    size_t word_start = i;
+    while (i < msg.size() &&
+           !std::isspace(static_cast<unsigned char>(msg[i]))) {
+      i++;
+    }
+
+    // extract word
+    auto word = msg.substr(word_start, i - word_start);
+
+    // dont include magic and delim in result
+    if (word == MAGIC || word == DELIM) {
+      continue;
+    }
+    words[count++] = word;
+
+    // unknown command ends the client, its arguments don't matter
+    if (count == 1) {
+      cmd = parse_command(word);
+      if (cmd == CMD_UNKNOWN) {
+        break;
+      }
+    }
+  }
+
+  return count;
+}
+
 } // namespace prsi
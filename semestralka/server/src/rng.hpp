@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <random>
+
+namespace prsi {
+
+// Small fast PRNG (PCG32), one per room. Whole state is two words, so a room
+// can be moved to another thread & a game replayed from its seed.
+class Rng {
+public:
+  Rng() { seed(0); }
+  explicit Rng(uint64_t s) { seed(s); }
+
+  void seed(uint64_t s) {
+    state_ = 0;
+    next();
+    state_ += s;
+    next();
+  }
+
+  uint32_t next() {
+    uint64_t old = state_;
+    state_ = old * MULTIPLIER + INCREMENT;
+    uint32_t xorshifted = ((old >> 18) ^ old) >> 27;
+    uint32_t rot = old >> 59;
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+  }
+
+  // uniform in 0..n-1, n > 0 (Lemire's method, without modulo bias)
+  uint32_t below(uint32_t n) {
+    uint64_t m = uint64_t{next()} * n;
+    if (static_cast<uint32_t>(m) < n) {
+      uint32_t threshold = -n % n;
+      while (static_cast<uint32_t>(m) < threshold) {
+        m = uint64_t{next()} * n;
+      }
+    }
+    return m >> 32;
+  }
+
+  // Fresh seed for a new game. Only the first call on a thread asks the OS,
+  // the rest are derived by splitmix64.
+  static uint64_t make_seed() {
+    thread_local uint64_t s = (uint64_t{std::random_device{}()} << 32) ^
+                              std::random_device{}();
+    uint64_t z = (s += 0x9E3779B97F4A7C15);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+    return z ^ (z >> 31);
+  }
+
+private:
+  static constexpr uint64_t MULTIPLIER = 6364136223846793005ULL;
+  static constexpr uint64_t INCREMENT = 1442695040888963407ULL;
+
+  uint64_t state_ = 0;
+};
+
+} // namespace prsi
@@ -1,35 +1,34 @@
 #include "room.hpp"
 #include "card.hpp"
 #include "logger.hpp"
-#include <algorithm>
-#include <array>
-#include <memory>
-#include <random>
-#include <vector>
+#include <utility>
 
 namespace prsi {
 
 int Room::new_room_id_ = 0;
 
-void Room::setup_game() {
+void Room::setup_game(uint64_t seed) {
+  seed_ = seed;
+  rng_.seed(seed);
   generate_deck();
 
   // 1 card to have "TOP card"
-  pile_.push(deal_card());
+  cards_[tail_++ % DECK_SIZE] = deal_card();
 
   // deal cards to players
   for (auto &p : players()) {
     auto &hand = p->hand();
     for (int i = 0; i < start_hand_size_; i++) {
-      hand.push_front(deal_card());
+      hand.add(deal_card());
     }
   }
 
   // set first player
   current_player_idx_ = 0;
+  changed();
 }
 
-Turn Room::current_turn() {
+Turn Room::current_turn() const {
   if (state_ != Room_State::PLAYING) {
     return {};
   }
@@ -38,114 +37,77 @@ Turn Room::current_turn() {
   t.name_ = players_[current_player_idx()]->nick();
 
   // top card
-  auto top = top_card();
-  t.card_.rank_ = top.rank_;
-  t.card_.suit_ = top.suit_;
+  t.card_ = top_card();
 
   return t;
 }
 
 void Room::generate_deck() {
-  std::array<char, 8> ranks{'7', '8', '9', '0', 'J', 'Q', 'K', 'A'};
-  std::array<char, 4> suits{'Z', 'L', 'K', 'S'};
-
-  for (const auto &r : ranks) {
-    for (const auto &s : suits) {
-      deck_.emplace(s, r);
-    }
+  for (int i = 0; i < DECK_SIZE; i++) {
+    cards_[i] = Card(static_cast<uint8_t>(i));
   }
+  head_ = 0;
+  mid_ = tail_ = DECK_SIZE;
 
   shuffle_deck();
 }
 
 Card Room::deal_card() {
-  if (deck_.size() > 0) {
-    Card ret = deck_.front();
-    deck_.pop();
-    return ret;
-  }
-
-  // needs pile reshuffleing
-
-  if (pile_.size() < 1) {
-    // default return something - shouldn't happen, so have fun
-    return Card('H', '7');
-  }
-  // save top
-  Card top = pile_.front();
-  pile_.pop();
-
-  while (pile_.size() > 0) {
-    deck_.emplace(pile_.front());
-    pile_.pop();
-  }
-
-  // save top
-  pile_.emplace(top);
-
-  shuffle_deck();
-
-  if (deck_.size() < 0) {
-    // just another dummy card - shouldn't happen, 4fun
-    return Card('Z', 'K');
+  if (head_ == mid_) {
+    // needs pile reshuffleing, everything below the top becomes deck
+    if (pile_size() < 2) {
+      // shouldn't happen, all cards are in hands
+      return Card();
+    }
+    mid_ = tail_ - 1;
+    shuffle_deck();
   }
 
-  // retry with shuffled deck
-  return deal_card();
+  return cards_[head_++ % DECK_SIZE];
 }
 
 void Room::shuffle_deck() {
-  // temporary move cards to somewhere 'shuffeable'
-  std::vector<Card> tmp;
-  tmp.reserve(deck_.size());
-
-  while (!deck_.empty()) {
-    tmp.push_back(deck_.front());
-    deck_.pop();
-  }
-
-  // shuffle
-  static std::random_device rd;
-  static std::mt19937 gen(rd());
-  std::shuffle(tmp.begin(), tmp.end(), gen);
-
-  // move back
-  for (auto &c : tmp) {
-    deck_.push(c);
+  for (uint32_t n = deck_size(); n > 1; n--) {
+    uint32_t j = rng_.below(n);
+    std::swap(cards_[(head_ + n - 1) % DECK_SIZE],
+              cards_[(head_ + j) % DECK_SIZE]);
   }
 }
 
 bool Room::play_card(const Card &c) {
-  auto p = current_player();
-  if (!p->have_card(c)) {
-    Logger::warn("{} tried to play card, but didn't have it in hand ({}).",
+  auto &p = current_player();
+  if (!p.have_card(c)) {
+    Logger::warn(LOG_GAME,
+                 "{} tried to play card, but didn't have it in hand ({}).",
                  Logger::more(p), c.to_string());
     return false;
   }
 
-  auto &top = top_card();
+  Card top = top_card();
 
   // change suit
-  if (c.rank_ == 'Q') {
-    p->remove_card(c);
-    pile_.emplace(c);
+  if (c.rank() == 'Q') {
+    p.remove_card(c);
+    cards_[tail_++ % DECK_SIZE] = c;
     current_player_idx_++;
+    changed();
     return true;
   }
 
   // normal card
-  if (c.rank_ != top.rank_ && c.suit_ != top.suit_) {
+  if (c.rank() != top.rank() && c.suit() != top.suit()) {
     return false;
   }
 
-  p->remove_card(c);
-  pile_.emplace(c);
+  p.remove_card(c);
+  cards_[tail_++ % DECK_SIZE] = c;
   current_player_idx_++;
+  changed();
   return true;
 }
 
-std::weak_ptr<Player> Room::get_winner() {
-  std::weak_ptr<Player> winner;
+Player *Room::get_winner() {
+  Player *winner = nullptr;
 
   for (int i = 0; i < players_.size(); i++) {
     auto p = players_[i];
@@ -2,9 +2,10 @@
 
 #include "card.hpp"
 #include "player.hpp"
+#include "rng.hpp"
+#include <array>
 #include <cstddef>
-#include <memory>
-#include <queue>
+#include <cstdint>
 #include <string>
 #include <vector>
 namespace prsi {
@@ -27,6 +28,12 @@ constexpr std::string to_string(Room_State s) {
   return "UNKNOWN";
 }
 
+// what other shards need to know about a room
+struct Room_Summary {
+  int id_;
+  Room_State state_;
+};
+
 struct Turn {
   std::string name_;
   Card card_;
@@ -36,12 +43,25 @@ class Room {
   static int new_room_id_;
 
 private:
+  // own slot in the server slab
+  Handle handle_;
   int id_ = -1;
-  std::vector<std::shared_ptr<Player>> players_;
+  // owned by the server, which removes them from here before freeing
+  std::vector<Player *> players_;
   Room_State state_ = Room_State::OPEN;
-
-  std::queue<Card> deck_; // drawing deck
-  std::queue<Card> pile_; // throw-away pile
+  // ROOM message, cleared on every change it shows
+  Snapshot snapshot_;
+
+  // Cards not in hands, as ring buffer: drawing deck is [head_, mid_) and
+  // throw-away pile [mid_, tail_), its top at tail_ - 1. Indices only grow,
+  // slot = index % DECK_SIZE, there are never more than DECK_SIZE cards.
+  std::array<Card, DECK_SIZE> cards_;
+  uint32_t head_ = 0;
+  uint32_t mid_ = 0;
+  uint32_t tail_ = 0;
+  // game is reproducible from seed_ & moves of players
+  uint64_t seed_ = 0;
+  Rng rng_;
   int current_player_idx_ = -1;
   int start_hand_size_ = -1;
   int max_hand_size_ = 9;
@@ -54,43 +74,60 @@ public:
     }
   };
 
+  Handle handle() const { return handle_; }
+  void handle(Handle h) { handle_ = h; }
+
   int id() const { return id_; }
   Room_State state() const { return state_; }
-  void state(Room_State s) { state_ = s; }
+  void state(Room_State s) {
+    state_ = s;
+    changed();
+  }
+
+  Snapshot &snapshot() { return snapshot_; }
+  // state, players, their hand sizes or sleeping changed
+  void changed() { snapshot_.clear(); }
 
-  std::vector<std::shared_ptr<Player>> &players() { return players_; }
+  std::vector<Player *> &players() { return players_; }
+  const std::vector<Player *> &players() const { return players_; }
 
   bool should_begin_game(size_t required_players) {
     return state_ == Room_State::OPEN && (players_.size() == required_players);
   }
 
   // prepare game = deal cards & prepare pile/deck
-  void setup_game();
+  void setup_game() { setup_game(Rng::make_seed()); }
+  // same seed & same moves = same game
+  void setup_game(uint64_t seed);
+  uint64_t seed() const { return seed_; }
 
   // safe wrapper
-  int current_player_idx() { return current_player_idx_ % players_.size(); }
-  std::shared_ptr<Player> current_player() {
-    return players_[current_player_idx()];
+  int current_player_idx() const {
+    return current_player_idx_ % players_.size();
   }
+  Player &current_player() { return *players_[current_player_idx()]; }
   void advance_player() { current_player_idx_++; }
-  Turn current_turn();
+  Turn current_turn() const;
 
+  // Fisher-Yates in place, only the drawing deck
   void shuffle_deck();
-  // generate shuffled deck
+  // generate shuffled deck, pile is empty
   void generate_deck();
 
   // remove card from deck, ensure there exist at least one, otherwise shuffle
-  // from pile
+  // from pile, invalid card if even pile has only the top
   Card deal_card();
-  const Card &top_card() { return pile_.back(); }
+  const Card &top_card() const { return cards_[(tail_ - 1) % DECK_SIZE]; }
+  size_t deck_size() const { return mid_ - head_; }
+  size_t pile_size() const { return tail_ - mid_; }
 
   // current player play this card. if not possible return false, otherwise true
   // change current_player
   // WARN: WON'T evaluate A/7
   bool play_card(const Card &c);
 
-  // if game is over, return winner. otherwise return pointer
-  std::weak_ptr<Player> get_winner();
+  // if game is over, return winner. otherwise return nullptr
+  Player *get_winner();
 };
 
 } // namespace prsi
@@ -5,21 +5,24 @@
 #include "player.hpp"
 #include "protocol.hpp"
 #include "room.hpp"
+#include "rng.hpp"
 #include <algorithm>
 #include <arpa/inet.h>
 #include <asm-generic/socket.h>
 #include <cerrno>
+#include <charconv>
 #include <chrono>
 #include <cstring>
 #include <exception>
 #include <fcntl.h>
+#include <fmt/core.h>
 #include <functional>
 #include <memory>
 #include <netinet/in.h>
 #include <string>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
-#include <sys/timerfd.h>
 #include <unistd.h>
 #include <unordered_map>
 
@@ -27,39 +30,82 @@ namespace prsi {
 
 // static part
 
-const std::unordered_map<std::string, Server::Handler> Server::handlers_ = {
-    {"PONG", &Server::handle_pong},
-    {"NAME", &Server::handle_name},
-    {"LIST_ROOMS", &Server::handle_list_rooms},
-    {"JOIN_ROOM", &Server::handle_join_room},
-    {"CREATE_ROOM", &Server::handle_create_room},
-    {"LEAVE_ROOM", &Server::handle_leave_room},
-    {"ROOM_INFO", &Server::handle_room_info},
-    {"STATE", &Server::handle_state},
-    {"PLAY", &Server::handle_play},
-    {"DRAW", &Server::handle_draw},
+const std::array<Server::Handler, CMD_COUNT> Server::handlers_ = {
+    &Server::handle_pong,            // CMD_PONG
+    &Server::handle_name,            // CMD_NAME
+    &Server::handle_list_rooms,      // CMD_LIST_ROOMS
+    &Server::handle_join_room,       // CMD_JOIN_ROOM
+    &Server::handle_create_room,     // CMD_CREATE_ROOM
+    &Server::handle_leave_room,      // CMD_LEAVE_ROOM
+    &Server::handle_room_info,       // CMD_ROOM_INFO
+    &Server::handle_state,           // CMD_STATE
+    &Server::handle_play,            // CMD_PLAY
+    &Server::handle_draw,            // CMD_DRAW
+    &Server::handle_proto,           // CMD_PROTO
+    &Server::handle_ok,              // CMD_OK
+    &Server::handle_subscribe_rooms, // CMD_SUBSCRIBE_ROOMS
+    &Server::handle_unknown,         // CMD_UNKNOWN
 };
 
 // other
 
 Server::~Server() {
+  // nobody is listening anymore, don't message other shards
+  running_ = false;
+
   // close all connections
-  for (auto &p : list_players()) {
-    terminate_player(p);
+  for (auto *p : list_players()) {
+    terminate_player(*p);
   }
   // close listen socket
   close(listen_fd_);
   // close epoll socket
-  close(epoll_fd_);
+  if (epoll_fd_ != -1) {
+    close(epoll_fd_);
+  }
+  if (inbox_fd_ != -1) {
+    close(inbox_fd_);
+  }
 }
 
-Server::Server(const Config &cfg)
-    : port_(cfg.port_), epoll_max_events_(cfg.epoll_max_events_),
+Server::Server(const Config &cfg, Cluster *cluster, int shard)
+    : cluster_(cluster), shard_(shard), port_(cfg.port_),
+      epoll_max_events_(cfg.epoll_max_events_),
       epoll_timeout_ms_(cfg.epoll_timeout_ms_), max_clients_(cfg.max_clients_),
       ping_timeout_ms_(cfg.ping_timeout_ms_),
       sleep_timeout_ms_(cfg.sleep_timeout_ms_),
       death_timeout_ms_(cfg.death_timeout_ms_), ip_(cfg.ip_),
-      max_rooms_(cfg.max_rooms_), kick_timer_ms_(cfg.kick_timer_ms_) {
+      max_rooms_(cfg.max_rooms_), kick_timer_ms_(cfg.kick_timer_ms_),
+      io_backend_(cfg.io_backend_), cork_(cfg.cork_),
+      session_tokens_(cfg.session_tokens_),
+      listen_backlog_(cfg.listen_backlog_), accept_batch_(cfg.accept_batch_),
+      admission_(cfg.admission_),
+      output_soft_limit_(std::max(cfg.output_soft_limit_, 0)),
+      output_hard_limit_(std::max(cfg.output_hard_limit_, 0)),
+      message_budget_(std::max(cfg.message_budget_, 0)) {
+
+  for (int c = 0; c < CLASS_COUNT; c++) {
+    const auto &limit = cfg.rate_limits_[c];
+    if (limit.rate_ > 0) {
+      class_rates_[c].interval_ =
+          std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+              std::chrono::seconds(1)) /
+          limit.rate_;
+      class_rates_[c].burst_ = std::max(limit.burst_, 1);
+    }
+  }
+
+  // reactors share the client limit, each expects its part of clients
+  if (cluster_) {
+    clients_ = &cluster_->clients();
+  }
+  if (shards() > 1) {
+    remote_rooms_.resize(shards());
+  }
+
+  // all slots are made now, so no allocation happens per connection
+  player_slab_.reserve((max_clients_ + shards() - 1) / shards());
+  room_slab_.reserve(max_rooms_);
 
   events_.resize(epoll_max_events_);
   setup();
@@ -67,12 +113,22 @@ Server::Server(const Config &cfg)
 
 void Server::run() {
   running_ = true;
+  if (io_backend_ == Io_Backend::IO_URING) {
+    run_uring();
+  } else {
+    run_epoll();
+  }
+}
+
+void Server::run_epoll() {
   while (running_) {
+    now_ = std::chrono::steady_clock::now();
+    int timeout = loop_timeout();
+
     // wait for n events to happen
     // n it at most epoll_max_events_
     // if dont have enough events before timeout, stops either
-    int n = epoll_wait(epoll_fd_, events_.data(), epoll_max_events_,
-                       epoll_timeout_ms_);
+    int n = epoll_wait(epoll_fd_, events_.data(), epoll_max_events_, timeout);
 
     // some fail in epoll_wait
     if (n == -1) {
@@ -82,6 +138,9 @@ void Server::run() {
       throw std::runtime_error("epoll_wait failed.");
     }
 
+    now_ = std::chrono::steady_clock::now();
+    resume_deferred();
+
     // check all happened events
     for (int i = 0; i < n; i++) {
       epoll_event &ev = events_[i];
@@ -89,8 +148,8 @@ void Server::run() {
       if (ev.data.fd == listen_fd_) { // NEW CONNECTION
         accept_connection();
 
-      } else if (is_timer_fd(ev.data.fd)) {
-        handle_timer(ev.data.fd);
+      } else if (ev.data.fd == inbox_fd_) { // OTHER SHARDS
+        drain_inbox();
 
       } else if (ev.events & EPOLLIN) { // RECV
         receive(ev.data.fd);
@@ -104,12 +163,93 @@ void Server::run() {
       }
     }
 
-    // check for timeouts
-    for (auto &p : list_players()) {
-      maybe_ping(p);
-      check_pong(p);
+    end_iteration();
+  }
+}
+
+void Server::run_uring() {
+  // created by the thread which uses it, ring has single issuer
+  uring_ = std::make_unique<Uring>(URING_ENTRIES);
+  uring_->setup_buffers(URING_BUFFER_GROUP, URING_BUFFERS, URING_BUFFER_SIZE);
+  Logger::info(LOG_NET, "Using io_uring backend, reactor={}", shard_);
+
+  uring_accept();
+  if (inbox_fd_ != -1) {
+    uring_->poll_multishot(inbox_fd_, user_data(OP_INBOX, inbox_fd_, 0));
+  }
+
+  while (running_) {
+    now_ = std::chrono::steady_clock::now();
+
+    // everything queued during last iteration (sends, re-armed recvs) goes to
+    // kernel in one syscall, which also waits for completions
+    uring_->submit_and_wait(loop_timeout());
+
+    now_ = std::chrono::steady_clock::now();
+    resume_deferred();
+
+    uring_->for_each_completion(
+        [this](const io_uring_cqe &cqe) { handle_completion(cqe); });
+
+    end_iteration();
+  }
+}
+
+int Server::loop_timeout() {
+  // messages are waiting, only look at what else happened
+  if (!deferred_.empty()) {
+    return 0;
+  }
+  // sleep only until the nearest timer
+  // configured timeout (if any) is the upper limit
+  int timeout = timers_.next_timeout_ms(now_);
+  if (epoll_timeout_ms_ >= 0 &&
+      (timeout == -1 || timeout > epoll_timeout_ms_)) {
+    timeout = epoll_timeout_ms_;
+  }
+  return timeout;
+}
+
+void Server::end_iteration() {
+  // only timers which are due, not every player
+  expired_.clear();
+  timers_.advance(now_, expired_);
+  for (const auto &t : expired_) {
+    handle_timer(t);
+  }
+
+  publish_rooms();
+  announce_rooms();
+  // somebody may have left during this iteration, other shards wake this
+  // one up by ACCEPT_RESUME
+  resume_accepting();
+
+  // after everything else, which may produce output
+  flush_dirty();
+}
+
+void Server::mark_dirty(Player &p) {
+  if (p.dirty()) {
+    return;
+  }
+  p.dirty(true);
+  dirty_.push_back(p.handle());
+}
+
+void Server::flush_dirty() {
+  // flushing may terminate player & produce output for others, so the vector
+  // can grow meanwhile
+  for (size_t i = 0; i < dirty_.size(); i++) {
+    auto *p = player_slab_.get(dirty_[i]);
+    if (!p) {
+      continue;
+    }
+    p->dirty(false);
+    if (p->valid_fd()) {
+      p->try_flush();
     }
   }
+  dirty_.clear();
 }
 
 void Server::setup() {
@@ -125,6 +265,11 @@ void Server::setup() {
       -1) {
     throw std::runtime_error("Cannot set socket options.");
   }
+  // every reactor has its own listen socket on the same port
+  if (shards() > 1 && setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEPORT, &opt,
+                                 sizeof(opt)) == -1) {
+    throw std::runtime_error("Cannot set socket option SO_REUSEPORT.");
+  }
 
   // set non blocking
   if (set_fd_nonblocking(listen_fd_) == -1) {
@@ -145,25 +290,40 @@ void Server::setup() {
     throw std::runtime_error("Cannot bind listen socket.");
   }
 
-  // set listen to only hardware limited number of connections
-  if (listen(listen_fd_, SOMAXCONN) == -1) {
+  if (listen(listen_fd_, listen_backlog_) == -1) {
     throw std::runtime_error("Cannot listen.");
   }
 
-  // NOTE: is used create1, because is newer & better
-  epoll_fd_ = epoll_create1(0);
-
-  if (epoll_fd_ == -1) {
-    Logger::error("epoll_create failed. errno {}: {}", errno,
-                  std::strerror(errno));
-    throw std::runtime_error("Cannot create epoll.");
+  // messages from other reactors
+  if (shards() > 1) {
+    inbox_fd_ = eventfd(0, EFD_NONBLOCK);
+    if (inbox_fd_ == -1) {
+      throw std::runtime_error("Cannot create reactor inbox.");
+    }
   }
 
-  if (set_epoll_events(listen_fd_, EPOLLIN, true) == -1) {
-    throw std::runtime_error("Cannot add listening socket to epoll.");
+  // listen socket & inbox are watched by multishot requests in run_uring()
+  if (io_backend_ != Io_Backend::IO_URING) {
+    // NOTE: is used create1, because is newer & better
+    epoll_fd_ = epoll_create1(0);
+
+    if (epoll_fd_ == -1) {
+      Logger::error(LOG_NET, "epoll_create failed. errno {}: {}", errno,
+                    std::strerror(errno));
+      throw std::runtime_error("Cannot create epoll.");
+    }
+
+    if (set_epoll_events(listen_fd_, EPOLLIN, true) == -1) {
+      throw std::runtime_error("Cannot add listening socket to epoll.");
+    }
+
+    if (inbox_fd_ != -1 && set_epoll_events(inbox_fd_, EPOLLIN, true) == -1) {
+      throw std::runtime_error("Cannot add reactor inbox to epoll.");
+    }
   }
 
-  Logger::info("Server now listen on IP={}, PORT={}", ip_, port_);
+  Logger::info(LOG_NET, "Server now listen on IP={}, PORT={}, reactor={}", ip_,
+               port_, shard_);
 }
 
 int Server::set_fd_nonblocking(int fd) {
@@ -188,60 +348,160 @@ int Server::set_epoll_events(int fd, uint32_t events, bool creating) {
 }
 
 void Server::accept_connection() {
-  sockaddr_in client_addr{};
-  socklen_t addr_len = sizeof(client_addr);
-
-  int client_fd = accept(listen_fd_, (sockaddr *)&client_addr, &addr_len);
-  if (client_fd == -1) {
-    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+  // listen socket is level-triggered, what is left wakes the next iteration
+  for (int i = 0; i < accept_batch_ && !accept_paused_; i++) {
+    // the server may have got full on other shard, clients wait in backlog
+    if (admission_ == ADMIT_PAUSE && count_players() >= max_clients_) {
+      pause_accepting();
       return;
     }
-    Logger::error("accept() failed");
-    return;
+    // socket comes non-blocking, no fcntl needed
+    int client_fd =
+        accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      }
+      // client gave up while waiting in backlog
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      static Log_Limit limit{std::chrono::seconds(1)};
+      Logger::error(limit, LOG_NET, "accept() failed: {}",
+                    std::strerror(errno));
+      return;
+    }
+
+    admit(client_fd);
   }
+}
+
+bool Server::reserve_client() {
+  // other shards admit at the same time
+  int n = clients_->load(std::memory_order_relaxed);
+  do {
+    if (n >= max_clients_) {
+      return false;
+    }
+  } while (!clients_->compare_exchange_weak(n, n + 1,
+                                            std::memory_order_relaxed));
+  return true;
+}
 
+void Server::admit(int client_fd) {
   // do we have space for new connection?
-  if (count_players() >= max_clients_) {
-    close(client_fd);
-    Logger::warn("Max clients reached, rejecting connection");
+  if (!reserve_client()) {
+    // full on other shard before it told this one, the connection can't go
+    // back to backlog
+    if (admission_ == ADMIT_PAUSE) {
+      pause_accepting();
+    }
+    reject(client_fd);
     return;
   }
 
-  // setup client socket
-  if (set_fd_nonblocking(client_fd))
-    throw std::runtime_error("set fd nonblocking failed for fd=" +
-                             std::to_string(client_fd));
+  if (uring_) {
+    uring_watch(client_fd);
 
-  // add to epoll
-  if (set_epoll_events(client_fd, EPOLLIN, true) == -1) {
-    close(client_fd);
-    Logger::error("Cannot add client to epoll, closing connection for fd={}",
-                  client_fd);
-    return;
+  } else {
+    // add to epoll
+    if (set_epoll_events(client_fd, EPOLLIN, true) == -1) {
+      clients_->fetch_sub(1, std::memory_order_relaxed);
+      close(client_fd);
+      Logger::error(LOG_NET,
+                    "Cannot add client to epoll, closing connection for fd={}",
+                    client_fd);
+      return;
+    }
   }
 
   // create new client
-  auto player = std::make_shared<Player>(*this, client_fd);
-  unnamed_.emplace_back(player);
+  metrics_.accepted_.add();
+  auto &player = new_player(client_fd);
+  unnamed_.push_back(&player);
+  player.location(Player_State::UNNAMED);
+  start_player_timers(player);
+
+  Logger::info(LOG_NET, "New client connected, fd={}", client_fd);
+
+  // the last place is taken, the next clients wait in backlog
+  if (admission_ == ADMIT_PAUSE && count_players() >= max_clients_) {
+    pause_accepting();
+    if (cluster_) {
+      cluster_->pause_accepting(shard_);
+    }
+  }
+}
 
-  Logger::info("New client connected, fd={}", client_fd);
+void Server::reject(int client_fd) {
+  // best effort, client may not read it at all
+  auto msg = Protocol::FULL();
+  send(client_fd, msg.data(), msg.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+  close(client_fd);
+
+  metrics_.rejected_.add();
+  static Log_Limit limit{std::chrono::seconds(1)};
+  Logger::warn(limit, LOG_NET, "Max clients reached, rejecting connection");
+}
+
+void Server::pause_accepting() {
+  if (accept_paused_) {
+    return;
+  }
+  accept_paused_ = true;
+  metrics_.accept_pauses_.add();
+
+  if (uring_) {
+    uring_->cancel(user_data(OP_ACCEPT, listen_fd_, accept_gen_),
+                   user_data(OP_CANCEL, listen_fd_, accept_gen_));
+  } else if (epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, listen_fd_, nullptr) == -1) {
+    Logger::error(LOG_NET, "Cannot remove listen socket from epoll: {}",
+                  std::strerror(errno));
+  }
+  Logger::warn(LOG_NET, "Max clients reached, accepting paused, reactor={}",
+               shard_);
+}
+
+void Server::resume_accepting() {
+  if (!accept_paused_ || count_players() >= max_clients_) {
+    return;
+  }
+  accept_paused_ = false;
+
+  if (uring_) {
+    // the cancelled request may still complete, it must not be re-armed
+    accept_gen_++;
+    uring_accept();
+  } else if (set_epoll_events(listen_fd_, EPOLLIN, true) == -1) {
+    Logger::error(LOG_NET, "Cannot add listen socket to epoll: {}",
+                  std::strerror(errno));
+  }
+  Logger::info(LOG_NET, "Accepting resumed, reactor={}", shard_);
+}
+
+void Server::uring_accept() {
+  auto data = user_data(OP_ACCEPT, listen_fd_, accept_gen_);
+  // multishot would take the whole backlog at once, even over MC
+  if (admission_ == ADMIT_PAUSE) {
+    uring_->accept(listen_fd_, data);
+  } else {
+    uring_->accept_multishot(listen_fd_, data);
+  }
 }
 
 void Server::receive(int fd) {
-  auto weak_p = find_player(fd);
-  auto p = weak_p.lock();
+  auto *p = find_player(fd);
   if (!p) {
-    Logger::error("Receive: Player with id={} was not found anywhere.",
+    Logger::error(LOG_NET, "Receive: Player with id={} was not found anywhere.",
                   std::to_string(fd));
-    if (p->valid_fd()) {
-      close_connection(fd);
-    }
+    close_connection(fd);
     return;
   }
 
   if (!p->valid_fd()) {
-    Logger::info("{} does not have valid socket connected, cannot receive.",
-                 Logger::more(p));
+    Logger::info(LOG_NET,
+                 "{} does not have valid socket connected, cannot receive.",
+                 Logger::more(*p));
     return;
   }
 
@@ -250,190 +510,280 @@ void Server::receive(int fd) {
 
     // any exception = terminate
   } catch (const std::exception &ex) {
-    Logger::error("Cannot receive from client fd={}, because: '{}'.", p->fd(),
-                  ex.what());
-    terminate_player(p);
+    Logger::error(LOG_NET, "Cannot receive from client fd={}, because: '{}'.",
+                  p->fd(), ex.what());
+    terminate_player(*p);
+    return;
   }
 
+  process_buffered(fd);
+}
+
+void Server::process_buffered(int fd) {
+  // look the player up for every message, because after reconnect the fd
+  // belongs to other player object and after handoff or terminate to nobody
+  auto *p = from_index(fd);
+  int processed = 0;
+
   try { // process messages
 
-    auto msg = p->complete_recv_msg();
-    while (!msg.empty()) {
-      process_message(msg, p);
+    Tokens msg;
+    Command cmd;
+    while (p && p->complete_recv_msg(msg, cmd)) {
+      // the rest waits, so one client can't hold up the others
+      if (message_budget_ > 0 && processed == message_budget_) {
+        p->unread_msg();
+        if (!p->deferred()) {
+          p->deferred(true);
+          deferred_.push_back(p->handle());
+        }
+        metrics_.budget_deferrals_.add();
+        break;
+      }
+      if (!take_token(*p, cmd)) {
+        p->unread_msg();
+        break;
+      }
+      process_message(msg, cmd, *p);
+      processed++;
 
-      msg = p->complete_recv_msg();
+      p = from_index(fd);
     }
 
     // received invalid message - doesn't start with magic
   } catch (const std::exception &ex) {
-    Logger::error("Invalid message received from fd={}, what? {}", p->fd(),
-                  ex.what());
-    terminate_player(p);
+    Logger::error(LOG_PROTOCOL, "Invalid message received from fd={}, what? {}",
+                  p->fd(), ex.what());
+    terminate_player(*p);
   }
 }
 
+bool Server::take_token(Player &p, Command cmd) {
+  auto c = COMMAND_CLASSES[cmd];
+  const auto &rate = class_rates_[c];
+  if (rate.burst_ == 0) {
+    return true;
+  }
+  auto &bucket = p.bucket(c);
+  if (bucket.take(now_, rate.interval_, rate.burst_)) {
+    return true;
+  }
+
+  // continue when the bucket has a token again
+  if (!p.timer(Timer_Kind::THROTTLE_END)) {
+    metrics_.rate_limited_.add();
+    Logger::debug(LOG_PROTOCOL, "{} is over the rate limit of {}.",
+                  Logger::more(p), COMMAND_NAMES[cmd]);
+    schedule_timer(p, Timer_Kind::THROTTLE_END,
+                   bucket.next_token(rate.interval_, rate.burst_));
+  }
+  return false;
+}
+
+void Server::resume_deferred() {
+  if (deferred_.empty()) {
+    return;
+  }
+  // processing may defer the players again, into the emptied list
+  resuming_.swap(deferred_);
+  for (auto h : resuming_) {
+    auto *p = player_slab_.get(h);
+    if (!p) {
+      continue;
+    }
+    p->deferred(false);
+    if (p->valid_fd()) {
+      process_buffered(p->fd());
+    }
+  }
+  resuming_.clear();
+}
+
 void Server::server_send(int fd) {
-  auto weak_p = find_player(fd);
-  auto p = weak_p.lock();
+  auto *p = find_player(fd);
   if (!p) {
-    Logger::error("Send: Player with id={} was not found anywhere.", fd);
+    Logger::error(LOG_NET, "Send: Player with id={} was not found anywhere.",
+                  fd);
+    return;
   }
 
   p->try_flush();
 }
 
 void Server::disconnect(int fd) {
-  auto weak_p = find_player(fd);
-  auto p = weak_p.lock();
+  auto *p = find_player(fd);
   if (!p) {
-    Logger::error("Disconnect: Player with id={} was not found anywhere.", fd);
+    Logger::error(LOG_NET,
+                  "Disconnect: Player with id={} was not found anywhere.", fd);
+    return;
   }
 
-  terminate_player(p);
+  terminate_player(*p);
 }
 
-int Server::count_players() const {
-  int count = 0;
+int Server::count_rooms() const {
+  int count = rooms_.size();
 
-  for (const auto &p : unnamed_) {
-    count++;
-  }
-
-  for (const auto &p : lobby_) {
-    count++;
-  }
-
-  for (const auto &r : rooms_) {
-    for (const auto &p : r->players()) {
-      count++;
-    }
+  for (const auto &remote : remote_rooms_) {
+    count += remote.size();
   }
 
   return count;
 }
 
 void Server::on_socket_lost(int fd) {
-  auto weak_p = find_player(fd);
-  auto p = weak_p.lock();
+  auto *p = find_player(fd);
   if (!p) {
     close_connection(fd);
     return;
   }
 
-  Logger::warn("{} lost connection, starting grace timer.", Logger::more(p));
+  Logger::warn(LOG_TIMER, "{} lost connection, starting grace timer.",
+               Logger::more(*p));
 
   close_connection(fd);
 
   // mark player as disconnected
   p->valid_fd(false);
 
-  start_disconnect_timer(p);
+  start_disconnect_timer(*p);
 }
 
-void Server::start_disconnect_timer(std::shared_ptr<Player> p) {
+void Server::start_disconnect_timer(Player &p) {
   // If already running, don't start twice
-  if (p->tfd() != -1) {
+  if (p.timer(Timer_Kind::RECONNECT_KICK) != 0) {
     return;
   }
 
-  int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
-  if (tfd == -1) {
-    Logger::error("timerfd_create failed: {}", std::strerror(errno));
-    return;
-  }
+  schedule_timer(p, Timer_Kind::RECONNECT_KICK,
+                 now_ + std::chrono::milliseconds(kick_timer_ms_));
+  Logger::info(LOG_TIMER, "{} started reconnect timer.", Logger::more(p));
+}
+
+void Server::stop_disconnect_timer(Player &p) {
+  // the timer stays in wheel, but is ignored when expires
+  p.timer(Timer_Kind::RECONNECT_KICK, 0);
+}
 
-  itimerspec spec{};
-  spec.it_value.tv_sec = kick_timer_ms_ / 1000;
-  spec.it_interval.tv_sec = 0; // one-time run only
+void Server::handle_disconnect_timer(Player &p) {
+  Logger::warn(LOG_TIMER, "{} Reconnect timer expired.", Logger::more(p));
 
-  if (timerfd_settime(tfd, 0, &spec, nullptr) == -1) {
-    Logger::error("timerfd_settime failed: {}", std::strerror(errno));
-    close(tfd);
-    return;
+  // if still not reconnected kick from game
+  if (!p.valid_fd()) {
+    remove_from_game_server(p);
+    free_player(p);
   }
+}
 
-  epoll_event ev{};
-  ev.events = EPOLLIN;
-  ev.data.fd = tfd;
+void Server::start_player_timers(Player &p) {
+  schedule_timer(p, Timer_Kind::PING_DUE,
+                 p.get_last_ping() +
+                     std::chrono::milliseconds(ping_timeout_ms_));
+  // +1 because the timeout must be exceeded, not only reached
+  schedule_timer(p, Timer_Kind::PONG_CHECK,
+                 p.get_last_pong() +
+                     std::chrono::milliseconds(sleep_timeout_ms_ + 1));
+}
 
-  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, tfd, &ev) == -1) {
-    Logger::error("epoll_ctl ADD timer failed: {}", std::strerror(errno));
-    close(tfd);
+void Server::schedule_timer(Player &p, Timer_Kind kind,
+                            std::chrono::steady_clock::time_point when) {
+  p.timer(kind, timers_.schedule(when, kind, p.handle()));
+}
+
+void Server::handle_timer(const Timer &t) {
+  auto *p = player_slab_.get(t.player_);
+  // player is gone or timer was replaced/cancelled
+  if (!p || p->timer(t.kind_) != t.id_) {
     return;
   }
+  p->timer(t.kind_, 0);
 
-  Logger::info("{} started reconnect timer.", Logger::more(p));
-  p->tfd(tfd);
-}
-
-bool Server::is_timer_fd(int fd) {
-  for (auto &p : list_players()) {
-    if (p->tfd() == fd) {
-      return true;
+  switch (t.kind_) {
+  case Timer_Kind::PING_DUE:
+    maybe_ping(*p);
+    break;
+  case Timer_Kind::PONG_CHECK:
+    check_pong(*p);
+    break;
+  case Timer_Kind::RECONNECT_KICK:
+    handle_disconnect_timer(*p);
+    break;
+  case Timer_Kind::THROTTLE_END:
+    if (p->valid_fd()) {
+      process_buffered(p->fd());
     }
+    break;
   }
-  return false;
 }
 
-void Server::handle_timer(int tfd) {
-  // find which player this belongs to
-  for (auto &p : list_players()) {
-    if (p->tfd() != tfd) {
-      continue;
-    }
-
-    uint64_t expirations;
-    read(tfd, &expirations, sizeof(expirations)); // must drain
-
-    Logger::warn("{} Reconnect timer expired.", Logger::more(p));
-
-    // remove from epoll
-    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, tfd, nullptr);
-    close(tfd);
-    p->tfd(-1);
+void Server::terminate_player(Player &p) {
+  remove_from_game_server(p);
+  Logger::info(LOG_GAME, "Player {}, fd={}, removed from the whole game.",
+               p.nick(), p.fd());
 
-    // if still not reconnected kick from game
-    if (!p->valid_fd()) {
-      remove_from_game_server(p);
-    }
+  // timer would otherwise outlive the player
+  stop_disconnect_timer(p);
 
-    return;
+  if (p.valid_fd()) {
+    close_connection(p.fd());
   }
+  free_player(p);
 }
 
-void Server::terminate_player(std::shared_ptr<Player> p) {
-  remove_from_game_server(p);
-  Logger::info("Player {}, fd={}, removed from the whole game.", p->nick(),
-               p->fd());
+Player &Server::new_player(int fd) {
+  auto h = player_slab_.emplace(*this, fd);
+  auto &p = *player_slab_.get(h);
+  p.handle(h);
+  index_fd(fd, p);
+  return p;
+}
 
-  if (p->valid_fd()) {
-    close_connection(p->fd());
+void Server::free_player(Player &p, bool handed_off) {
+  // handles in timers, dirty list & fd index go stale with it
+  if (!p.nick().empty()) {
+    unindex_nick(p);
+  }
+  player_slab_.erase(p.handle());
+  if (!handed_off) {
+    clients_->fetch_sub(1);
+    // this shard resumes at the end of iteration, the others are woken up
+    if (cluster_ && admission_ == ADMIT_PAUSE) {
+      cluster_->resume_accepting(shard_);
+    }
   }
 }
 
 void Server::close_connection(int fd) {
-  // remove from epoll
-  auto res = epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
-  Logger::info("fd={}, removed from epoll.", fd);
-  if (res == -1) {
-    Logger::error("Error when removing player from epoll: {}",
-                  std::strerror(errno));
+  unindex_fd(fd);
+
+  if (uring_) {
+    uring_unwatch(fd);
+
+  } else {
+    // remove from epoll
+    auto res = epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+    Logger::info(LOG_NET, "fd={}, removed from epoll.", fd);
+    if (res == -1) {
+      Logger::error(LOG_NET, "Error when removing player from epoll: {}",
+                    std::strerror(errno));
+    }
   }
 
   // close connection
   close(fd);
-  Logger::info("Closed connection fd={}.", fd);
+  Logger::info(LOG_NET, "Closed connection fd={}.", fd);
 }
 
-void Server::remove_from_game_server(std::shared_ptr<Player> p) {
+void Server::remove_from_game_server(Player &p) {
   // find where the player is & lock them down
   auto location = where_player(p);
 
   // find players owning vector
-  std::reference_wrapper<std::vector<std::shared_ptr<Player>>> owner = unnamed_;
+  std::reference_wrapper<std::vector<Player *>> owner = unnamed_;
   switch (location.state_) {
   case Player_State::NON_EXISTING: // should not happen
-    Logger::error("{} have no related socekt on the server", Logger::more(p));
+    Logger::error(LOG_NET, "{} have no related socekt on the server",
+                  Logger::more(p));
     return;
   case Player_State::UNNAMED:
     owner = unnamed_;
@@ -443,16 +793,16 @@ void Server::remove_from_game_server(std::shared_ptr<Player> p) {
     break;
   case Player_State::ROOM:
   case Player_State::GAME:
-    auto room = location.room_.lock();
+    auto *room = location.room_;
     if (!room) {
-      Logger::error("{} is in not-existing room.", Logger::more(p));
+      Logger::error(LOG_GAME, "{} is in not-existing room.", Logger::more(p));
       return;
     }
 
     try {
       // move player from room to lobby
-      broadcast_to_room(room, Protocol::DEAD(p), {p->fd()});
-      leave_room(p, room);
+      broadcast_to_room(*room, Protocol::DEAD(p), {p.fd()});
+      leave_room(p, *room);
       owner = lobby_;
 
     } catch (const std::exception &ex) {
@@ -464,157 +814,157 @@ void Server::remove_from_game_server(std::shared_ptr<Player> p) {
   }
 
   // delete player from any owning vector
-  auto &vec = owner.get();
-  auto fd = p->fd();
-  erase_by_fd(vec, fd);
+  std::erase(owner.get(), &p);
+  p.location(Player_State::NON_EXISTING);
+
+  notify_gone(p);
 }
 
-std::vector<std::shared_ptr<Player>> Server::list_players() {
-  std::vector<std::shared_ptr<Player>> result;
+std::vector<Player *> Server::list_players() {
+  std::vector<Player *> result;
   result.reserve(max_clients_);
 
   result.insert(result.end(), unnamed_.begin(), unnamed_.end());
   result.insert(result.end(), lobby_.begin(), lobby_.end());
 
-  for (auto &r : rooms_) {
-    auto p = r->players();
+  for (auto *r : rooms_) {
+    auto &p = r->players();
     result.insert(result.end(), p.begin(), p.end());
   }
 
   return result;
 }
 
-std::weak_ptr<Player> Server::find_player(int fd) {
-  auto all = list_players();
-
+Player *Server::find_player(int fd) {
   // don't accept player with invalid socket FD
   // reason: on reconnect with InTCPtor the slow nature of converging did cause
   // a little time when two clients have had the same FD, but one wasn't valid
-  auto it = std::find_if(all.begin(), all.end(),
-                         [fd](const std::shared_ptr<Player> &p) {
-                           return p->fd() == fd && p->valid_fd();
-                         });
-  if (it == all.end()) {
-    return {};
-  }
-  return *it;
+  // NOTE: index only ever contains players with valid FD
+  return from_index(fd);
 }
 
-std::weak_ptr<Player> Server::find_player(const std::string &nick) {
-  auto all = list_players();
-
-  auto it = std::find_if(
-      all.begin(), all.end(),
-      [&nick](const std::shared_ptr<Player> &p) { return p->nick() == nick; });
-  if (it == all.end()) {
-    return {};
+Player *Server::find_player(const std::string &nick) {
+  auto it = by_nick_.find(nick);
+  if (it == by_nick_.end()) {
+    return nullptr;
   }
-  return *it;
+  return player_slab_.get(it->second);
 }
 
-Player_Location Server::where_player(std::shared_ptr<Player> p) {
-  Player_Location l;
+Player *Server::find_session(std::string_view token,
+                             const std::string &nick) {
+  uint64_t v = 0;
+  auto [end, ec] =
+      std::from_chars(token.data(), token.data() + token.size(), v, 16);
+  if (ec != std::errc() || end != token.data() + token.size()) {
+    return nullptr;
+  }
 
-  { // UNNAMED
-    auto it = std::find_if(unnamed_.begin(), unnamed_.end(),
-                           [&p](const std::shared_ptr<Player> &pp) {
-                             return pp->fd() == p->fd();
-                           });
-    if (it != unnamed_.end()) {
-      l.state_ = Player_State::UNNAMED;
-      return l;
-    }
+  Handle h;
+  h.v_ = static_cast<uint32_t>(v);
+  auto *p = player_slab_.get(h);
+  // secret can't be 0, so player without token never matches
+  if (!p || p->session_secret() == 0 || p->session_secret() != v >> 32 ||
+      p->nick() != nick) {
+    return nullptr;
   }
+  return p;
+}
 
-  { // LOBBY
-    auto it = std::find_if(lobby_.begin(), lobby_.end(),
-                           [&p](const std::shared_ptr<Player> &pp) {
-                             return pp->fd() == p->fd();
-                           });
-    if (it != lobby_.end()) {
-      l.state_ = Player_State::LOBBY;
-      return l;
-    }
+std::string Server::session_token(Player &p) {
+  while (p.session_secret() == 0) {
+    p.session_secret(static_cast<uint32_t>(Rng::make_seed()));
   }
+  uint64_t v = uint64_t{p.session_secret()} << 32 | p.handle().v_;
+  return fmt::format("{:016x}", v);
+}
 
-  { // ROOM/GAME
-    for (const auto &r : rooms_) {
-      auto players = r->players();
-      auto it = std::find_if(players.begin(), players.end(),
-                             [&p](const std::shared_ptr<Player> &pp) {
-                               return pp->fd() == p->fd();
-                             });
-      if (it == players.end()) {
-        continue;
-      }
+Player_Location Server::where_player(const Player &p) {
+  Player_Location l = p.location();
 
-      // found room, what is its state
-      l.room_ = r;
-      switch (r->state()) {
-      case Room_State::OPEN:
-        l.state_ = Player_State::ROOM;
-        break;
-      case Room_State::PLAYING:
-      case Room_State::FINISHED:
-        l.state_ = Player_State::GAME;
-        break;
-      }
+  switch (l.state_) {
+  case Player_State::UNNAMED:
+  case Player_State::LOBBY:
+    break;
 
-      return l;
+  case Player_State::ROOM:
+  case Player_State::GAME:
+    // game starts & ends with the room state, so it's never out of date
+    if (!l.room_) {
+      Logger::error("Where-Player: Player is in room, but has none.");
+      l.state_ = Player_State::NON_EXISTING;
+      break;
     }
+    l.state_ = l.room_->state() == Room_State::OPEN ? Player_State::ROOM
+                                                    : Player_State::GAME;
+    break;
+
+  case Player_State::NON_EXISTING:
+    Logger::error("Where-Player: Player not found anywhere on server.");
+    break;
   }
 
-  // not found
-  Logger::error("Where-Player: Player not found anywhere on server.");
-  l.state_ = Player_State::NON_EXISTING;
   return l;
 }
 
-void Server::maybe_ping(std::shared_ptr<Player> p) {
-  auto ping_diff = std::chrono::steady_clock::now() - p->get_last_ping();
-  auto ping_diff_ms =
-      std::chrono::duration_cast<std::chrono::milliseconds>(ping_diff).count();
-
-  if (ping_diff_ms > ping_timeout_ms_) {
-    p->append_msg(Protocol::PING());
-    p->set_last_ping();
+void Server::maybe_ping(Player &p) {
+  // no socket to ping through, just wait for reconnect
+  if (p.valid_fd()) {
+    p.append_msg(Protocol::PING(), MSG_PING);
+    p.set_last_ping(now_);
   }
+
+  schedule_timer(p, Timer_Kind::PING_DUE,
+                 now_ + std::chrono::milliseconds(ping_timeout_ms_));
 }
 
-void Server::check_pong(std::shared_ptr<Player> p) {
+void Server::check_pong(Player &p) {
   // when was the last PONG received
-  auto pong_diff = std::chrono::steady_clock::now() - p->get_last_pong();
+  auto pong_diff = now_ - p.get_last_pong();
   auto pong_diff_ms =
       std::chrono::duration_cast<std::chrono::milliseconds>(pong_diff).count();
 
   // long inactivity
   if (pong_diff_ms > death_timeout_ms_) {
-    Logger::error("Terminating player fd={}: didn't respond for {} seconds.",
-                  p->fd(), pong_diff_ms / 1000);
+    Logger::error(LOG_TIMER,
+                  "Terminating player fd={}: didn't respond for {} seconds.",
+                  p.fd(), pong_diff_ms / 1000);
+    metrics_.deaths_.add();
     terminate_player(p);
+    return;
 
     // short inactivity
   } else if (pong_diff_ms > sleep_timeout_ms_) {
     // how many sleeps did we missed already
     int n_sleeps = pong_diff_ms / sleep_timeout_ms_;
-    bool new_sleep = n_sleeps > p->did_sleep_times();
+    bool new_sleep = n_sleeps > p.did_sleep_times();
 
     // only do this periodically on sleep timeout multipliers
     if (new_sleep) {
       // only notify room once
-      if (p->did_sleep_times() == 0) {
+      if (p.did_sleep_times() == 0) {
+        metrics_.sleeps_.add();
         auto loc = where_player(p);
-        auto room = loc.room_.lock();
-        if (room) {
-          broadcast_to_room(room, Protocol::SLEEP(p), {p->fd()});
+        if (loc.room_) {
+          loc.room_->changed();
+          broadcast_to_room(*loc.room_, Protocol::SLEEP(p), {p.fd()});
         }
       }
 
-      p->did_sleep_times(n_sleeps);
-      Logger::warn("Player fd={} didn't respond for {} seconds.", p->fd(),
-                   pong_diff_ms / 1000);
+      p.did_sleep_times(n_sleeps);
+      Logger::warn(LOG_TIMER, "Player fd={} didn't respond for {} seconds.",
+                   p.fd(), pong_diff_ms / 1000);
     }
   }
+
+  // check again on next sleep multiplier or death, whichever comes first
+  // if pong comes meanwhile, it's counted from the new one
+  int next_ms = sleep_timeout_ms_ * (p.did_sleep_times() + 1);
+  if (next_ms > death_timeout_ms_) {
+    next_ms = death_timeout_ms_;
+  }
+  schedule_timer(p, Timer_Kind::PONG_CHECK,
+                 p.get_last_pong() + std::chrono::milliseconds(next_ms + 1));
 }
 
 void Server::enable_sending(int fd) {
@@ -623,311 +973,718 @@ void Server::enable_sending(int fd) {
 
 void Server::disable_sending(int fd) { set_epoll_events(fd, EPOLLIN); }
 
-void Server::process_message(const std::vector<std::string> &msg,
-                             std::shared_ptr<Player> p) {
-  if (msg.size() < 1) {
+void Server::handle_completion(const io_uring_cqe &cqe) {
+  auto op = static_cast<Uring_Op>(cqe.user_data >> 56);
+  uint32_t gen = cqe.user_data >> 24;
+  int fd = cqe.user_data & 0xFFFFFF;
+  bool more = cqe.flags & IORING_CQE_F_MORE;
+
+  switch (op) {
+  case OP_ACCEPT:
+    if (cqe.res >= 0) {
+      admit(cqe.res);
+    } else if (cqe.res != -ECANCELED) {
+      static Log_Limit limit{std::chrono::seconds(1)};
+      Logger::error(limit, LOG_NET, "accept() failed: {}",
+                    std::strerror(-cqe.res));
+    }
+    // request ended, e.g. on error, unless it was paused or replaced
+    if (!more && running_ && !accept_paused_ && gen == accept_gen_) {
+      uring_accept();
+    }
+    break;
+
+  case OP_INBOX:
+    drain_inbox();
+    if (!more && running_) {
+      uring_->poll_multishot(inbox_fd_, cqe.user_data);
+    }
+    break;
+
+  case OP_RECV:
+    handle_recv(cqe, fd, gen);
+    break;
+
+  case OP_SEND:
+    handle_sent(cqe, fd, gen);
+    break;
+
+  case OP_CANCEL: // nothing to do, the cancelled request reports itself
+    break;
+  }
+}
+
+void Server::handle_recv(const io_uring_cqe &cqe, int fd, uint32_t gen) {
+  bool has_buffer = cqe.flags & IORING_CQE_F_BUFFER;
+  uint16_t buffer_id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+
+  auto &c = conn(fd);
+  // socket was closed or moved meanwhile, just return the buffer
+  if (gen != c.gen_) {
+    if (has_buffer) {
+      uring_->recycle_buffer(buffer_id);
+    }
+    return;
+  }
+  bool more = cqe.flags & IORING_CQE_F_MORE;
+  if (!more) {
+    c.receiving_ = false;
+  }
+
+  auto *p = from_index(fd);
+  auto handoff = handoffs_.find(fd);
+  if (!p && handoff != handoffs_.end()) {
+    p = player_slab_.get(handoff->second.player_);
+  }
+
+  // copy data out, so the buffer can be reused by kernel right away
+  if (has_buffer) {
+    try {
+      if (p && cqe.res > 0) {
+        p->on_received(uring_->buffer(buffer_id), cqe.res);
+      }
+    } catch (const std::exception &ex) {
+      uring_->recycle_buffer(buffer_id);
+      Logger::error(LOG_NET, "Cannot receive from client fd={}, because: '{}'.",
+                    fd, ex.what());
+      // leaving player is dealt with by the other shard
+      if (handoff != handoffs_.end()) {
+        finish_handoff(fd);
+      } else if (p) {
+        terminate_player(*p);
+      }
+      return;
+    }
+    uring_->recycle_buffer(buffer_id);
+  }
+
+  // leaving player only collects data until recv is cancelled
+  if (handoff != handoffs_.end()) {
+    finish_handoff(fd);
+    return;
+  }
+  if (!p) {
     return;
   }
 
-  // the first part of msg is command
-  const auto &cmd = msg[0];
-  auto it = handlers_.find(cmd);
+  if (cqe.res == 0) { // client closed connection
+    Logger::error(LOG_NET, "Cannot receive from client fd={}, because: '{}'.",
+                  fd, "Client closed connection.");
+    terminate_player(*p);
+    return;
+  }
+  // out of buffers only ends multishot, anything else is fatal
+  if (cqe.res < 0 && cqe.res != -ENOBUFS) {
+    Logger::error(LOG_NET, "recv failed for fd={}: {}", fd,
+                  std::strerror(-cqe.res));
+    terminate_player(*p);
+    return;
+  }
+
+  if (cqe.res > 0) {
+    process_buffered(fd);
+  }
+
+  // arm again, if the socket is still ours
+  if (!more && gen == c.gen_ && !c.receiving_ && from_index(fd)) {
+    c.receiving_ = true;
+    uring_->recv_multishot(fd, URING_BUFFER_GROUP, user_data(OP_RECV, fd, gen));
+  }
+}
 
-  // find & execute command
-  if (it != handlers_.end()) {
-    auto fn = it->second;
-    (this->*fn)(msg, p);
+void Server::handle_sent(const io_uring_cqe &cqe, int fd, uint32_t gen) {
+  auto &c = conn(fd);
+  std::vector<Segment> segments = std::move(c.sending_);
+  size_t offset = c.send_offset_;
+  c.sending_.clear();
+  c.send_in_flight_ = false;
 
-    // unknown command = player ends
-    // every OK message is not invalid
-  } else if (cmd != "OK") {
+  auto *p = from_index(fd);
+
+  // sent to old socket, new one on the same fd may be waiting for its turn
+  if (gen != c.gen_) {
+    if (p) {
+      uring_send(*p);
+    }
+    return;
+  }
+
+  auto handoff = handoffs_.find(fd);
+  if (!p && handoff != handoffs_.end()) {
+    p = player_slab_.get(handoff->second.player_);
+  }
+  if (!p) {
+    return;
+  }
+
+  if (cqe.res < 0 && handoff == handoffs_.end()) {
+    Logger::error(LOG_NET, "send failed for fd={}: {}", fd,
+                  std::strerror(-cqe.res));
+    terminate_player(*p);
+    return;
+  }
+
+  // unsent rest goes first next time
+  size_t sent = cqe.res < 0 ? 0 : cqe.res;
+  metrics_.bytes_out_.add(sent);
+  size_t i = 0;
+  while (i < segments.size() && sent >= segments[i].size() - offset) {
+    sent -= segments[i].size() - offset;
+    offset = 0;
+    i++;
+  }
+  if (i < segments.size()) {
+    p->unsent(segments, i, offset + sent);
+  }
+
+  if (handoff != handoffs_.end()) {
+    finish_handoff(fd);
+  } else {
+    uring_send(*p);
+  }
+}
+
+void Server::uring_watch(int fd) {
+  auto &c = conn(fd);
+  c.gen_++;
+  c.receiving_ = true;
+  uring_->recv_multishot(fd, URING_BUFFER_GROUP,
+                         user_data(OP_RECV, fd, c.gen_));
+}
+
+void Server::uring_unwatch(int fd) {
+  auto &c = conn(fd);
+  if (c.receiving_) {
+    uring_->cancel(user_data(OP_RECV, fd, c.gen_),
+                   user_data(OP_CANCEL, fd, c.gen_));
+    c.receiving_ = false;
+  }
+  // in-flight send keeps its buffer until completion, but is stale
+  c.gen_++;
+}
+
+void Server::uring_send(Player &p) {
+  int fd = p.fd();
+  if (!p.valid_fd() || !p.has_output()) {
+    return;
+  }
+
+  auto &c = conn(fd);
+  // completion of the current send will send the rest
+  if (c.send_in_flight_) {
+    return;
+  }
+
+  // all queued messages in one request
+  metrics_.write_queue_.observe(p.queued());
+  c.sending_.clear();
+  c.send_offset_ = p.take_output(c.sending_);
+  c.iov_.resize(c.sending_.size());
+  for (size_t i = 0; i < c.sending_.size(); i++) {
+    size_t skip = i == 0 ? c.send_offset_ : 0;
+    c.iov_[i].iov_base = const_cast<char *>(c.sending_[i].data()) + skip;
+    c.iov_[i].iov_len = c.sending_[i].size() - skip;
+  }
+  c.msg_ = {};
+  c.msg_.msg_iov = c.iov_.data();
+  c.msg_.msg_iovlen = c.iov_.size();
+
+  c.send_in_flight_ = true;
+  uring_->sendmsg(fd, &c.msg_, user_data(OP_SEND, fd, c.gen_));
+}
+
+void Server::finish_handoff(int fd) {
+  auto it = handoffs_.find(fd);
+  if (it == handoffs_.end()) {
+    return;
+  }
+
+  auto &c = conn(fd);
+  if (c.receiving_ || c.send_in_flight_) {
+    return;
+  }
+
+  auto h = std::move(it->second);
+  handoffs_.erase(it);
+  // socket isn't ours anymore
+  c.gen_++;
+
+  auto *p = player_slab_.get(h.player_);
+  if (!p) {
+    return;
+  }
+  h.msg_.player_ = p->release();
+  free_player(*p, true);
+  send_to_shard(h.shard_, std::move(h.msg_));
+}
+
+void Server::process_message(Tokens msg, Command cmd,
+                             Player &p) {
+  if (msg.size() < 1) {
+    return;
+  }
+
+  // command is known from parsing, jump straight to its handler
+  metrics_.messages_[cmd].add();
+  auto start = std::chrono::steady_clock::now();
+  (this->*handlers_[cmd])(msg, p);
+  auto took = std::chrono::steady_clock::now() - start;
+  metrics_.handler_ns_.observe(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(took).count());
+}
+
+void Server::handle_proto(Tokens msg, Player &p) {
+  // switching is possible only before anything else happened
+  if (msg.size() != 2 || p.binary() ||
+      where_player(p).state_ != Player_State::UNNAMED) {
+    Logger::error(LOG_PROTOCOL, "{} Invalid PROTO", Logger::more(p));
     terminate_player(p);
+    return;
   }
+
+  if (msg[1] == "BIN") {
+    // still in text, client switches after reading it
+    p.append_msg(Protocol::OK_PROTO());
+    p.start_binary();
+  } else if (msg[1] == "TEXT") {
+    p.append_msg(Protocol::OK_PROTO());
+  } else {
+    p.append_msg(Protocol::FAIL_PROTO());
+  }
+}
+
+void Server::handle_ok(Tokens, Player &) {}
+
+void Server::handle_unknown(Tokens, Player &p) {
+  // unknown command = player ends
+  terminate_player(p);
 }
 
-void Server::handle_pong(const std::vector<std::string> &msg,
-                         std::shared_ptr<Player> p) {
+void Server::handle_pong(Tokens msg, Player &p) {
   if (msg.size() != 1) {
-    Logger::error("{} Invalid PONG", Logger::more(p));
+    Logger::error(LOG_PROTOCOL, "{} Invalid PONG", Logger::more(p));
     terminate_player(p);
     return;
   }
 
-  p->set_last_pong();
+  p.set_last_pong(now_);
 }
 
-void Server::handle_name(const std::vector<std::string> &msg,
-                         std::shared_ptr<Player> p) {
-  if (msg.size() != 2) {
-    Logger::error("{} Invalid NAME, number of words", Logger::more(p));
+void Server::handle_name(Tokens msg, Player &p) {
+  // NAME nick [session token]
+  if (msg.size() != 2 && msg.size() != 3) {
+    Logger::error(LOG_PROTOCOL, "{} Invalid NAME, number of words",
+                  Logger::more(p));
     terminate_player(p);
     return;
   }
 
   auto location = where_player(p);
   if (location.state_ != Player_State::UNNAMED) {
-    Logger::error("{} Invalid NAME, player wasn't unnamed", Logger::more(p));
+    Logger::error(LOG_PROTOCOL, "{} Invalid NAME, player wasn't unnamed",
+                  Logger::more(p));
     terminate_player(p);
     return;
   }
 
+  // copy, the receive buffer may move with the socket to other player
+  std::string token = msg.size() == 3 ? std::string(msg[2]) : "";
+  resolve_name(p, std::string(msg[1]), token, 0);
+}
+
+void Server::resolve_name(Player &p, const std::string &nick,
+                          const std::string &token, int hops) {
   // RECONNECT strategy
-  auto weak_existing = find_player(msg[1]);
-  auto existing = weak_existing.lock();
+  // token leads right to the player, the nick is looked up only without it
+  Player *existing = nullptr;
+  if (session_tokens_ && !token.empty()) {
+    existing = find_session(token, nick);
+    if (existing) {
+      Logger::debug(LOG_NET, "{} resumed by session token.",
+                    Logger::more(*existing));
+    }
+  }
+  if (!existing) {
+    existing = find_player(nick);
+  }
+
+  // the player may live on other shard
+  if (!existing) {
+    // not at home = ask home, at home = ask the shard where player is away
+    int target = home_shard(nick);
+    auto away = away_.find(nick);
+    if (target == shard_ && away != away_.end()) {
+      target = away->second;
+    }
+
+    if (target != shard_) {
+      // other shards are still moving the player, give up after a while
+      if (hops >= MAX_NAME_HOPS) {
+        Logger::error(LOG_GAME, "{} Cannot resolve name {} across reactors.",
+                      Logger::more(p), nick);
+        terminate_player(p);
+        return;
+      }
+
+      Shard_Message m;
+      m.action_ = Handoff_Action::HANDOFF_NAME;
+      m.nick_ = nick;
+      m.token_ = token;
+      m.hops_ = hops + 1;
+      hand_off(p, target, std::move(m));
+      return;
+    }
+  }
 
   // this is a new player
   if (!existing) {
-    p->nick(msg[1]);
-    p->append_msg(Protocol::OK_NAME());
+    p.nick(nick);
+    index_nick(p);
+    p.append_msg(session_tokens_ ? Protocol::OK_NAME(session_token(p))
+                                 : Protocol::OK_NAME());
 
-    move_player_by_fd(p->fd(), unnamed_, lobby_);
-    Logger::info("{} have name and is in lobby.", Logger::more(p));
+    move_player(p, unnamed_, lobby_, Player_State::LOBBY);
+    Logger::info(LOG_GAME, "{} have name and is in lobby.", Logger::more(p));
 
     // this is an existing player
   } else {
     // switch socket FD
     int old_fd = existing->fd();
-
-    existing->fd(p->fd());
-    existing->append_msg(Protocol::OK_NAME());
+    // if the socket was lost, old fd is already closed and may even be reused
+    // by this very connection - must not be closed again
+    bool old_valid = existing->valid_fd();
+
+    existing->fd(p.fd());
+    existing->binary(p.binary());
+    // the new connection didn't ask for room changes
+    existing->subscribed(false);
+    index_fd(existing->fd(), *existing);
+    existing->append_msg(session_tokens_
+                             ? Protocol::OK_NAME(session_token(*existing))
+                             : Protocol::OK_NAME());
 
     // cancel reconnect timer if running
-    if (existing->tfd() != -1) {
-      epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, existing->tfd(), nullptr);
-      close(existing->tfd());
-      existing->tfd(-1);
-    }
+    stop_disconnect_timer(*existing);
 
     // erase this temporary player object
-    // (in unnamed is only the tmp object, and if there are two, with the same
-    // fd, it doesn't matter)
-    erase_by_fd(unnamed_, p->fd());
-    close_connection(old_fd);
+    std::erase(unnamed_, &p);
+    if (old_valid) {
+      close_connection(old_fd);
+    }
+    // messages sent right after NAME belong to the existing player now
+    existing->read_buffer(p.release().read_buffer_);
+    free_player(p);
 
-    Logger::info("Existing player name={} switched sockets: {} => {}",
+    Logger::info(LOG_NET, "Existing player name={} switched sockets: {} => {}",
                  existing->nick(), old_fd, existing->fd());
   }
 }
 
-void Server::handle_list_rooms(const std::vector<std::string> &msg,
-                               std::shared_ptr<Player> p) {
+void Server::handle_list_rooms(Tokens msg, Player &p) {
   if (msg.size() != 1) {
-    Logger::error("{} Invalid LIST_ROOMS", Logger::more(p));
+    Logger::error(LOG_PROTOCOL, "{} Invalid LIST_ROOMS", Logger::more(p));
     terminate_player(p);
     return;
   }
 
   auto loc = where_player(p);
   if (loc.state_ != Player_State::LOBBY) {
-    Logger::info("{} tried to list rooms while not in lobby, disconnecting.",
+    Logger::info(LOG_GAME,
+                 "{} tried to list rooms while not in lobby, disconnecting.",
                  Logger::more(p));
     terminate_player(p);
     return;
   }
 
-  p->append_msg(Protocol::ROOMS(rooms_));
-  Logger::info("{} listed rooms", Logger::more(p));
+  auto build = [this]() { return Protocol::ROOMS(list_rooms()); };
+  p.append_msg(Protocol::cached(rooms_snapshot_, p.binary(), build),
+               MSG_ROOMS);
+  Logger::info(LOG_GAME, "{} listed rooms", Logger::more(p));
 }
 
-void Server::handle_join_room(const std::vector<std::string> &msg,
-                              std::shared_ptr<Player> p) {
+void Server::handle_subscribe_rooms(Tokens msg, Player &p) {
+  if (msg.size() != 1) {
+    Logger::error(LOG_PROTOCOL, "{} Invalid SUBSCRIBE_ROOMS", Logger::more(p));
+    terminate_player(p);
+    return;
+  }
+
+  auto loc = where_player(p);
+  if (loc.state_ != Player_State::LOBBY) {
+    Logger::info(LOG_GAME,
+                 "{} tried to subscribe rooms while not in lobby, "
+                 "disconnecting.",
+                 Logger::more(p));
+    terminate_player(p);
+    return;
+  }
+
+  // others get what is pending first, so everybody knows the same rooms &
+  // the snapshot below is where events of this player start
+  announce_rooms();
+  bool first = std::none_of(lobby_.begin(), lobby_.end(),
+                            [](const Player *l) { return l->subscribed(); });
+  if (first) {
+    announced_rooms_ = list_rooms();
+  }
+  p.subscribed(true);
+
+  p.append_msg(Protocol::cached(rooms_snapshot_, p.binary(), [this]() {
+    return Protocol::ROOMS(list_rooms());
+  }));
+  Logger::info(LOG_GAME, "{} subscribed rooms", Logger::more(p));
+}
+
+void Server::handle_join_room(Tokens msg, Player &p) {
   if (msg.size() != 2) {
-    Logger::error("{} Invalid JOIN_ROOM", Logger::more(p));
+    Logger::error(LOG_PROTOCOL, "{} Invalid JOIN_ROOM", Logger::more(p));
     terminate_player(p);
     return;
   }
 
   auto loc = where_player(p);
   if (loc.state_ != Player_State::LOBBY) {
-    Logger::info("{} tried to join room while not in lobby, disconnecting.",
+    Logger::info(LOG_GAME,
+                 "{} tried to join room while not in lobby, disconnecting.",
                  Logger::more(p));
     terminate_player(p);
     return;
   }
 
-  int r_id = std::stoi(msg[1]);
+  join_room(p, Protocol::to_int(msg[1]));
+}
+
+void Server::join_room(Player &p, int r_id) {
+  // room lives on other shard, player has to move there
+  int owner = room_shard(r_id);
+  if (owner != shard_) {
+    if (!remote_room_open(r_id)) {
+      p.append_msg(Protocol::FAIL_JOIN_ROOM());
+      Logger::info(LOG_GAME, "{} couldn't join room id={} on other reactor.",
+                   Logger::more(p), r_id);
+      return;
+    }
+
+    // remember where the player is, for reconnect
+    away_[p.nick()] = owner;
+
+    Shard_Message m;
+    m.action_ = Handoff_Action::HANDOFF_JOIN;
+    m.room_id_ = r_id;
+    hand_off(p, owner, std::move(m));
+    return;
+  }
 
   auto room_it =
       std::find_if(rooms_.begin(), rooms_.end(),
-                   [r_id](const auto &r) { return r->id() == r_id; });
+                   [r_id](const Room *r) { return r->id() == r_id; });
   if (room_it == rooms_.end()) { // cannot find room
-    p->append_msg(Protocol::FAIL_JOIN_ROOM());
-    Logger::info("{} couldn't join non-existing room.", Logger::more(p));
+    p.append_msg(Protocol::FAIL_JOIN_ROOM());
+    Logger::info(LOG_GAME, "{} couldn't join non-existing room.",
+                 Logger::more(p));
+    return_home(p);
     return;
   }
 
-  std::shared_ptr<Room> room = *room_it;
+  auto &room = **room_it;
 
-  if (room->state() != Room_State::OPEN) { // room full
-    p->append_msg(Protocol::FAIL_JOIN_ROOM());
-    Logger::info("{} couldn't join full room id={}.", Logger::more(p),
-                 room->id());
+  if (room.state() != Room_State::OPEN) { // room full
+    p.append_msg(Protocol::FAIL_JOIN_ROOM());
+    Logger::info(LOG_GAME, "{} couldn't join full room id={}.", Logger::more(p),
+                 room.id());
+    return_home(p);
     return;
   }
 
   // move to room & remove from lobby
-  move_player_by_fd(p->fd(), lobby_, room->players());
-  p->append_msg(Protocol::OK_JOIN_ROOM());
-  broadcast_to_room(room, Protocol::JOIN(p), {p->fd()});
+  move_player(p, lobby_, room.players(), Player_State::ROOM, &room);
+  room.changed();
+  p.append_msg(Protocol::OK_JOIN_ROOM());
+  broadcast_to_room(room, Protocol::JOIN(p), {p.fd()});
 
-  Logger::info("{} joined room id={}.", Logger::more(p), room->id());
+  Logger::info(LOG_GAME, "{} joined room id={}.", Logger::more(p), room.id());
 
   // start game ==> server takes over control
-  if (room->should_begin_game(players_in_game_)) {
-    room->state(Room_State::PLAYING);
+  if (room.should_begin_game(players_in_game_)) {
+    room.state(Room_State::PLAYING);
+    rooms_changed();
     broadcast_to_room(room, Protocol::GAME_START(), {});
 
-    room->setup_game();
+    room.setup_game();
+    Logger::info(LOG_GAME, "Room {} started game with seed {}.", room.id(),
+                 room.seed());
 
     // show everyone hand
-    for (auto p : room->players()) {
-      p->append_msg(Protocol::HAND(p));
+    for (auto *rp : room.players()) {
+      rp->append_msg(Protocol::HAND(*rp));
     }
 
     // show everyone turn
-    broadcast_to_room(room, Protocol::TURN(room->current_turn()), {});
+    broadcast_to_room(room, Protocol::TURN(room.current_turn()), {});
   }
 }
 
-void Server::handle_create_room(const std::vector<std::string> &msg,
-                                std::shared_ptr<Player> p) {
+void Server::handle_create_room(Tokens msg, Player &p) {
   if (msg.size() != 1) {
-    Logger::error("{} Invalid CREATE_ROOM", Logger::more(p));
+    Logger::error(LOG_PROTOCOL, "{} Invalid CREATE_ROOM", Logger::more(p));
     terminate_player(p);
     return;
   }
 
   auto loc = where_player(p);
   if (loc.state_ != Player_State::LOBBY) {
-    Logger::info("{} tried to create room while not in lobby, disconnecting.",
+    Logger::info(LOG_GAME,
+                 "{} tried to create room while not in lobby, disconnecting.",
                  Logger::more(p));
     terminate_player(p);
     return;
   }
 
-  if (rooms_.size() >= max_rooms_) { // already limit of rooms
-    p->append_msg(Protocol::FAIL_CREATE_ROOM());
-    Logger::info("{} Failed create new room - limit of rooms reached.",
+  if (count_rooms() >= max_rooms_) { // already limit of rooms
+    p.append_msg(Protocol::FAIL_CREATE_ROOM());
+    Logger::info(LOG_GAME,
+                 "{} Failed create new room - limit of rooms reached.",
                  Logger::more(p));
     return;
   }
 
   // create new room
-  rooms_.emplace_back(std::make_shared<Room>(start_hand_size_, max_hand_size_));
-  auto room = rooms_.back();
-  Logger::info("{} New room id={} was created and joined", Logger::more(p),
-               room->id());
+  auto h = room_slab_.emplace(start_hand_size_, max_hand_size_, new_room_id());
+  auto *room = room_slab_.get(h);
+  room->handle(h);
+  rooms_.push_back(room);
+  rooms_changed();
+  Logger::info(LOG_GAME, "{} New room id={} was created and joined",
+               Logger::more(p), room->id());
 
   // move to room & remove from lobby
-  move_player_by_fd(p->fd(), lobby_, room->players());
-  p->append_msg(Protocol::OK_CREATE_ROOM());
+  move_player(p, lobby_, room->players(), Player_State::ROOM, room);
+  room->changed();
+  p.append_msg(Protocol::OK_CREATE_ROOM());
 }
 
-void Server::handle_leave_room(const std::vector<std::string> &msg,
-                               std::shared_ptr<Player> p) {
+void Server::handle_leave_room(Tokens msg, Player &p) {
   if (msg.size() != 1) {
-    Logger::error("{} Invalid LEAVE_ROOM", Logger::more(p));
+    Logger::error(LOG_PROTOCOL, "{} Invalid LEAVE_ROOM", Logger::more(p));
     terminate_player(p);
     return;
   }
 
   auto loc = where_player(p);
   if (loc.state_ != Player_State::ROOM && loc.state_ != Player_State::GAME) {
-    Logger::info("{} tried to leave room while not in one, disconnecting.",
+    Logger::info(LOG_GAME,
+                 "{} tried to leave room while not in one, disconnecting.",
                  Logger::more(p));
 
     terminate_player(p);
     return;
   }
 
-  auto room = loc.room_.lock();
+  auto *room = loc.room_;
   if (!room) {
-    Logger::warn("{} tried to leave non-existing room? disconnecting",
+    Logger::warn(LOG_GAME, "{} tried to leave non-existing room? disconnecting",
                  Logger::more(p));
     terminate_player(p);
     return;
   }
 
   try {
-    leave_room(p, room);
+    leave_room(p, *room);
   } catch (const std::exception &ex) {
     Logger::error("Error: {}", ex.what());
     terminate_player(p);
+    return;
   }
+
+  return_home(p);
 }
 
-void Server::leave_room(std::shared_ptr<Player> p, std::shared_ptr<Room> r) {
+void Server::leave_room(Player &p, Room &r) {
 
   // move to lobby & remove from room
   // may throw
-  move_player_by_fd(p->fd(), r->players(), lobby_);
-  p->clear_hand();
+  move_player(p, r.players(), lobby_, Player_State::LOBBY);
+  r.changed();
+  p.clear_hand();
+  // subscription ended by joining the room, lobby may differ meanwhile
+  p.subscribed(false);
 
-  p->append_msg(Protocol::OK_LEAVE_ROOM());
-  Logger::info("{} left room id={}.", Logger::more(p), r->id());
+  p.append_msg(Protocol::OK_LEAVE_ROOM());
+  Logger::info(LOG_GAME, "{} left room id={}.", Logger::more(p), r.id());
 
   // tell others in room
-  broadcast_to_room(r, Protocol::LEAVE(p), {p->fd()});
+  broadcast_to_room(r, Protocol::LEAVE(p), {p.fd()});
 
   // remove empty room
-  if (r->players().size() == 0) {
-    rooms_.erase(
-        std::find_if(rooms_.begin(), rooms_.end(),
-                     [&r](const auto &rr) { return r->id() == rr->id(); }));
-    Logger::info("Empty room id={} was closed.", r->id());
+  if (r.players().size() == 0) {
+    std::erase(rooms_, &r);
+    rooms_changed();
+    Logger::info(LOG_GAME, "Empty room id={} was closed.", r.id());
+    room_slab_.erase(r.handle());
 
     // end game because someone left
-  } else if (r->state() == Room_State::PLAYING) {
+  } else if (r.state() == Room_State::PLAYING) {
     broadcast_to_room(r, Protocol::WIN(), {});
-    r->state(Room_State::FINISHED);
+    r.state(Room_State::FINISHED);
+    rooms_changed();
   }
 }
 
-void Server::handle_room_info(const std::vector<std::string> &msg,
-                              std::shared_ptr<Player> p) {
+void Server::handle_room_info(Tokens msg, Player &p) {
   if (msg.size() != 1) {
-    Logger::error("{} Invalid ROOM_INFO", Logger::more(p));
+    Logger::error(LOG_PROTOCOL, "{} Invalid ROOM_INFO", Logger::more(p));
     terminate_player(p);
     return;
   }
 
   auto loc = where_player(p);
   if (loc.state_ != Player_State::ROOM && loc.state_ != Player_State::GAME) {
-    Logger::info("{} tried to get room info while not in one, disconnecting.",
+    Logger::info(LOG_GAME,
+                 "{} tried to get room info while not in one, disconnecting.",
                  Logger::more(p));
 
     terminate_player(p);
     return;
   }
 
-  auto room = loc.room_.lock();
+  auto *room = loc.room_;
   if (!room) {
-    Logger::warn("{} tried to get info about non-existing room? disconnecting",
+    Logger::warn(LOG_GAME,
+                 "{} tried to get info about non-existing room? disconnecting",
                  Logger::more(p));
     terminate_player(p);
     return;
   }
 
-  p->append_msg(Protocol::ROOM(room));
-  Logger::info("{} sent room info.", Logger::more(p));
+  p.append_msg(Protocol::cached(room->snapshot(), p.binary(),
+                                [room]() { return Protocol::ROOM(*room); }),
+               MSG_ROOM);
+  Logger::info(LOG_GAME, "{} sent room info.", Logger::more(p));
 }
 
-void Server::handle_state(const std::vector<std::string> &msg,
-                          std::shared_ptr<Player> p) {
+void Server::handle_state(Tokens msg, Player &p) {
   if (msg.size() != 1) {
-    Logger::error("{} Invalid STATE", Logger::more(p));
+    Logger::error(LOG_PROTOCOL, "{} Invalid STATE", Logger::more(p));
     terminate_player(p);
     return;
   }
 
-  p->append_msg(Protocol::STATE(*this, p));
-  Logger::info("{} sent state.", Logger::more(p));
+  // in open room the state is just the room info
+  auto loc = where_player(p);
+  if (loc.state_ == Player_State::ROOM && loc.room_) {
+    auto *room = loc.room_;
+    p.append_msg(Protocol::cached(room->snapshot(), p.binary(),
+                                  [room]() { return Protocol::ROOM(*room); }),
+                 MSG_ROOM);
+  } else {
+    p.append_msg(Protocol::STATE(*this, p));
+  }
+  Logger::info(LOG_GAME, "{} sent state.", Logger::more(p));
 }
 
-void Server::handle_play(const std::vector<std::string> &msg,
-                         std::shared_ptr<Player> p) {
+void Server::handle_play(Tokens msg, Player &p) {
   if (msg.size() != 2) {
-    Logger::error("{} Invalid PLAY", Logger::more(p));
+    Logger::error(LOG_PROTOCOL, "{} Invalid PLAY", Logger::more(p));
     terminate_player(p);
     return;
   }
@@ -935,6 +1692,7 @@ void Server::handle_play(const std::vector<std::string> &msg,
   auto loc = where_player(p);
   if (loc.state_ != Player_State::GAME) {
     Logger::info(
+        LOG_GAME,
         "{} tried to play card when not in game state => disconnecting.",
         Logger::more(p));
 
@@ -942,32 +1700,35 @@ void Server::handle_play(const std::vector<std::string> &msg,
     return;
   }
 
-  auto room = loc.room_.lock();
+  auto *room = loc.room_;
   if (!room) {
-    Logger::warn("{} tried to play in non-existing room? disconnecting",
+    Logger::warn(LOG_GAME,
+                 "{} tried to play in non-existing room? disconnecting",
                  Logger::more(p));
     terminate_player(p);
     return;
   }
 
   if (room->state() != Room_State::PLAYING) {
-    Logger::warn("{} tried to play in room which is not playing, disconnecting",
-                 Logger::more(p));
+    Logger::warn(
+        LOG_GAME,
+        "{} tried to play in room which is not playing, disconnecting",
+        Logger::more(p));
     terminate_player(p);
     return;
   }
 
-  if (room->current_turn().name_ != p->nick()) {
-    Logger::warn("{} tried to play when not on turn, disconnecting",
+  if (room->current_turn().name_ != p.nick()) {
+    Logger::warn(LOG_GAME, "{} tried to play when not on turn, disconnecting",
                  Logger::more(p));
     terminate_player(p);
     return;
   }
 
-  Card c{msg[1][0], msg[1][1]};
+  Card c{msg[1][0], msg[1].size() > 1 ? msg[1][1] : '\0'};
 
   if (!c.is_valid()) {
-    Logger::warn("{} tried to play invalid card ({}), disconnecting",
+    Logger::warn(LOG_GAME, "{} tried to play invalid card ({}), disconnecting",
                  Logger::more(p), c.to_string());
     terminate_player(p);
     return;
@@ -975,60 +1736,62 @@ void Server::handle_play(const std::vector<std::string> &msg,
 
   if (!room->play_card(c)) {
     Logger::warn(
+        LOG_GAME,
         "{} tried to play card which cannot be played ({}), disconnecting",
         Logger::more(p), c.to_string());
     terminate_player(p);
     return;
   }
 
-  p->append_msg(Protocol::OK_PLAY());
-  broadcast_to_room(room, Protocol::PLAYED(p, c), {p->fd()});
+  p.append_msg(Protocol::OK_PLAY());
+  broadcast_to_room(*room, Protocol::PLAYED(p, c), {p.fd()});
 
-  Logger::info("{} played card={}", Logger::more(p), c.to_string());
+  Logger::info(LOG_GAME, "{} played card={}", Logger::more(p), c.to_string());
 
   // is this end of game?
-  auto w = room->get_winner();
-  auto win = w.lock();
+  auto *win = room->get_winner();
   if (win) {
     win->append_msg(Protocol::WIN());
-    broadcast_to_room(room, Protocol::LOSE(), {win->fd()});
+    broadcast_to_room(*room, Protocol::LOSE(), {win->fd()});
     room->state(Room_State::FINISHED);
+    rooms_changed();
 
     // return control to clients
     return;
   }
 
-  if (c.rank_ == 'A') {
+  if (c.rank() == 'A') {
     // next player = is theoretically current, because play_card advanced
-    auto np = room->current_player();
-    broadcast_to_room(room, Protocol::SKIP(np), {});
+    auto &np = room->current_player();
+    broadcast_to_room(*room, Protocol::SKIP(np), {});
     // really skip the player
     room->advance_player();
 
-  } else if (c.rank_ == '7') {
-    auto np = room->current_player();
+  } else if (c.rank() == '7') {
+    auto &np = room->current_player();
     // draw cards
     auto c1 = room->deal_card();
     auto c2 = room->deal_card();
 
     // give them to player
-    auto &hand = np->hand();
-    hand.push_back(c1);
-    hand.push_back(c2);
+    auto &hand = np.hand();
+    hand.add(c1);
+    hand.add(c2);
+    room->changed();
 
     // send it to people
-    np->append_msg(Protocol::CARDS({c1, c2}));
-    broadcast_to_room(room, Protocol::DRAWED(np, 2), {np->fd()});
+    np.append_msg(Protocol::CARDS({c1, c2}));
+    broadcast_to_room(*room, Protocol::DRAWED(np, 2), {np.fd()});
     // skip the player
     room->advance_player();
 
     // is this end of game? (only because might now have more than MAX_CARDS)
-    auto w = room->get_winner();
-    auto win = w.lock();
+    auto *win = room->get_winner();
     if (win) {
       win->append_msg(Protocol::WIN());
-      broadcast_to_room(room, Protocol::LOSE(), {win->fd()});
+      broadcast_to_room(*room, Protocol::LOSE(), {win->fd()});
       room->state(Room_State::FINISHED);
+      rooms_changed();
 
       // return control to clients
       return;
@@ -1036,13 +1799,12 @@ void Server::handle_play(const std::vector<std::string> &msg,
   }
 
   // next turn
-  broadcast_to_room(room, Protocol::TURN(room->current_turn()), {});
+  broadcast_to_room(*room, Protocol::TURN(room->current_turn()), {});
 }
 
-void Server::handle_draw(const std::vector<std::string> &msg,
-                         std::shared_ptr<Player> p) {
+void Server::handle_draw(Tokens msg, Player &p) {
   if (msg.size() != 1) {
-    Logger::error("{} Invalid DRAW", Logger::more(p));
+    Logger::error(LOG_PROTOCOL, "{} Invalid DRAW", Logger::more(p));
     terminate_player(p);
     return;
   }
@@ -1050,6 +1812,7 @@ void Server::handle_draw(const std::vector<std::string> &msg,
   auto loc = where_player(p);
   if (loc.state_ != Player_State::GAME) {
     Logger::info(
+        LOG_GAME,
         "{} tried to draw card when not in game state => disconnecting.",
         Logger::more(p));
 
@@ -1057,23 +1820,26 @@ void Server::handle_draw(const std::vector<std::string> &msg,
     return;
   }
 
-  auto room = loc.room_.lock();
+  auto *room = loc.room_;
   if (!room) {
-    Logger::warn("{} tried to draw in non-existing room? disconnecting",
+    Logger::warn(LOG_GAME,
+                 "{} tried to draw in non-existing room? disconnecting",
                  Logger::more(p));
     terminate_player(p);
     return;
   }
 
   if (room->state() != Room_State::PLAYING) {
-    Logger::warn("{} tried to draw in room which is not playing, disconnecting",
-                 Logger::more(p));
+    Logger::warn(
+        LOG_GAME,
+        "{} tried to draw in room which is not playing, disconnecting",
+        Logger::more(p));
     terminate_player(p);
     return;
   }
 
-  if (room->current_turn().name_ != p->nick()) {
-    Logger::warn("{} tried to draw when not on turn, disconnecting",
+  if (room->current_turn().name_ != p.nick()) {
+    Logger::warn(LOG_GAME, "{} tried to draw when not on turn, disconnecting",
                  Logger::more(p));
     terminate_player(p);
     return;
@@ -1083,20 +1849,20 @@ void Server::handle_draw(const std::vector<std::string> &msg,
   auto c = room->deal_card();
 
   // give them to player
-  auto &hand = p->hand();
-  hand.push_back(c);
+  p.hand().add(c);
+  room->changed();
 
   // send it to people
-  p->append_msg(Protocol::CARDS({c}));
-  broadcast_to_room(room, Protocol::DRAWED(p, 1), {p->fd()});
+  p.append_msg(Protocol::CARDS({c}));
+  broadcast_to_room(*room, Protocol::DRAWED(p, 1), {p.fd()});
 
   // is this end of game?
-  auto w = room->get_winner();
-  auto win = w.lock();
+  auto *win = room->get_winner();
   if (win) {
     win->append_msg(Protocol::WIN());
-    broadcast_to_room(room, Protocol::LOSE(), {win->fd()});
+    broadcast_to_room(*room, Protocol::LOSE(), {win->fd()});
     room->state(Room_State::FINISHED);
+    rooms_changed();
 
     // return control to clients
     return;
@@ -1104,30 +1870,362 @@ void Server::handle_draw(const std::vector<std::string> &msg,
 
   // next turn
   room->advance_player();
-  broadcast_to_room(room, Protocol::TURN(room->current_turn()), {});
+  broadcast_to_room(*room, Protocol::TURN(room->current_turn()), {});
+}
+
+void Server::post(Shard_Message &&msg) {
+  {
+    std::lock_guard<std::mutex> lock(inbox_mutex_);
+    inbox_.push_back(std::move(msg));
+  }
+
+  // wake up the shard
+  uint64_t one = 1;
+  write(inbox_fd_, &one, sizeof(one));
+}
+
+void Server::send_to_shard(int shard, Shard_Message &&msg) {
+  if (!cluster_ || !running_) {
+    return;
+  }
+
+  msg.from_ = shard_;
+  cluster_->post(shard, std::move(msg));
+}
+
+void Server::drain_inbox() {
+  uint64_t count;
+  read(inbox_fd_, &count, sizeof(count)); // must drain
+
+  std::vector<Shard_Message> messages;
+  {
+    std::lock_guard<std::mutex> lock(inbox_mutex_);
+    messages.swap(inbox_);
+  }
+
+  for (auto &m : messages) {
+    handle_shard_message(m);
+  }
+}
+
+void Server::handle_shard_message(Shard_Message &msg) {
+  switch (msg.kind_) {
+  case Shard_Message_Kind::HANDOFF:
+    adopt(msg);
+    break;
+
+  case Shard_Message_Kind::ROOMS_UPDATE:
+    remote_rooms_[msg.from_] = std::move(msg.rooms_);
+    rooms_snapshot_.clear();
+    announce_due_ = true;
+    break;
+
+  case Shard_Message_Kind::NICK_GONE: {
+    // only if the player didn't move meanwhile
+    auto it = away_.find(msg.nick_);
+    if (it != away_.end() && it->second == msg.from_) {
+      away_.erase(it);
+    }
+    break;
+  }
+
+  case Shard_Message_Kind::ACCEPT_PAUSE:
+    // a place may have been freed meanwhile
+    if (count_players() >= max_clients_) {
+      pause_accepting();
+    }
+    break;
+
+  case Shard_Message_Kind::ACCEPT_RESUME:
+    resume_accepting();
+    break;
+  }
+}
+
+void Server::hand_off(Player &p, int shard,
+                      Shard_Message &&msg) {
+  int fd = p.fd();
+  Logger::info(LOG_NET, "{} handed off to reactor {}.", Logger::more(p), shard);
+
+  msg.kind_ = Shard_Message_Kind::HANDOFF;
+
+  // kernel may still write received data into this player or read its
+  // output, so it's passed on only after the in-flight requests complete
+  if (uring_) {
+    unindex_fd(fd);
+    std::erase(unnamed_, &p);
+    std::erase(lobby_, &p);
+    p.location(Player_State::NON_EXISTING);
+    unindex_nick(p);
+    // the player lives on only until handoff, timers must not touch it
+    for (auto kind : {Timer_Kind::PING_DUE, Timer_Kind::PONG_CHECK,
+                      Timer_Kind::RECONNECT_KICK}) {
+      p.timer(kind, 0);
+    }
+
+    auto &c = conn(fd);
+    if (c.receiving_) {
+      uring_->cancel(user_data(OP_RECV, fd, c.gen_),
+                     user_data(OP_CANCEL, fd, c.gen_));
+    }
+    handoffs_.emplace(fd, Pending_Handoff{p.handle(), shard, std::move(msg)});
+    finish_handoff(fd);
+    return;
+  }
+
+  // keep the socket open, only stop watching it here
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr) == -1) {
+    Logger::error(LOG_NET, "Error when removing player from epoll: {}",
+                  std::strerror(errno));
+  }
+  unindex_fd(fd);
+  std::erase(unnamed_, &p);
+  std::erase(lobby_, &p);
+  p.location(Player_State::NON_EXISTING);
+  unindex_nick(p);
+
+  msg.player_ = p.release();
+  free_player(p, true);
+  send_to_shard(shard, std::move(msg));
+}
+
+void Server::adopt(Shard_Message &msg) {
+  int fd = msg.player_.fd_;
+  bool pending_write = !msg.player_.write_queue_.empty();
+
+  if (uring_) {
+    uring_watch(fd);
+  } else if (set_epoll_events(fd, EPOLLIN, true) == -1) {
+    Logger::error(LOG_NET,
+                  "Cannot add handed off client to epoll, closing fd={}", fd);
+    close(fd);
+    clients_->fetch_sub(1, std::memory_order_relaxed);
+    return;
+  }
+
+  auto &p = new_player(fd);
+  auto h = p.handle();
+  p.restore(std::move(msg.player_));
+  if (!p.nick().empty()) {
+    index_nick(p);
+  }
+  start_player_timers(p);
+
+  try {
+    switch (msg.action_) {
+    case Handoff_Action::HANDOFF_NAME:
+      unnamed_.push_back(&p);
+      p.location(Player_State::UNNAMED);
+      resolve_name(p, msg.nick_, msg.token_, msg.hops_);
+      break;
+    case Handoff_Action::HANDOFF_JOIN:
+      lobby_.push_back(&p);
+      p.location(Player_State::LOBBY);
+      join_room(p, msg.room_id_);
+      break;
+    case Handoff_Action::HANDOFF_LOBBY:
+      lobby_.push_back(&p);
+      p.location(Player_State::LOBBY);
+      away_.erase(p.nick());
+      Logger::info(LOG_GAME, "{} returned home to lobby.", Logger::more(p));
+      break;
+    }
+  } catch (const std::exception &ex) {
+    Logger::error(LOG_NET, "{} Error after handoff: {}", Logger::more(p),
+                  ex.what());
+    if (player_slab_.get(h)) {
+      terminate_player(p);
+    }
+    return;
+  }
+
+  // what wasn't sent by previous shard, player may be gone already (moved
+  // on, reconnected as other player)
+  if (pending_write && player_slab_.get(h) && p.valid_fd()) {
+    p.try_flush();
+  }
+
+  // messages which came together with the one causing handoff
+  process_buffered(fd);
+}
+
+void Server::return_home(Player &p) {
+  int home = home_shard(p.nick());
+  if (home == shard_) {
+    return;
+  }
+
+  Shard_Message m;
+  m.action_ = Handoff_Action::HANDOFF_LOBBY;
+  hand_off(p, home, std::move(m));
+}
+
+void Server::notify_gone(Player &p) {
+  if (p.nick().empty()) {
+    return;
+  }
+
+  int home = home_shard(p.nick());
+  if (home == shard_) {
+    return;
+  }
+
+  Shard_Message m;
+  m.kind_ = Shard_Message_Kind::NICK_GONE;
+  m.nick_ = p.nick();
+  send_to_shard(home, std::move(m));
 }
 
-void Server::move_player_by_fd(int fd,
-                               std::vector<std::shared_ptr<Player>> &from,
-                               std::vector<std::shared_ptr<Player>> &to) {
-  move_player([fd](const auto &p) { return p->fd() == fd; }, from, to);
+void Server::publish_rooms() {
+  if (!rooms_dirty_) {
+    return;
+  }
+  rooms_dirty_ = false;
+
+  std::array<int64_t, 3> by_state{};
+  for (const auto &r : rooms_) {
+    by_state[r->state()]++;
+  }
+  for (size_t i = 0; i < by_state.size(); i++) {
+    metrics_.rooms_[i].set(by_state[i]);
+  }
+
+  if (shards() == 1) {
+    return;
+  }
+
+  std::vector<Room_Summary> local;
+  local.reserve(rooms_.size());
+  for (const auto &r : rooms_) {
+    local.push_back({r->id(), r->state()});
+  }
+
+  for (int i = 0; i < shards(); i++) {
+    if (i == shard_) {
+      continue;
+    }
+
+    Shard_Message m;
+    m.kind_ = Shard_Message_Kind::ROOMS_UPDATE;
+    m.rooms_ = local;
+    send_to_shard(i, std::move(m));
+  }
 }
-void Server::move_player_by_nick(const std::string &nick,
-                                 std::vector<std::shared_ptr<Player>> &from,
-                                 std::vector<std::shared_ptr<Player>> &to) {
-  move_player([&nick](const auto &p) { return p->nick() == nick; }, from, to);
+
+void Server::announce_rooms() {
+  if (!announce_due_) {
+    return;
+  }
+  announce_due_ = false;
+
+  // nobody listens, the subscriber to come starts from a fresh list
+  bool any = std::any_of(lobby_.begin(), lobby_.end(),
+                         [](const Player *p) { return p->subscribed(); });
+  if (!any) {
+    return;
+  }
+
+  // both lists are sorted by id, so one pass finds all differences
+  auto now = list_rooms();
+  std::vector<std::string> events;
+  auto a = announced_rooms_.begin();
+  auto n = now.begin();
+  while (a != announced_rooms_.end() || n != now.end()) {
+    if (n == now.end() || (a != announced_rooms_.end() && a->id_ < n->id_)) {
+      events.push_back(Protocol::ROOM_REMOVED(a->id_));
+      a++;
+    } else if (a == announced_rooms_.end() || n->id_ < a->id_) {
+      events.push_back(Protocol::ROOM_ADDED(*n));
+      n++;
+    } else {
+      if (a->state_ != n->state_) {
+        events.push_back(Protocol::ROOM_CHANGED(*n));
+      }
+      a++;
+      n++;
+    }
+  }
+  announced_rooms_ = std::move(now);
+  if (events.empty()) {
+    return;
+  }
+
+  // one buffer for all subscribers, binary one only if somebody needs it
+  std::string text;
+  for (const auto &e : events) {
+    text += e;
+  }
+  auto payload = make_payload(std::move(text));
+  Payload binary;
+
+  for (auto *p : lobby_) {
+    if (!p->subscribed()) {
+      continue;
+    }
+    if (p->binary() && !binary) {
+      std::string frames;
+      for (const auto &e : events) {
+        frames += Protocol::to_binary(e);
+      }
+      binary = make_payload(std::move(frames));
+    }
+    p->append_msg(p->binary() ? binary : payload);
+  }
+  Logger::info(LOG_GAME, "Announced {} room changes.", events.size());
+}
+
+std::vector<Room_Summary> Server::list_rooms() {
+  std::vector<Room_Summary> result;
+  result.reserve(count_rooms());
+
+  for (const auto &r : rooms_) {
+    result.push_back({r->id(), r->state()});
+  }
+  for (const auto &remote : remote_rooms_) {
+    result.insert(result.end(), remote.begin(), remote.end());
+  }
+
+  std::sort(result.begin(), result.end(),
+            [](const auto &a, const auto &b) { return a.id_ < b.id_; });
+  return result;
 }
 
-void Server::broadcast_to_room(std::shared_ptr<Room> r, const std::string &msg,
+bool Server::remote_room_open(int room_id) {
+  int owner = room_shard(room_id);
+  if (owner == shard_ || owner >= static_cast<int>(remote_rooms_.size())) {
+    return false;
+  }
+
+  for (const auto &r : remote_rooms_[owner]) {
+    if (r.id_ == room_id) {
+      return r.state_ == Room_State::OPEN;
+    }
+  }
+  return false;
+}
+
+void Server::broadcast_to_room(Room &r, std::string msg,
                                const std::vector<int> &except_fds) {
+  auto payload = make_payload(std::move(msg));
+  // encoded once, only if some player uses binary protocol
+  Payload binary;
+
   // for every player
-  for (auto &p : r->players()) {
+  for (auto *p : r.players()) {
     // look if isn't in except vector
     auto here = std::find(except_fds.begin(), except_fds.end(), p->fd());
     // isn't => send message
-    if (here == except_fds.end()) {
-      p->append_msg(msg);
+    if (here != except_fds.end()) {
+      continue;
+    }
+    if (!p->binary()) {
+      p->append_msg(payload);
+      continue;
+    }
+    if (!binary) {
+      binary = make_payload(Protocol::to_binary(*payload));
     }
+    p->append_msg(binary);
   }
 }
 
@@ -1,45 +1,169 @@
 #pragma once
 
+#include "cluster.hpp"
+#include "command.hpp"
 #include "config.hpp"
+#include "metrics.hpp"
 #include "room.hpp"
+#include "slab.hpp"
+#include "timer.hpp"
+#include "uring.hpp"
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <deque>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <unordered_map>
 #include <vector>
 
 namespace prsi {
 
-// Handle epoll, own sessions and game manager.
+// Handle epoll (or io_uring), own sessions and game manager.
 class Server {
   friend class Player; // forward declare & befriend
   friend class Protocol;
+  friend struct Server_Bench; // benchmarks set up rooms without sockets
 
 private:
   // epoll
   int epoll_fd_ = -1;
   std::vector<epoll_event> events_;
 
+  // io_uring, only when selected instead of epoll
+  std::unique_ptr<Uring> uring_;
+  // what is the completion about, stored in top byte of user data
+  enum Uring_Op : uint8_t { OP_ACCEPT, OP_RECV, OP_SEND, OP_INBOX, OP_CANCEL };
+  // io_uring state of one socket, index = fd
+  struct Uring_Conn {
+    // bumped when socket leaves this shard, older completions are stale
+    uint32_t gen_ = 0;
+    // multishot recv is armed
+    bool receiving_ = false;
+    // messages read by kernel until send completes, one send at a time keeps
+    // the order of messages
+    bool send_in_flight_ = false;
+    std::vector<Segment> sending_;
+    // where in the first message the send started
+    size_t send_offset_ = 0;
+    std::vector<iovec> iov_;
+    msghdr msg_{};
+  };
+  // deque, so references stay valid when it grows
+  std::deque<Uring_Conn> conns_;
+  // player leaving to other shard, waits for in-flight recv & send
+  struct Pending_Handoff {
+    Handle player_;
+    int shard_;
+    Shard_Message msg_;
+  };
+  std::unordered_map<int, Pending_Handoff> handoffs_;
+  static constexpr unsigned URING_ENTRIES = 1024;
+  static constexpr uint16_t URING_BUFFER_GROUP = 0;
+  static constexpr unsigned URING_BUFFERS = 256; // must be power of 2
+  static constexpr unsigned URING_BUFFER_SIZE = 4096;
+
   // sockets
   int listen_fd_ = -1;
 
   // orchestration
   bool running_ = false;
+  // listen socket isn't watched, the server is full (ADM PAUSE)
+  // NOTE: other shards read it to know whom to wake up when a place frees
+  std::atomic<bool> accept_paused_{false};
+  // generation of the multishot accept, so a cancelled one isn't re-armed
+  uint32_t accept_gen_ = 0;
+
+  // owns, objects don't move & are freed only explicitly
+  Slab<Player> player_slab_;
+  Slab<Room> room_slab_;
+
+  // where the players are, pointers into the slabs above
+  // NOTE: player must be removed from these before it is freed
+  std::vector<Player *> unnamed_;
+  std::vector<Player *> lobby_;
+  std::vector<Room *> rooms_;
+
+  // indexes for O(1) lookup of players owned above
+  // NOTE: entry must be removed whenever the fd is closed
+  // socket fd => player, only for players with valid socket
+  std::vector<Handle> by_fd_;
+  // nick => named player living here, also the ones without socket
+  std::unordered_map<std::string, Handle> by_nick_;
+
+  // clients of the whole cluster (or of this server alone), so players
+  // handed off between shards can't push any of them over MC
+  std::atomic<int> own_clients_{0};
+  std::atomic<int> *clients_ = &own_clients_;
+
+  // timers
+  // all ping/pong/reconnect timers of all players
+  Timer_Wheel timers_;
+  // reused buffer for expired timers
+  std::vector<Timer> expired_;
+  // time of current loop iteration, so it's not read on every use
+  std::chrono::steady_clock::time_point now_;
+
+  // counters & histograms, read by metrics endpoint
+  Shard_Metrics metrics_;
 
-  // owns
-  std::vector<std::shared_ptr<Player>> unnamed_;
-  std::vector<std::shared_ptr<Player>> lobby_;
-  std::vector<std::shared_ptr<Room>> rooms_;
+  // corking
+  // players who got output during this loop iteration, flushed at its end
+  // handles, player may be freed before the flush
+  std::vector<Handle> dirty_;
+
+  // fairness
+  // players whose buffered messages are over the budget of this iteration,
+  // processed at the start of the next one
+  std::vector<Handle> deferred_;
+  // reused buffer for the deferred players being processed
+  std::vector<Handle> resuming_;
+
+  // reactors
+  // all shards & which one is this
+  Cluster *cluster_ = nullptr;
+  int shard_ = 0;
+  // messages from other shards, eventfd in epoll wakes this shard up
+  int inbox_fd_ = -1;
+  std::mutex inbox_mutex_;
+  std::vector<Shard_Message> inbox_;
+  // players having this as home shard, who are in room on other shard
+  std::unordered_map<std::string, int> away_;
+  // how many times can be a connection passed around during NAME
+  static constexpr int MAX_NAME_HOPS = 8;
+  // last known rooms of other shards, index = shard
+  std::vector<std::vector<Room_Summary>> remote_rooms_;
+  // local rooms changed, other shards should be told
+  bool rooms_dirty_ = false;
+  // ROOMS message of local & remote rooms, cleared when any of them changes
+  Snapshot rooms_snapshot_;
+  // rooms as subscribed lobby players know them, sorted by id
+  std::vector<Room_Summary> announced_rooms_;
+  // local or remote rooms changed, subscribers should be told
+  bool announce_due_ = false;
+  // room ids are unique across shards = sequence * shards + shard
+  int next_room_seq_ = 0;
 
 public:
   // initialize member variables
-  Server(const Config &config);
+  // cluster may be null for standalone server
+  Server(const Config &config, Cluster *cluster = nullptr, int shard = 0);
   ~Server();
-  // the main server loop - wait on epoll socket events & handle them
+  // the main server loop - wait on socket events & handle them
   void run();
+  // pass message from other shard, thread-safe
+  void post(Shard_Message &&msg);
+  const Shard_Metrics &metrics() const { return metrics_; }
+  // not accepting until a place frees, thread-safe
+  bool accept_paused() const { return accept_paused_; }
 
   // net
 private:
@@ -51,18 +175,73 @@ private:
   // return -1 on failure
   int set_epoll_events(int fd, uint32_t events, bool creating_new_ev = false);
 
-  // accept new connection
+  // wait on epoll readiness & handle ready sockets
+  void run_epoll();
+  // wait on io_uring completions & handle them
+  void run_uring();
+  // how long can the loop sleep - until the nearest timer
+  int loop_timeout();
+  // expired timers & other work done once per loop iteration
+  void end_iteration();
+  // remember player to be flushed at the end of iteration, once
+  void mark_dirty(Player &p);
+  // flush all output appended during this iteration
+  void flush_dirty();
+
+  // accept waiting connections, at most accept_batch_ of them
   void accept_connection();
+  // register accepted socket & create player for it
+  void admit(int client_fd);
+  // tell the client the server is full & close the socket
+  void reject(int client_fd);
+  // stop & start watching listen socket, connections wait in backlog
+  void pause_accepting();
+  void resume_accepting();
+  // start accept request on listen socket (io_uring)
+  void uring_accept();
   void receive(int fd);
+  // process complete messages already received on fd, at most
+  // message_budget_ of them & only while the player has tokens
+  // player on fd may change meanwhile (reconnect) or leave shard (handoff)
+  void process_buffered(int fd);
+  // take token for the command from bucket of its class, false if empty
+  bool take_token(Player &p, Command cmd);
+  // process messages left over the budget in the previous iteration
+  void resume_deferred();
   // categorize message, do what is appropriate for it
-  void process_message(const std::vector<std::string> &msg,
-                       std::shared_ptr<Player> p);
+  void process_message(Tokens msg, Command cmd, Player &p);
   // try flushing message to the socket
   void server_send(int fd);
   void disconnect(int fd);
 
-  void maybe_ping(std::shared_ptr<Player> p);
-  void check_pong(std::shared_ptr<Player> p);
+  // timer handlers, each of them schedules itself again
+  // send ping if player has socket
+  void maybe_ping(Player &p);
+  // mark player asleep or terminate them, based on last pong
+  void check_pong(Player &p);
+
+  // io_uring
+  static uint64_t user_data(Uring_Op op, int fd, uint32_t gen) {
+    return static_cast<uint64_t>(op) << 56 |
+           static_cast<uint64_t>(gen) << 24 | (fd & 0xFFFFFF);
+  }
+  Uring_Conn &conn(int fd) {
+    if (fd >= static_cast<int>(conns_.size())) {
+      conns_.resize(fd + 1);
+    }
+    return conns_[fd];
+  }
+  void handle_completion(const io_uring_cqe &cqe);
+  void handle_recv(const io_uring_cqe &cqe, int fd, uint32_t gen);
+  void handle_sent(const io_uring_cqe &cqe, int fd, uint32_t gen);
+  // start receiving from the socket
+  void uring_watch(int fd);
+  // stop receiving from the socket, its completions are stale from now on
+  void uring_unwatch(int fd);
+  // submit send of queued messages, unless a send is in flight
+  void uring_send(Player &p);
+  // pass handed off player to other shard, if no I/O is in flight anymore
+  void finish_handoff(int fd);
 
   // friendly functions
   // enable EPOLLOUT for a socket
@@ -77,100 +256,184 @@ private:
   // player in time, then the player is kicked
   void on_socket_lost(int fd);
   // start a timer for given player
-  void start_disconnect_timer(std::shared_ptr<Player> p);
-  // is the FD a timer of player disconnect?
-  bool is_timer_fd(int fd);
-  // kick player out of the server if timer is fired
-  void handle_timer(int tfd);
+  void start_disconnect_timer(Player &p);
+  // cancel the timer of given player, if any is running
+  void stop_disconnect_timer(Player &p);
+  // kick player out of the server if still not reconnected
+  void handle_disconnect_timer(Player &p);
+  // start ping & pong timers of newly connected player
+  void start_player_timers(Player &p);
+  // (re)schedule timer of given kind, replacing the previous one
+  void schedule_timer(Player &p, Timer_Kind kind,
+                      std::chrono::steady_clock::time_point when);
+  // dispatch expired timer to its handler, if it wasn't replaced meanwhile
+  void handle_timer(const Timer &t);
   // remove player from all rooms or lobby, notify
   // others & disconnect player
   // from server
-  void terminate_player(std::shared_ptr<Player> p);
+  void terminate_player(Player &p);
   // remove player from room/lobby + notify others
-  // WARN: it will erase the owning shared_ptr
-  void remove_from_game_server(std::shared_ptr<Player> p);
+  // WARN: player isn't freed, caller must free_player it
+  void remove_from_game_server(Player &p);
   // disconnect client behind FD from server
   void close_connection(int fd);
+  // create player for the socket in the slab
+  Player &new_player(int fd);
+  // release slab slot of player, who must not be in any list anymore
+  // handed off player keeps its place in the client count
+  void free_player(Player &p, bool handed_off = false);
   // broadcast to room with the exception of players with given fds
-  void broadcast_to_room(std::shared_ptr<Room> r, const std::string &msg,
+  // message is shared by all recipients, not copied for each
+  void broadcast_to_room(Room &r, std::string msg,
                          const std::vector<int> &except_fds);
   // do everything what is needed on leaving room - send all messages, notify
   // roommates. if player is not in room, throw
-  void leave_room(std::shared_ptr<Player> p, std::shared_ptr<Room> r);
+  void leave_room(Player &p, Room &r);
+
+  // reactors
+private:
+  // how many shards are there
+  int shards() const { return cluster_ ? cluster_->size() : 1; }
+  int home_shard(const std::string &nick) const {
+    return cluster_ ? cluster_->home_shard(nick) : shard_;
+  }
+  int room_shard(int room_id) const {
+    return cluster_ ? cluster_->room_shard(room_id) : shard_;
+  }
+  void send_to_shard(int shard, Shard_Message &&msg);
+  // handle all messages waiting in inbox
+  void drain_inbox();
+  void handle_shard_message(Shard_Message &msg);
+  // move player with socket to other shard, player must be unnamed or in lobby
+  void hand_off(Player &p, int shard, Shard_Message &&msg);
+  // take over player handed off by other shard
+  void adopt(Shard_Message &msg);
+  // send player in lobby back to its home shard, if not there
+  void return_home(Player &p);
+  // tell home shard that player living here is gone for good
+  void notify_gone(Player &p);
+  // local room was created, removed or changed state
+  void rooms_changed() {
+    rooms_dirty_ = true;
+    announce_due_ = true;
+    rooms_snapshot_.clear();
+  }
+  // let other shards know local rooms, if changed
+  void publish_rooms();
+  // send subscribed lobby players what changed since the last announcement,
+  // events are built once & shared by all of them
+  void announce_rooms();
+  // local & remote rooms, sorted by id
+  std::vector<Room_Summary> list_rooms();
+  // is the room of other shard (as last known) open for joining
+  bool remote_room_open(int room_id);
+  int new_room_id() { return next_room_seq_++ * shards() + shard_; }
 
   // game
 private:
+  // assign nick to unnamed player, or reconnect existing player with that
+  // nick, wherever the player lives
+  void resolve_name(Player &p, const std::string &nick,
+                    const std::string &token, int hops);
+  // move player from lobby to given room, wherever the room lives
+  void join_room(Player &p, int room_id);
   // list all players on the server
-  std::vector<std::shared_ptr<Player>> list_players();
-  // count all players everywhere
-  int count_players() const;
+  std::vector<Player *> list_players();
+  // count all players of all shards, O(1)
+  // NOTE: not relaxed, pausing shard & leaving player must see each other
+  int count_players() const { return clients_->load(); }
+  // take place of new client under MC, false if the server is full
+  bool reserve_client();
   // count all rooms
   int count_rooms() const;
 
-  // find player anywhere on server & return weak ptr to them
-  std::weak_ptr<Player> find_player(int fd);
-  std::weak_ptr<Player> find_player(const std::string &nick);
-  // at which state the player is
-  Player_Location where_player(std::shared_ptr<Player> p);
+  // find player anywhere on server, nullptr if there is none
+  // NOTE: lookups by fd & nick are O(1) using the indexes
+  Player *find_player(int fd);
+  Player *find_player(const std::string &nick);
+  // player of the session token issued here, if the nick matches too
+  Player *find_session(std::string_view token, const std::string &nick);
+  // token for OK NAME, valid while the player lives on this shard
+  std::string session_token(Player &p);
+  // at which state the player is, O(1) - read from the player itself
+  Player_Location where_player(const Player &p);
 
   // handlers
 private:
   // handler for any incoming message
-  using Handler = void (Server::*)(const std::vector<std::string> &,
-                                   std::shared_ptr<Player>);
-  // lookup table
-  // store all handlers for incoming messages
+  using Handler = void (Server::*)(Tokens, Player &);
+  // store all handlers for incoming messages, index = Command
   // all handlers have the capability to terminate player, if invoked
   // incorrectly = bad time / bad syntax
-  static const std::unordered_map<std::string, Handler> handlers_;
+  static const std::array<Handler, CMD_COUNT> handlers_;
 
   // set last pong
-  void handle_pong(const std::vector<std::string> &msg,
-                   std::shared_ptr<Player> p);
-  void handle_name(const std::vector<std::string> &msg,
-                   std::shared_ptr<Player> p);
-  void handle_list_rooms(const std::vector<std::string> &msg,
-                         std::shared_ptr<Player> p);
-  void handle_join_room(const std::vector<std::string> &msg,
-                        std::shared_ptr<Player> p);
-  void handle_create_room(const std::vector<std::string> &msg,
-                          std::shared_ptr<Player> p);
-  void handle_leave_room(const std::vector<std::string> &msg,
-                         std::shared_ptr<Player> p);
-  void handle_room_info(const std::vector<std::string> &msg,
-                        std::shared_ptr<Player> p);
-  void handle_state(const std::vector<std::string> &msg,
-                    std::shared_ptr<Player> p);
-  void handle_play(const std::vector<std::string> &msg,
-                   std::shared_ptr<Player> p);
-  void handle_draw(const std::vector<std::string> &msg,
-                   std::shared_ptr<Player> p);
+  void handle_pong(Tokens msg, Player &p);
+  void handle_name(Tokens msg, Player &p);
+  void handle_list_rooms(Tokens msg, Player &p);
+  void handle_join_room(Tokens msg, Player &p);
+  void handle_create_room(Tokens msg, Player &p);
+  void handle_leave_room(Tokens msg, Player &p);
+  void handle_room_info(Tokens msg, Player &p);
+  void handle_state(Tokens msg, Player &p);
+  void handle_play(Tokens msg, Player &p);
+  void handle_draw(Tokens msg, Player &p);
+  // switch connection to binary protocol, or stay in text
+  void handle_proto(Tokens msg, Player &p);
+  // every OK message is valid, but needs nothing
+  void handle_ok(Tokens msg, Player &p);
+  // send ROOMS & then push its changes until the player leaves lobby
+  void handle_subscribe_rooms(Tokens msg, Player &p);
+  void handle_unknown(Tokens msg, Player &p);
 
   // player manipulation
 private:
-  template <typename Pred>
-  void move_player(Pred pred, std::vector<std::shared_ptr<Player>> &from,
-                   std::vector<std::shared_ptr<Player>> &to) {
-    auto it = std::find_if(from.begin(), from.end(), pred);
+  // by identity, not by fd - player without socket may share stale fd
+  // with another one
+  // location of the player is changed together with the lists
+  void move_player(Player &p, std::vector<Player *> &from,
+                   std::vector<Player *> &to, Player_State state,
+                   Room *room = nullptr) {
+    auto it = std::find(from.begin(), from.end(), &p);
     if (it == from.end()) {
       throw std::runtime_error("Cannot move player - wasn't found.");
     }
-    to.push_back(std::move(*it));
+    to.push_back(*it);
     from.erase(it);
+    p.location(state, room);
   }
 
-  // convenience functions for moving player
-  void move_player_by_fd(int fd, std::vector<std::shared_ptr<Player>> &from,
-                         std::vector<std::shared_ptr<Player>> &to);
-  void move_player_by_nick(const std::string &nick,
-                           std::vector<std::shared_ptr<Player>> &from,
-                           std::vector<std::shared_ptr<Player>> &to);
-
-  // erase from any vector
-  void erase_by_fd(std::vector<std::shared_ptr<Player>> &v, int fd) {
-    v.erase(std::remove_if(v.begin(), v.end(),
-                           [&](auto &sp) { return sp->fd() == fd; }),
-            v.end());
+  // keep fd index in sync, must be called whenever player gets/loses socket
+  void index_fd(int fd, const Player &p) { set_index(fd, p.handle()); }
+  void unindex_fd(int fd) { set_index(fd, Handle()); }
+  // keep nick index in sync, player must be named
+  void index_nick(const Player &p) { by_nick_[p.nick()] = p.handle(); }
+  void unindex_nick(const Player &p) {
+    auto it = by_nick_.find(p.nick());
+    // nick may be taken over by another player object meanwhile
+    if (it != by_nick_.end() && it->second == p.handle()) {
+      by_nick_.erase(it);
+    }
+  }
+  // return player on fd from index or nullptr
+  Player *from_index(int fd) {
+    if (fd < 0 || fd >= static_cast<int>(by_fd_.size())) {
+      return nullptr;
+    }
+    return player_slab_.get(by_fd_[fd]);
+  }
+  void set_index(int fd, Handle h) {
+    if (fd < 0) {
+      return;
+    }
+    // fds are small numbers reused by kernel, so vector is enough
+    if (fd >= static_cast<int>(by_fd_.size())) {
+      if (!h) {
+        return;
+      }
+      by_fd_.resize(fd + 1);
+    }
+    by_fd_[fd] = h;
   }
 
 private:
@@ -189,6 +452,21 @@ private:
   int start_hand_size_ = 4;
   int max_hand_size_ = 9;
   int kick_timer_ms_;
+  Io_Backend io_backend_;
+  bool cork_;
+  bool session_tokens_;
+  int listen_backlog_;
+  int accept_batch_;
+  Admission_Policy admission_;
+  size_t output_soft_limit_;
+  size_t output_hard_limit_;
+  int message_budget_;
+  // token buckets of command classes, burst 0 = no limit
+  struct Class_Rate {
+    std::chrono::steady_clock::duration interval_{};
+    int burst_ = 0;
+  };
+  std::array<Class_Rate, CLASS_COUNT> class_rates_;
 };
 
 } // namespace prsi
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace prsi {
+
+// Reference to object in a slab: slot index & generation of the slot.
+// Generation changes whenever the slot is freed, so handle of a removed
+// object never reaches the object placed into the slot afterwards.
+// Default handle (0) is never valid.
+struct Handle {
+  static constexpr int INDEX_BITS = 20;
+  static constexpr uint32_t INDEX_MASK = (1u << INDEX_BITS) - 1;
+  static constexpr uint32_t GEN_MASK = (1u << (32 - INDEX_BITS)) - 1;
+
+  uint32_t v_ = 0;
+
+  constexpr Handle() {}
+  constexpr Handle(uint32_t index, uint32_t gen)
+      : v_(gen << INDEX_BITS | index) {}
+
+  constexpr uint32_t index() const { return v_ & INDEX_MASK; }
+  constexpr uint32_t gen() const { return v_ >> INDEX_BITS; }
+  constexpr explicit operator bool() const { return v_ != 0; }
+  constexpr bool operator==(const Handle &o) const { return v_ == o.v_; }
+};
+
+// Pool of objects of one type, addressed by generational handles. Slots are
+// created up front & reused, objects never move, so pointers stay valid until
+// the object is erased. Grows past its capacity only if it has to.
+template <typename T> class Slab {
+public:
+  static constexpr size_t MAX_CAPACITY = size_t{Handle::INDEX_MASK} + 1;
+
+  explicit Slab(size_t capacity = 0) { grow(capacity); }
+  // make slots for at least capacity objects
+  void reserve(size_t capacity) { grow(capacity); }
+
+  // throw if all MAX_CAPACITY slots are taken
+  template <typename... Args> Handle emplace(Args &&...args) {
+    if (free_.empty()) {
+      if (slots_.size() == MAX_CAPACITY) {
+        throw std::runtime_error("Slab is full.");
+      }
+      grow(std::max<size_t>(slots_.size() * 2, 16));
+    }
+    uint32_t i = free_.back();
+    free_.pop_back();
+
+    auto &s = slots_[i];
+    s.value_.emplace(std::forward<Args>(args)...);
+    size_++;
+    return Handle(i, s.gen_);
+  }
+
+  // nullptr if the object was erased meanwhile
+  T *get(Handle h) {
+    if (h.index() >= slots_.size()) {
+      return nullptr;
+    }
+    auto &s = slots_[h.index()];
+    return s.gen_ == h.gen() && s.value_ ? &*s.value_ : nullptr;
+  }
+
+  // destroy the object, its handles are stale from now on
+  void erase(Handle h) {
+    if (!get(h)) {
+      return;
+    }
+    auto &s = slots_[h.index()];
+    s.value_.reset();
+    // skip 0, so handle is never null
+    s.gen_ = (s.gen_ + 1) & Handle::GEN_MASK;
+    if (s.gen_ == 0) {
+      s.gen_ = 1;
+    }
+    size_--;
+    free_.push_back(h.index());
+  }
+
+  size_t size() const { return size_; }
+  size_t capacity() const { return slots_.size(); }
+
+private:
+  struct Slot {
+    uint32_t gen_ = 1;
+    std::optional<T> value_;
+  };
+  // deque, so objects don't move when it grows
+  std::deque<Slot> slots_;
+  // indices of empty slots, the last is used first
+  std::vector<uint32_t> free_;
+  size_t size_ = 0;
+
+  void grow(size_t capacity) {
+    capacity = std::min(capacity, MAX_CAPACITY);
+    size_t from = slots_.size();
+    if (capacity <= from) {
+      return;
+    }
+    slots_.resize(capacity);
+    // lower indices are used first
+    for (size_t i = capacity; i > from; i--) {
+      free_.push_back(i - 1);
+    }
+  }
+};
+
+} // namespace prsi
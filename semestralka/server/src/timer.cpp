@@ -0,0 +1,213 @@
+#include "timer.hpp"
+#include <bit>
+#include <limits>
+#include <utility>
+
+namespace prsi {
+
+Timer_Wheel::Timer_Wheel(int tick_ms, Clock::time_point start)
+    : start_(start), tick_(std::chrono::milliseconds(tick_ms)) {}
+
+uint64_t Timer_Wheel::schedule(Clock::time_point when, Timer_Kind kind,
+                               Handle p) {
+  Timer t;
+  t.id_ = next_id_++;
+  t.deadline_ = to_tick(when, true);
+  t.kind_ = kind;
+  t.player_ = p;
+
+  auto id = t.id_;
+  place(std::move(t));
+  size_++;
+
+  return id;
+}
+
+void Timer_Wheel::advance(Clock::time_point now, std::vector<Timer> &expired) {
+  uint64_t target = to_tick(now, false);
+
+  // jump over empty ticks, only stop where some slot has to be processed
+  uint64_t tick;
+  while (next_event_tick(tick) && tick <= target) {
+    if (tick > now_tick_) {
+      now_tick_ = tick;
+
+      // cascade from the top, so lower levels get everything they need
+      for (int level = LEVELS - 1; level > 0; level--) {
+        uint64_t level_mask = (1ull << (SLOT_BITS * level)) - 1;
+        if ((now_tick_ & level_mask) == 0) {
+          cascade(level, (now_tick_ >> (SLOT_BITS * level)) & SLOT_MASK);
+        }
+      }
+
+      // fire the current slot
+      int slot = now_tick_ & SLOT_MASK;
+      auto &timers = slots_[0][slot];
+      for (auto &t : timers) {
+        expired.push_back(std::move(t));
+      }
+      size_ -= timers.size();
+      timers.clear();
+      occupied_[0] &= ~(1ull << slot);
+    }
+
+    // scheduled in the past or cascaded right onto current tick
+    for (auto &t : due_) {
+      expired.push_back(std::move(t));
+    }
+    size_ -= due_.size();
+    due_.clear();
+  }
+
+  if (target > now_tick_) {
+    now_tick_ = target;
+  }
+}
+
+int Timer_Wheel::next_timeout_ms(Clock::time_point now) const {
+  if (!due_.empty()) {
+    return 0;
+  }
+  if (empty()) {
+    return -1;
+  }
+
+  uint64_t best = std::numeric_limits<uint64_t>::max();
+
+  // on level 0 the slot itself says the deadline
+  int dist = first_occupied(0, (now_tick_ + 1) & SLOT_MASK);
+  if (dist != -1) {
+    best = now_tick_ + 1 + dist;
+  }
+
+  // higher levels are sorted by slots, but the slot covers more ticks
+  // so look at the timers in the first non-empty one
+  for (int level = 1; level < LEVELS; level++) {
+    uint64_t block = now_tick_ >> (SLOT_BITS * level);
+    dist = first_occupied(level, (block + 1) & SLOT_MASK);
+    if (dist == -1) {
+      continue;
+    }
+
+    int slot = (block + 1 + dist) & SLOT_MASK;
+    uint64_t begin = (block + 1 + dist) << (SLOT_BITS * level);
+    uint64_t end = begin + (1ull << (SLOT_BITS * level));
+    for (const auto &t : slots_[level][slot]) {
+      // parked far timer, at least the cascade must happen
+      uint64_t at = t.deadline_ < end ? t.deadline_ : begin;
+      best = std::min(best, at);
+    }
+  }
+
+  auto deadline = start_ + tick_ * best;
+  if (deadline <= now) {
+    return 0;
+  }
+
+  // round up, waking before the deadline would be for nothing
+  auto diff = deadline - now;
+  auto ms = std::chrono::ceil<std::chrono::milliseconds>(diff).count();
+  if (ms > std::numeric_limits<int>::max()) {
+    return std::numeric_limits<int>::max();
+  }
+  return static_cast<int>(ms);
+}
+
+void Timer_Wheel::place(Timer &&t) {
+  if (t.deadline_ <= now_tick_) {
+    due_.push_back(std::move(t));
+    return;
+  }
+
+  uint64_t delta = t.deadline_ - now_tick_;
+  uint64_t when = t.deadline_;
+  if (delta > MAX_DELTA) { // too far, will be re-placed on cascade
+    delta = MAX_DELTA;
+    when = now_tick_ + MAX_DELTA;
+  }
+
+  // the lowest level which can hold such distance
+  int level = 0;
+  while (level < LEVELS - 1 && (delta >> (SLOT_BITS * (level + 1))) != 0) {
+    level++;
+  }
+
+  int slot = (when >> (SLOT_BITS * level)) & SLOT_MASK;
+  slots_[level][slot].push_back(std::move(t));
+  occupied_[level] |= 1ull << slot;
+}
+
+void Timer_Wheel::cascade(int level, int slot) {
+  if (!(occupied_[level] & (1ull << slot))) {
+    return;
+  }
+
+  // take them out first, placing may touch the same level
+  std::vector<Timer> timers;
+  timers.swap(slots_[level][slot]);
+  occupied_[level] &= ~(1ull << slot);
+
+  for (auto &t : timers) {
+    place(std::move(t));
+  }
+}
+
+bool Timer_Wheel::next_event_tick(uint64_t &tick) const {
+  if (!due_.empty()) {
+    tick = now_tick_;
+    return true;
+  }
+
+  bool found = false;
+  uint64_t best = std::numeric_limits<uint64_t>::max();
+
+  int dist = first_occupied(0, (now_tick_ + 1) & SLOT_MASK);
+  if (dist != -1) {
+    best = now_tick_ + 1 + dist;
+    found = true;
+  }
+
+  // higher level slot is processed when its block begins
+  for (int level = 1; level < LEVELS; level++) {
+    uint64_t block = now_tick_ >> (SLOT_BITS * level);
+    dist = first_occupied(level, (block + 1) & SLOT_MASK);
+    if (dist == -1) {
+      continue;
+    }
+
+    uint64_t at = (block + 1 + dist) << (SLOT_BITS * level);
+    if (at < best) {
+      best = at;
+    }
+    found = true;
+  }
+
+  tick = best;
+  return found;
+}
+
+int Timer_Wheel::first_occupied(int level, int from) const {
+  uint64_t bits = occupied_[level];
+  if (bits == 0) {
+    return -1;
+  }
+
+  // rotate so `from` is on bit 0
+  return std::countr_zero(std::rotr(bits, from));
+}
+
+uint64_t Timer_Wheel::to_tick(Clock::time_point tp, bool round_up) const {
+  if (tp <= start_) {
+    return 0;
+  }
+
+  auto diff = tp - start_;
+  uint64_t ticks = diff / tick_;
+  if (round_up && diff % tick_ != Clock::duration::zero()) {
+    ticks++;
+  }
+
+  return ticks;
+}
+
+} // namespace prsi
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "slab.hpp"
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace prsi {
+
+// what should happen when the timer expires
+enum Timer_Kind {
+  PING_DUE,       // time to send another PING
+  PONG_CHECK,     // check whether player is asleep/dead
+  RECONNECT_KICK, // grace period after lost socket is over
+  THROTTLE_END,   // rate limited player has a token again
+};
+
+struct Timer {
+  uint64_t id_ = 0;
+  uint64_t deadline_ = 0; // in ticks
+  Timer_Kind kind_;
+  Handle player_;
+};
+
+// Hierarchical timing wheel, all player timers of one server live here.
+// Each level has 64 slots, level L slot covers 64^L ticks. Timers far in the
+// future sit on higher levels and are cascaded down as the time goes, so
+// scheduling & expiring is O(1) and nothing is done for timers not yet due.
+// Cancelling is lazy - owner remembers the id of its live timer and ignores
+// expired timers with other id.
+class Timer_Wheel {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  Timer_Wheel(int tick_ms = 1, Clock::time_point start = Clock::now());
+
+  // schedule timer at given time, return its id (never 0)
+  uint64_t schedule(Clock::time_point when, Timer_Kind kind,
+                    Handle p);
+
+  // move the wheel to now, push all expired timers into expired
+  void advance(Clock::time_point now, std::vector<Timer> &expired);
+
+  // in how many ms the next timer expires, -1 if there is no timer
+  int next_timeout_ms(Clock::time_point now) const;
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+private:
+  static constexpr int SLOT_BITS = 6;
+  static constexpr int SLOTS = 1 << SLOT_BITS;
+  static constexpr int LEVELS = 4;
+  static constexpr uint64_t SLOT_MASK = SLOTS - 1;
+  // timers further than this are parked on the last slot of top level
+  static constexpr uint64_t MAX_DELTA = (1ull << (SLOT_BITS * LEVELS)) - 1;
+
+  Clock::time_point start_;
+  Clock::duration tick_;
+  uint64_t now_tick_ = 0;
+  uint64_t next_id_ = 1;
+  size_t size_ = 0;
+
+  std::array<std::array<std::vector<Timer>, SLOTS>, LEVELS> slots_;
+  // bit i set = slot i on that level is not empty
+  std::array<uint64_t, LEVELS> occupied_{};
+  // already expired when scheduled, returned on next advance
+  std::vector<Timer> due_;
+
+  // put timer to the right level & slot relative to now_tick_
+  void place(Timer &&t);
+  // move all timers from level slot to lower levels
+  void cascade(int level, int slot);
+  // first tick after now_tick_ on which any slot needs to be processed
+  // return false if wheel is empty
+  bool next_event_tick(uint64_t &tick) const;
+  // index of first occupied slot on level, starting from slot `from`
+  // return distance from `from` or -1
+  int first_occupied(int level, int from) const;
+
+  uint64_t to_tick(Clock::time_point tp, bool round_up) const;
+};
+
+} // namespace prsi
@@ -0,0 +1,275 @@
+#include "uring.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace prsi {
+
+Uring::Uring(unsigned entries) {
+  io_uring_params p{};
+  p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER |
+            IORING_SETUP_COOP_TASKRUN;
+  p.cq_entries = entries * 4;
+
+  ring_fd_ = syscall(__NR_io_uring_setup, entries, &p);
+  if (ring_fd_ == -1 && errno == EINVAL) { // older kernel, try without extras
+    p = {};
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+    ring_fd_ = syscall(__NR_io_uring_setup, entries, &p);
+  }
+  if (ring_fd_ == -1) {
+    throw std::runtime_error(std::string("io_uring_setup failed: ") +
+                             std::strerror(errno));
+  }
+  if (!(p.features & IORING_FEAT_EXT_ARG)) {
+    close(ring_fd_);
+    throw std::runtime_error("io_uring without timeout support (EXT_ARG).");
+  }
+
+  // map the rings, newer kernels have both in one mapping
+  sq_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+  }
+
+  sq_ptr_ = mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ptr_ == MAP_FAILED) {
+    close(ring_fd_);
+    throw std::runtime_error("Cannot map io_uring submission queue.");
+  }
+
+  if (single_mmap) {
+    cq_ptr_ = sq_ptr_;
+  } else {
+    cq_ptr_ = mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_ptr_ == MAP_FAILED) {
+      munmap(sq_ptr_, sq_size_);
+      close(ring_fd_);
+      throw std::runtime_error("Cannot map io_uring completion queue.");
+    }
+  }
+
+  auto sq = static_cast<char *>(sq_ptr_);
+  sq_head_ = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+  sq_mask_ = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+  sq_entries_ = p.sq_entries;
+  sqe_tail_ = *sq_tail_;
+
+  auto cq = static_cast<char *>(cq_ptr_);
+  cq_head_ = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+
+  sqes_ = static_cast<io_uring_sqe *>(
+      mmap(nullptr, p.sq_entries * sizeof(io_uring_sqe),
+           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+           IORING_OFF_SQES));
+  if (sqes_ == MAP_FAILED) {
+    if (!single_mmap) {
+      munmap(cq_ptr_, cq_size_);
+    }
+    munmap(sq_ptr_, sq_size_);
+    close(ring_fd_);
+    throw std::runtime_error("Cannot map io_uring submission entries.");
+  }
+}
+
+Uring::~Uring() {
+  munmap(sqes_, sq_entries_ * sizeof(io_uring_sqe));
+  if (cq_ptr_ != sq_ptr_) {
+    munmap(cq_ptr_, cq_size_);
+  }
+  munmap(sq_ptr_, sq_size_);
+  close(ring_fd_);
+}
+
+void Uring::submit_and_wait(int timeout_ms) {
+  flush_recycled();
+  store_release(sq_tail_, sqe_tail_);
+
+  __kernel_timespec ts{};
+  io_uring_getevents_arg arg{};
+  unsigned flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+  if (timeout_ms >= 0) {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1'000'000;
+    arg.ts = reinterpret_cast<uint64_t>(&ts);
+  }
+
+  int ret = enter(to_submit_, 1, flags, &arg, sizeof(arg));
+  if (ret > 0) {
+    to_submit_ -= std::min<unsigned>(ret, to_submit_);
+  }
+
+  // timeout & interrupt are fine, loop just goes on
+  if (ret == -1 && errno != ETIME && errno != EINTR && errno != EAGAIN &&
+      errno != EBUSY) {
+    throw std::runtime_error(std::string("io_uring_enter failed: ") +
+                             std::strerror(errno));
+  }
+}
+
+void Uring::submit() {
+  flush_recycled();
+  store_release(sq_tail_, sqe_tail_);
+
+  while (to_submit_ > 0) {
+    int ret = enter(to_submit_, 0, 0, nullptr, 0);
+    if (ret == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error(std::string("io_uring_enter failed: ") +
+                               std::strerror(errno));
+    }
+    to_submit_ -= std::min<unsigned>(ret, to_submit_);
+  }
+}
+
+void Uring::setup_buffers(uint16_t group, unsigned count, unsigned size) {
+  // NOTE: classic provided buffers, not the ring mapped ones
+  // (IORING_REGISTER_PBUF_RING), which always reported ENOBUFS on some kernels
+  buf_group_ = group;
+  buffer_size_ = size;
+  buffers_.resize(static_cast<size_t>(count) * size);
+  provide_buffers(0, count);
+}
+
+void Uring::provide_buffers(uint16_t id, unsigned count) {
+  auto sqe = next_sqe();
+  sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+  sqe->fd = count;
+  sqe->addr = reinterpret_cast<uint64_t>(buffer(id));
+  sqe->len = buffer_size_;
+  sqe->off = id;
+  sqe->buf_group = buf_group_;
+  sqe->user_data = INTERNAL;
+}
+
+void Uring::flush_recycled() {
+  if (recycled_.empty()) {
+    return;
+  }
+
+  // queueing may submit when the queue is full, which flushes again
+  std::vector<uint16_t> ids;
+  ids.swap(recycled_);
+
+  // buffers are usually returned in the order they were used
+  std::sort(ids.begin(), ids.end());
+  size_t start = 0;
+  for (size_t i = 1; i <= ids.size(); i++) {
+    if (i == ids.size() || ids[i] != ids[i - 1] + 1) {
+      provide_buffers(ids[start], i - start);
+      start = i;
+    }
+  }
+
+  // keep the capacity
+  ids.clear();
+  if (recycled_.empty()) {
+    recycled_.swap(ids);
+  }
+}
+
+void Uring::accept_multishot(int fd, uint64_t user_data) {
+  auto sqe = next_sqe();
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data = user_data;
+}
+
+void Uring::accept(int fd, uint64_t user_data) {
+  auto sqe = next_sqe();
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = fd;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data = user_data;
+}
+
+void Uring::recv_multishot(int fd, uint16_t group, uint64_t user_data) {
+  auto sqe = next_sqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = group;
+  sqe->user_data = user_data;
+}
+
+void Uring::sendmsg(int fd, const msghdr *msg, uint64_t user_data) {
+  auto sqe = next_sqe();
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uint64_t>(msg);
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = user_data;
+}
+
+void Uring::cancel(uint64_t target_user_data, uint64_t user_data) {
+  auto sqe = next_sqe();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = target_user_data;
+  sqe->user_data = user_data;
+}
+
+void Uring::poll_multishot(int fd, uint64_t user_data) {
+  auto sqe = next_sqe();
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = user_data;
+}
+
+io_uring_sqe *Uring::next_sqe() {
+  // full queue, make space
+  if (sqe_tail_ - load_acquire(sq_head_) >= sq_entries_) {
+    submit();
+  }
+
+  unsigned idx = sqe_tail_ & sq_mask_;
+  auto sqe = &sqes_[idx];
+  std::memset(sqe, 0, sizeof(*sqe));
+  sq_array_[idx] = idx;
+
+  sqe_tail_++;
+  to_submit_++;
+  return sqe;
+}
+
+int Uring::enter(unsigned to_submit, unsigned min_complete, unsigned flags,
+                 void *arg, size_t arg_size) {
+  return syscall(__NR_io_uring_enter, ring_fd_, to_submit, min_complete,
+                 flags, arg, arg_size);
+}
+
+unsigned Uring::load_acquire(unsigned *p) {
+  return std::atomic_ref<unsigned>(*p).load(std::memory_order_acquire);
+}
+
+void Uring::store_release(unsigned *p, unsigned v) {
+  std::atomic_ref<unsigned>(*p).store(v, std::memory_order_release);
+}
+
+} // namespace prsi
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#include <vector>
+
+namespace prsi {
+
+// Minimal io_uring wrapper on top of raw syscalls, so no liburing is needed.
+// Not thread-safe, every reactor has its own ring, which can be used only by
+// the thread which created it.
+class Uring {
+public:
+  // entries = size of submission queue, completion queue is 4 times bigger,
+  // because multishot requests post many completions
+  Uring(unsigned entries);
+  ~Uring();
+  // Delete copy/move
+  Uring(const Uring &) = delete;
+  Uring &operator=(const Uring &) = delete;
+
+  // submit queued requests and wait until at least one is completed
+  // -1 = no timeout
+  void submit_and_wait(int timeout_ms);
+  // only submit queued requests
+  void submit();
+
+  // call fn(cqe) for every completion which is ready & consume them
+  template <typename Fn> void for_each_completion(Fn fn) {
+    unsigned head = *cq_head_;
+    while (head != load_acquire(cq_tail_)) {
+      // copy, the handler may submit & the slot can be reused after head moves
+      io_uring_cqe cqe = cqes_[head & cq_mask_];
+      head++;
+      store_release(cq_head_, head);
+      if (cqe.user_data != INTERNAL) {
+        fn(cqe);
+      }
+    }
+  }
+
+  // provided buffers for recv, kernel picks one for each received chunk
+  void setup_buffers(uint16_t group, unsigned count, unsigned size);
+  char *buffer(uint16_t id) { return buffers_.data() + id * buffer_size_; }
+  unsigned buffer_size() const { return buffer_size_; }
+  // give buffer back to kernel after its data were used
+  // returned on next submit, neighbouring buffers in one request
+  void recycle_buffer(uint16_t id) { recycled_.push_back(id); }
+
+  // prepare requests, they are submitted in batch on next submit
+  void accept_multishot(int fd, uint64_t user_data);
+  // single connection, the next one stays in backlog until asked for
+  void accept(int fd, uint64_t user_data);
+  void recv_multishot(int fd, uint16_t group, uint64_t user_data);
+  // msg must stay valid until completion
+  void sendmsg(int fd, const msghdr *msg, uint64_t user_data);
+  void cancel(uint64_t target_user_data, uint64_t user_data);
+  void poll_multishot(int fd, uint64_t user_data);
+
+private:
+  int ring_fd_ = -1;
+
+  // submission queue
+  void *sq_ptr_ = nullptr;
+  size_t sq_size_ = 0;
+  unsigned *sq_head_;
+  unsigned *sq_tail_;
+  unsigned sq_mask_;
+  unsigned *sq_array_;
+  unsigned sq_entries_;
+  io_uring_sqe *sqes_ = nullptr;
+  // local tail, published on submit
+  unsigned sqe_tail_ = 0;
+  // how many entries since last submit
+  unsigned to_submit_ = 0;
+
+  // completion queue
+  void *cq_ptr_ = nullptr;
+  size_t cq_size_ = 0;
+  unsigned *cq_head_;
+  unsigned *cq_tail_;
+  unsigned cq_mask_;
+  io_uring_cqe *cqes_;
+
+  // provided buffers
+  uint16_t buf_group_ = 0;
+  unsigned buffer_size_ = 0;
+  std::vector<char> buffers_;
+  std::vector<uint16_t> recycled_;
+  // user data of requests made by the wrapper itself, not reported
+  static constexpr uint64_t INTERNAL = UINT64_MAX;
+
+  // queue request providing count buffers starting at id
+  void provide_buffers(uint16_t id, unsigned count);
+  // queue all recycled buffers
+  void flush_recycled();
+
+  // get empty submission entry, submit if queue is full
+  io_uring_sqe *next_sqe();
+  int enter(unsigned to_submit, unsigned min_complete, unsigned flags,
+            void *arg, size_t arg_size);
+
+  static unsigned load_acquire(unsigned *p);
+  static void store_release(unsigned *p, unsigned v);
+};
+
+} // namespace prsi